@@ -1,128 +1,793 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h> 
 #include <string.h>
 #include <unistd.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <time.h>
+#include <pthread.h>
 #include "disk_emu.h"
 
+/*Interval between two migrations of the mover thread of a tiered disk*/
+#define TIER_INTERVAL_MS 50
+/*Blocks promoted by a migration at most*/
+#define TIER_MAX_MOVES 32
+/*Accesses a block needs since the last migrations to be promoted*/
+#define TIER_PROMOTE_MIN_HEAT 2
+
+/*Fast image caching the hot blocks of a tiered disk*/
+struct TIER
+{
+    FILE* fp;
+    int num_slots;
+    int policy;
+    /*Block held by each slot of the fast image, -1 if the slot is free*/
+    int* slot_block;
+    /*Slot holding each block of the disk, -1 if the block is only on the slow image*/
+    int* block_slot;
+    /*Set for the slots written since their block was last written to the slow image*/
+    unsigned char* dirty;
+    /*Set for the blocks that never leave the fast image*/
+    unsigned char* pinned;
+    /*Accesses of every block, halved by each migration so older accesses count less*/
+    unsigned int* heat;
+    /*Accesses in progress to each block, a block is not moved while it has some*/
+    int* users;
+    /*Set for the blocks being moved between the images or discarded, accesses to them wait*/
+    unsigned char* moving;
+    disk_tier_stats stats;
+    /*Held while the slots are looked up or changed, not while an image is read or written*/
+    pthread_mutex_t lock;
+    /*Signaled when a block stops moving or its last access ends*/
+    pthread_cond_t moved;
+    pthread_cond_t wake;
+    pthread_t mover;
+    int mover_started;
+    int stopping;
+};
+
+/*An emulated disk, backed by a file*/
+struct DISK
+{
+    FILE* fp;
+    int block_size;
+    int max_block;
+    /*Fast image in front of the file, NULL if the disk is not tiered*/
+    struct TIER* tier;
+};
 
-FILE* fp = NULL;
 double L, p;
 double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
+int MAX_RETRY;
+
+/*Disk of init_fresh_disk and init_disk, used by the calls without a disk*/
+disk_t* default_disk = NULL;
+
+/*------------------------------------------------------------------*/
+/*Tiered disk: the slow image is the file of the disk, it has the   */
+/*latency of the disk. The fast image holds copies of the hot blocks*/
+/*without latency. Every block is on the slow image, a dirty copy on*/
+/*the fast image is newer (write back policy). The lock is held to  */
+/*look up and change the slots, never while an image is read or    */
+/*written: an access counts itself as a user of its block, a block  */
+/*moved or discarded is marked moving and accesses to it wait.      */
+/*------------------------------------------------------------------*/
+
+/*Reads a block of an image at its offset, a block past the end of the file reads as 0's*/
+int image_read_block(FILE* fp, int block_size, int index, void* buffer)
+{
+    if (pread(fileno(fp), buffer, block_size, (off_t) index * block_size) != block_size)
+    {
+        memset(buffer, 0, block_size);
+    }
+    return 0;
+}
+
+/*Writes a block of an image at its offset*/
+int image_write_block(FILE* fp, int block_size, int index, const void* buffer)
+{
+    if (pwrite(fileno(fp), buffer, block_size, (off_t) index * block_size) != block_size)
+    {
+        printf("write error %d\n", index);
+        return -1;
+    }
+    return 0;
+}
+
+/*Deallocates a series of blocks of an image, they read as 0's afterwards*/
+int image_discard_blocks(FILE* fp, int block_size, int start_address, int nblocks)
+{
+    /*Pending writes must reach the file before its range is punched out*/
+    fflush(fp);
+
+    /*Deallocates the range while keeping the size of the file*/
+    if (fallocate(fileno(fp), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t) start_address * block_size, (off_t) nblocks * block_size) == 0)
+    {
+        return nblocks;
+    }
+
+    if (errno != EOPNOTSUPP && errno != ENOSYS)
+    {
+        printf("discard error %d\n", start_address);
+        return -1;
+    }
+
+    /*The host file system can't punch holes, the blocks are still zeroed*/
+    void* blockZero = (void*) calloc(1, block_size);
+    fseek(fp, start_address * block_size, SEEK_SET);
+    for (int i = 0; i < nblocks; ++i)
+    {
+        fwrite(blockZero, block_size, 1, fp);
+    }
+    fflush(fp);
+    free(blockZero);
+    return nblocks;
+}
+
+/*Writes a block to the slow image, after the latency of the disk*/
+int tier_write_slow(disk_t *disk, int block, const void* buffer)
+{
+    usleep(L);
+    return image_write_block(disk->fp, disk->block_size, block, buffer);
+}
+
+/*Set if a block has no access in progress and is not moving, called with the lock held*/
+int tier_idle(struct TIER* tier, int block)
+{
+    return tier->users[block] == 0 && !tier->moving[block];
+}
+
+/*Waits until a block is not moving and counts an access to it, called with the lock held*/
+/*Returns the slot holding the block, -1 if it is only on the slow image*/
+int tier_enter(struct TIER* tier, int block)
+{
+    while (tier->moving[block])
+    {
+        pthread_cond_wait(&tier->moved, &tier->lock);
+    }
+    tier->users[block]++;
+    tier->heat[block]++;
+    return tier->block_slot[block];
+}
+
+/*Ends an access to a block, called with the lock held*/
+void tier_leave(struct TIER* tier, int block)
+{
+    tier->users[block]--;
+    if (tier->users[block] == 0)
+    {
+        pthread_cond_broadcast(&tier->moved);
+    }
+}
+
+/*Finds a free slot, or the slot of the coldest idle block not pinned if it was accessed less than heat times*/
+/*Returns -1 if there is none, called with the lock held*/
+int tier_find_slot(disk_t *disk, unsigned int heat)
+{
+    struct TIER* tier = disk->tier;
+    int victim = -1;
+    for (int slot = 0; slot < tier->num_slots; ++slot)
+    {
+        int block = tier->slot_block[slot];
+        if (block == -1)
+        {
+            return slot;
+        }
+        if (!tier->pinned[block] && tier_idle(tier, block) && tier->heat[block] < heat &&
+            (victim == -1 || tier->heat[block] < tier->heat[tier->slot_block[victim]]))
+        {
+            victim = slot;
+        }
+    }
+    return victim;
+}
+
+/*Copies an idle block of the slow image to a slot, the block the slot held is written to the slow*/
+/*image first if it is dirty. Called with the lock held, it is released while the images are read */
+/*and written: both blocks are marked moving meanwhile. Returns -1 if the block is not promoted    */
+int tier_replace(disk_t *disk, int slot, int block, void* buffer)
+{
+    struct TIER* tier = disk->tier;
+    int old = tier->slot_block[slot];
+    int dirty = old != -1 && tier->dirty[slot];
+    if (old != -1)
+    {
+        tier->moving[old] = 1;
+    }
+    else
+    {
+        /*A free slot is taken now, so it isn't found free again until the block is on it*/
+        tier->slot_block[slot] = block;
+    }
+    tier->moving[block] = 1;
+    pthread_mutex_unlock(&tier->lock);
+
+    int demoted = 0;
+    int promoted = -1;
+    if (dirty)
+    {
+        image_read_block(tier->fp, disk->block_size, slot, buffer);
+        demoted = tier_write_slow(disk, old, buffer);
+    }
+    if (demoted == 0)
+    {
+        image_read_block(disk->fp, disk->block_size, block, buffer);
+        promoted = image_write_block(tier->fp, disk->block_size, slot, buffer);
+    }
+
+    pthread_mutex_lock(&tier->lock);
+    if (old != -1 && demoted == 0)
+    {
+        tier->block_slot[old] = -1;
+        tier->dirty[slot] = 0;
+        tier->stats.writebacks += dirty;
+        tier->stats.demotions++;
+    }
+    if (demoted == 0)
+    {
+        tier->slot_block[slot] = -1;
+    }
+    if (promoted == 0)
+    {
+        tier->slot_block[slot] = block;
+        tier->block_slot[block] = slot;
+        tier->stats.promotions++;
+    }
+    if (old != -1)
+    {
+        tier->moving[old] = 0;
+    }
+    tier->moving[block] = 0;
+    pthread_cond_broadcast(&tier->moved);
+    return promoted;
+}
+
+/*Reads blocks from the fast image when it holds them, from the slow one otherwise*/
+int tier_read_blocks(disk_t *disk, int start_address, int nblocks, void *buffer)
+{
+    struct TIER* tier = disk->tier;
+    int BLOCK_SIZE = disk->block_size;
+
+    for (int i = 0; i < nblocks; ++i)
+    {
+        int block = start_address + i;
+        char* blockRead = (char *)buffer+(i*BLOCK_SIZE);
+
+        pthread_mutex_lock(&tier->lock);
+        int slot = tier_enter(tier, block);
+        if (slot != -1)
+        {
+            tier->stats.hits++;
+        }
+        else
+        {
+            tier->stats.misses++;
+        }
+        pthread_mutex_unlock(&tier->lock);
+
+        if (slot != -1)
+        {
+            image_read_block(tier->fp, BLOCK_SIZE, slot, blockRead);
+        }
+        else
+        {
+            image_read_block(disk->fp, BLOCK_SIZE, block, blockRead);
+        }
+
+        pthread_mutex_lock(&tier->lock);
+        tier_leave(tier, block);
+        pthread_mutex_unlock(&tier->lock);
+    }
+    return nblocks;
+}
+
+/*Writes blocks to the fast image when it holds them, and to the slow one but in write back policy*/
+int tier_write_blocks(disk_t *disk, int start_address, int nblocks, void *buffer)
+{
+    struct TIER* tier = disk->tier;
+    int BLOCK_SIZE = disk->block_size;
+    int s = 0;
+
+    for (int i = 0; i < nblocks; ++i)
+    {
+        int block = start_address + i;
+        char* blockWrite = (char *)buffer+(i*BLOCK_SIZE);
+
+        pthread_mutex_lock(&tier->lock);
+        int slot = tier_enter(tier, block);
+        pthread_mutex_unlock(&tier->lock);
+
+        int r = 0;
+        int slow = slot == -1 || tier->policy != DISK_TIER_WRITEBACK;
+        if (slot != -1)
+        {
+            r = image_write_block(tier->fp, BLOCK_SIZE, slot, blockWrite);
+        }
+        if (r == 0 && slow)
+        {
+            r = tier_write_slow(disk, block, blockWrite);
+        }
+
+        pthread_mutex_lock(&tier->lock);
+        if (r == 0 && !slow)
+        {
+            tier->dirty[slot] = 1;
+        }
+        tier_leave(tier, block);
+        pthread_mutex_unlock(&tier->lock);
+
+        if (r != 0)
+        {
+            break;
+        }
+        s++;
+    }
+    return s == nblocks ? s : -1;
+}
+
+/*Discards blocks of a tiered disk: their copies are dropped from the fast image, a pinned block  */
+/*keeps its slot with 0's in it, and the blocks are punched out of the slow image. They are marked*/
+/*moving until then, so the mover can't promote their old content from the slow image meanwhile  */
+int tier_discard_blocks(disk_t *disk, int start_address, int nblocks)
+{
+    struct TIER* tier = disk->tier;
+    void* blockZero = calloc(1, disk->block_size);
+
+    /*Blocks are taken in order, as by every access, two discards can't wait on each other*/
+    pthread_mutex_lock(&tier->lock);
+    for (int block = start_address; block < start_address + nblocks; ++block)
+    {
+        while (!tier_idle(tier, block))
+        {
+            pthread_cond_wait(&tier->moved, &tier->lock);
+        }
+        tier->moving[block] = 1;
+
+        int slot = tier->block_slot[block];
+        if (slot == -1)
+        {
+            continue;
+        }
+        tier->dirty[slot] = 0;
+        if (!tier->pinned[block])
+        {
+            tier->block_slot[block] = -1;
+            tier->slot_block[slot] = -1;
+        }
+    }
+    pthread_mutex_unlock(&tier->lock);
+
+    /*The slots of the pinned blocks don't change while they are moving*/
+    for (int block = start_address; block < start_address + nblocks; ++block)
+    {
+        if (tier->pinned[block])
+        {
+            image_write_block(tier->fp, disk->block_size, tier->block_slot[block], blockZero);
+        }
+    }
+    int r = image_discard_blocks(disk->fp, disk->block_size, start_address, nblocks);
+
+    pthread_mutex_lock(&tier->lock);
+    for (int block = start_address; block < start_address + nblocks; ++block)
+    {
+        tier->moving[block] = 0;
+    }
+    pthread_cond_broadcast(&tier->moved);
+    pthread_mutex_unlock(&tier->lock);
+    free(blockZero);
+    return r;
+}
+
+/*Writes every dirty block of the fast image to the slow one*/
+int tier_flush(disk_t *disk)
+{
+    struct TIER* tier = disk->tier;
+    void* blockCopy = malloc(disk->block_size);
+    int r = 0;
+
+    pthread_mutex_lock(&tier->lock);
+    for (int slot = 0; slot < tier->num_slots && r == 0; ++slot)
+    {
+        /*A block written meanwhile is written back once its writes are done*/
+        while (tier->dirty[slot] && !tier_idle(tier, tier->slot_block[slot]))
+        {
+            pthread_cond_wait(&tier->moved, &tier->lock);
+        }
+        if (!tier->dirty[slot])
+        {
+            continue;
+        }
+
+        int block = tier->slot_block[slot];
+        tier->moving[block] = 1;
+        pthread_mutex_unlock(&tier->lock);
+        image_read_block(tier->fp, disk->block_size, slot, blockCopy);
+        r = tier_write_slow(disk, block, blockCopy);
+        pthread_mutex_lock(&tier->lock);
+
+        tier->dirty[slot] = r == 0 ? 0 : 1;
+        tier->stats.writebacks += r == 0 ? 1 : 0;
+        tier->moving[block] = 0;
+        pthread_cond_broadcast(&tier->moved);
+    }
+    pthread_mutex_unlock(&tier->lock);
+    free(blockCopy);
+    return r;
+}
+
+/*Mover thread, migrates blocks between the images until the disk is closed*/
+void* tier_mover_main(void* arg)
+{
+    disk_t* disk = (disk_t*) arg;
+    struct TIER* tier = disk->tier;
+
+    pthread_mutex_lock(&tier->lock);
+    while (!tier->stopping)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long) TIER_INTERVAL_MS * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec = deadline.tv_nsec % 1000000000;
+        pthread_cond_timedwait(&tier->wake, &tier->lock, &deadline);
+        if (tier->stopping)
+        {
+            break;
+        }
+
+        pthread_mutex_unlock(&tier->lock);
+        disk_tier_migrate(disk);
+        pthread_mutex_lock(&tier->lock);
+    }
+    pthread_mutex_unlock(&tier->lock);
+    return NULL;
+}
+
+/*Stops the mover thread, writes the dirty blocks to the slow image and closes the fast one*/
+void tier_close(disk_t *disk)
+{
+    struct TIER* tier = disk->tier;
+    if (tier->mover_started)
+    {
+        pthread_mutex_lock(&tier->lock);
+        tier->stopping = 1;
+        pthread_cond_signal(&tier->wake);
+        pthread_mutex_unlock(&tier->lock);
+        pthread_join(tier->mover, NULL);
+    }
+
+    tier_flush(disk);
+    fclose(tier->fp);
+    free(tier->slot_block);
+    free(tier->block_slot);
+    free(tier->dirty);
+    free(tier->pinned);
+    free(tier->heat);
+    free(tier->users);
+    free(tier->moving);
+    pthread_mutex_destroy(&tier->lock);
+    pthread_cond_destroy(&tier->moved);
+    pthread_cond_destroy(&tier->wake);
+    free(tier);
+    disk->tier = NULL;
+}
 
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
 /*----------------------------------------------------------*/
-int close_disk()
+int disk_close(disk_t *disk)
 {
-    if(NULL != fp)
+    if(NULL != disk)
     {
-        fclose(fp);
+        if (disk->tier != NULL)
+        {
+            tier_close(disk);
+        }
+        fclose(disk->fp);
+        free(disk);
     }
     return 0;
 }
 
-/*---------------------------------------*/
-/*Initializes a disk file filled with 0's*/
-/*---------------------------------------*/
-int init_fresh_disk(char *filename, int block_size, int num_blocks)
+/*----------------------------------------------------------------*/
+/*Opens a disk file, a fresh disk is created filled with 0's      */
+/*----------------------------------------------------------------*/
+disk_t* disk_open(char *filename, int block_size, int num_blocks, int fresh)
 {
-    int i, j;
+    disk_t* disk = (disk_t*) malloc(sizeof(disk_t));
+    disk->block_size = block_size;
+    disk->max_block = num_blocks;
+    disk->tier = NULL;
+
+    if (!fresh)
+    {
+        /*Opens a file*/
+        disk->fp = fopen (filename, "r+b");
+
+        if (disk->fp == NULL)
+        {
+            printf("Could not open %s\n\n", filename);
+            free(disk);
+            return NULL;
+        }
+        return disk;
+    }
 
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
     /*Initializes the random number generator*/
     srand((unsigned int)(time( 0 )) );
     /*Creates a new file*/
-    fp = fopen (filename, "w+b");
+    disk->fp = fopen (filename, "w+b");
 
-    if (fp == NULL)
+    if (disk->fp == NULL)
     {
         printf("Could not create new disk file %s\n\n", filename);
-        return -1;
+        free(disk);
+        return NULL;
     }
     
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
+    /*Extends the file to its given size without writing it*/
+    /*The file is sparse: blocks never written read as 0's and take no space on the host*/
+    if (ftruncate(fileno(disk->fp), (off_t) block_size * num_blocks) != 0)
+    {
+        printf("Could not size new disk file %s\n\n", filename);
+        fclose(disk->fp);
+        free(disk);
+        return NULL;
+    }
+    return disk;
+}
+
+/*------------------------------------------------------------------*/
+/*Opens a tiered disk: the disk file is the slow image, a new fast  */
+/*image of cache_blocks blocks is created in front of it. The fast  */
+/*image starts empty, hot blocks are promoted to it in the        */
+/*background. policy is DISK_TIER_WRITETHROUGH or                   */
+/*DISK_TIER_WRITEBACK.                                              */
+/*------------------------------------------------------------------*/
+disk_t* disk_open_tiered(char *filename, char *cache_filename, int block_size, int num_blocks,
+                         int cache_blocks, int policy, int fresh)
+{
+    if (cache_blocks < 1 || (policy != DISK_TIER_WRITETHROUGH && policy != DISK_TIER_WRITEBACK))
+    {
+        return NULL;
+    }
+
+    disk_t* disk = disk_open(filename, block_size, num_blocks, fresh);
+    if (disk == NULL)
     {
-        for (j = 0; j < BLOCK_SIZE; j++)
+        return NULL;
+    }
+
+    struct TIER* tier = (struct TIER*) calloc(1, sizeof(struct TIER));
+    /*Whatever the fast image held is stale, every block is on the slow image once it is closed*/
+    tier->fp = fopen(cache_filename, "w+b");
+    if (tier->fp == NULL || ftruncate(fileno(tier->fp), (off_t) block_size * cache_blocks) != 0)
+    {
+        printf("Could not create cache file %s\n\n", cache_filename);
+        if (tier->fp != NULL)
         {
-            fputc(0, fp);
+            fclose(tier->fp);
         }
+        free(tier);
+        disk_close(disk);
+        return NULL;
     }
-    return 0;
+
+    tier->num_slots = cache_blocks;
+    tier->policy = policy;
+    tier->slot_block = (int*) malloc(cache_blocks * sizeof(int));
+    tier->block_slot = (int*) malloc(num_blocks * sizeof(int));
+    tier->dirty = (unsigned char*) calloc(cache_blocks, 1);
+    tier->pinned = (unsigned char*) calloc(num_blocks, 1);
+    tier->heat = (unsigned int*) calloc(num_blocks, sizeof(unsigned int));
+    tier->users = (int*) calloc(num_blocks, sizeof(int));
+    tier->moving = (unsigned char*) calloc(num_blocks, 1);
+    for (int i = 0; i < cache_blocks; ++i)
+    {
+        tier->slot_block[i] = -1;
+    }
+    for (int i = 0; i < num_blocks; ++i)
+    {
+        tier->block_slot[i] = -1;
+    }
+    pthread_mutex_init(&tier->lock, NULL);
+    pthread_cond_init(&tier->moved, NULL);
+    pthread_cond_init(&tier->wake, NULL);
+    disk->tier = tier;
+
+    /*Without a mover thread, blocks only move with disk_tier_migrate*/
+    tier->mover_started = pthread_create(&tier->mover, NULL, tier_mover_main, disk) == 0;
+    return disk;
 }
-/*----------------------------*/
-/*Initializes an existing disk*/
-/*----------------------------*/
-int init_disk(char *filename, int block_size, int num_blocks)
+
+/*------------------------------------------------------------------*/
+/*Moves the hottest blocks of the slow image to the fast one, the   */
+/*coldest blocks of the fast image make room for them. Then every   */
+/*access count is halved. Returns the number of blocks promoted.  */
+/*------------------------------------------------------------------*/
+int disk_tier_migrate(disk_t *disk)
 {
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
-    /*Opens a file*/
-    fp = fopen (filename, "r+b");
+    struct TIER* tier = disk->tier;
+    if (tier == NULL)
+    {
+        return -1;
+    }
+
+    void* blockCopy = malloc(disk->block_size);
+    int hot[TIER_MAX_MOVES];
+    int num_hot = 0;
+    int moved = 0;
+
+    pthread_mutex_lock(&tier->lock);
+    /*Hottest blocks only on the slow image, hottest first, found in a single pass*/
+    for (int block = 0; block < disk->max_block; ++block)
+    {
+        if (tier->block_slot[block] != -1 || tier->heat[block] < TIER_PROMOTE_MIN_HEAT || !tier_idle(tier, block) ||
+            (num_hot == TIER_MAX_MOVES && tier->heat[block] <= tier->heat[hot[num_hot - 1]]))
+        {
+            continue;
+        }
+        int i = num_hot < TIER_MAX_MOVES ? num_hot++ : num_hot - 1;
+        while (i > 0 && tier->heat[hot[i - 1]] < tier->heat[block])
+        {
+            hot[i] = hot[i - 1];
+            i--;
+        }
+        hot[i] = block;
+    }
+
+    /*The lock is released while each block moves, a block accessed or moved meanwhile is skipped*/
+    for (int i = 0; i < num_hot; ++i)
+    {
+        if (tier->block_slot[hot[i]] != -1 || !tier_idle(tier, hot[i]))
+        {
+            continue;
+        }
+        int slot = tier_find_slot(disk, tier->heat[hot[i]]);
+        if (slot == -1 || tier_replace(disk, slot, hot[i], blockCopy) != 0)
+        {
+            break;
+        }
+        moved++;
+    }
 
-    if (fp == NULL)
+    /*Older accesses count less*/
+    for (int block = 0; block < disk->max_block; ++block)
+    {
+        tier->heat[block] = tier->heat[block] / 2;
+    }
+    pthread_mutex_unlock(&tier->lock);
+
+    free(blockCopy);
+    return moved;
+}
+
+/*------------------------------------------------------------------*/
+/*Pins a series of blocks to the fast image of a tiered disk, they  */
+/*are promoted now and never demoted. Returns the number of blocks  */
+/*pinned, fewer if the fast image is full of pinned blocks.         */
+/*------------------------------------------------------------------*/
+int disk_pin_blocks(disk_t *disk, int start_address, int nblocks)
+{
+    struct TIER* tier = disk->tier;
+    if (tier == NULL || start_address < 0 || start_address + nblocks > disk->max_block)
     {
-        printf("Could not open %s\n\n", filename);
         return -1;
     }
+
+    void* blockCopy = malloc(disk->block_size);
+    int pinned = 0;
+
+    pthread_mutex_lock(&tier->lock);
+    for (int block = start_address; block < start_address + nblocks; ++block)
+    {
+        while (!tier_idle(tier, block))
+        {
+            pthread_cond_wait(&tier->moved, &tier->lock);
+        }
+        if (tier->block_slot[block] == -1)
+        {
+            int slot = tier_find_slot(disk, (unsigned int) -1);
+            if (slot == -1 || tier_replace(disk, slot, block, blockCopy) != 0)
+            {
+                break;
+            }
+        }
+        tier->pinned[block] = 1;
+        pinned++;
+    }
+    pthread_mutex_unlock(&tier->lock);
+
+    free(blockCopy);
+    return pinned;
+}
+
+/*------------------------------------------------------------------*/
+/*Copies the counters of a tiered disk, returns -1 if it is not one */
+/*------------------------------------------------------------------*/
+int disk_get_tier_stats(disk_t *disk, disk_tier_stats *stats)
+{
+    struct TIER* tier = disk->tier;
+    if (tier == NULL)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&tier->lock);
+    *stats = tier->stats;
+    stats->cached_blocks = 0;
+    stats->dirty_blocks = 0;
+    for (int slot = 0; slot < tier->num_slots; ++slot)
+    {
+        stats->cached_blocks += tier->slot_block[slot] != -1 ? 1 : 0;
+        stats->dirty_blocks += tier->dirty[slot];
+    }
+    pthread_mutex_unlock(&tier->lock);
     return 0;
 }
 
 /*-------------------------------------------------------------------*/
 /*Reads a series of blocks from the disk into the buffer             */
 /*-------------------------------------------------------------------*/
-int read_blocks(int start_address, int nblocks, void *buffer)
+int disk_read_blocks(disk_t *disk, int start_address, int nblocks, void *buffer)
 {
     int i, s;
     s = 0;
-
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
+    int BLOCK_SIZE = disk->block_size;
 
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (start_address + nblocks > disk->max_block)
     {
         printf("out of bound error %d\n", start_address);
         return -1;
     }
 
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    if (disk->tier != NULL)
+    {
+        return tier_read_blocks(disk, start_address, nblocks, buffer);
+    }
 
     /*For every block requested*/
+    /*Read at the block offset, so reads from several threads don't share a file position*/
+    /*Blocks are read straight into the buffer, no temporary copy*/
     for (i = 0; i < nblocks; ++i)
     {
         s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-        memcpy((char *)buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
+        char* blockRead = (char *)buffer+(i*BLOCK_SIZE);
+        if (pread(fileno(disk->fp), blockRead, BLOCK_SIZE, (off_t) (start_address + i) * BLOCK_SIZE) != BLOCK_SIZE)
+        {
+            memset(blockRead, 0, BLOCK_SIZE);
+        }
     }
 
-    free(blockRead);
     return s;
 }
 
 /*------------------------------------------------------------------*/
 /*Writes a series of blocks to the disk from the buffer             */
 /*------------------------------------------------------------------*/
-int write_blocks(int start_address, int nblocks, void *buffer)
+int disk_write_blocks(disk_t *disk, int start_address, int nblocks, void *buffer)
 {
     int i, s;
     s = 0;
-
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
+    int BLOCK_SIZE = disk->block_size;
+    FILE* fp = disk->fp;
 
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (start_address + nblocks > disk->max_block)
     {
         printf("out of bound error\n");
         return -1;
     }
 
+    if (disk->tier != NULL)
+    {
+        return tier_write_blocks(disk, start_address, nblocks, buffer);
+    }
+
     /*Goto where the data is to be written on the disk*/        
     fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
 
@@ -132,12 +797,175 @@ int write_blocks(int start_address, int nblocks, void *buffer)
         /*Pause until the latency duration is elapsed*/
         usleep(L);
 
-        memcpy(blockWrite, (char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
-
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
+        fwrite((char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE, 1, fp);
         s++;
     }
-    free(blockWrite);
+    /*The blocks reach the file once, not on stable storage until disk_sync*/
+    fflush(fp);
     return s;
 }
+
+/*------------------------------------------------------------------*/
+/*Discards a series of blocks, their content is lost and they read  */
+/*as 0's afterwards. The space they use is returned to the host.    */
+/*------------------------------------------------------------------*/
+int disk_discard_blocks(disk_t *disk, int start_address, int nblocks)
+{
+    int BLOCK_SIZE = disk->block_size;
+    FILE* fp = disk->fp;
+
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address + nblocks > disk->max_block)
+    {
+        printf("out of bound error\n");
+        return -1;
+    }
+
+    /*Copies on the fast image are dropped as the blocks are punched out, they read as 0's there too*/
+    if (disk->tier != NULL)
+    {
+        return tier_discard_blocks(disk, start_address, nblocks);
+    }
+
+    return image_discard_blocks(fp, BLOCK_SIZE, start_address, nblocks);
+}
+
+/*------------------------------------------------------------------*/
+/*Copies a series of blocks of the disk to other blocks of the disk.*/
+/*The host copies them (copy_file_range), they are not read into a  */
+/*buffer. The two series must not overlap.                          */
+/*------------------------------------------------------------------*/
+int disk_copy_blocks(disk_t *disk, int src_address, int dst_address, int nblocks)
+{
+    int BLOCK_SIZE = disk->block_size;
+    int fd = fileno(disk->fp);
+
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (src_address + nblocks > disk->max_block || dst_address + nblocks > disk->max_block)
+    {
+        printf("out of bound error\n");
+        return -1;
+    }
+
+    /*Blocks of a tiered disk may be on either image, they are copied through a buffer*/
+    if (disk->tier != NULL)
+    {
+        void* blockCopy = malloc(BLOCK_SIZE);
+        for (int i = 0; i < nblocks; ++i)
+        {
+            if (disk_read_blocks(disk, src_address + i, 1, blockCopy) != 1 ||
+                disk_write_blocks(disk, dst_address + i, 1, blockCopy) != 1)
+            {
+                free(blockCopy);
+                return -1;
+            }
+        }
+        free(blockCopy);
+        return nblocks;
+    }
+
+    /*Pause until the latency duration of every block written is elapsed*/
+    for (int i = 0; i < nblocks; ++i)
+    {
+        usleep(L);
+    }
+
+    loff_t src_offset = (loff_t) src_address * BLOCK_SIZE;
+    loff_t dst_offset = (loff_t) dst_address * BLOCK_SIZE;
+    size_t remaining = (size_t) nblocks * BLOCK_SIZE;
+    while (remaining > 0)
+    {
+        ssize_t copied = copy_file_range(fd, &src_offset, fd, &dst_offset, remaining, 0);
+        if (copied <= 0)
+        {
+            break;
+        }
+        remaining -= copied;
+    }
+    if (remaining == 0)
+    {
+        return nblocks;
+    }
+
+    /*The host can't copy the range itself, what is left goes through a buffer*/
+    void* blockCopy = malloc(BLOCK_SIZE);
+    while (remaining > 0)
+    {
+        if (pread(fd, blockCopy, BLOCK_SIZE, src_offset) != BLOCK_SIZE ||
+            pwrite(fd, blockCopy, BLOCK_SIZE, dst_offset) != BLOCK_SIZE)
+        {
+            printf("copy error %d\n", dst_address);
+            free(blockCopy);
+            return -1;
+        }
+        src_offset += BLOCK_SIZE;
+        dst_offset += BLOCK_SIZE;
+        remaining -= BLOCK_SIZE;
+    }
+    free(blockCopy);
+    return nblocks;
+}
+
+/*------------------------------------------------------------------*/
+/*Waits until every block written is on stable storage              */
+/*------------------------------------------------------------------*/
+int disk_sync(disk_t *disk)
+{
+    /*Blocks only written to the fast image are written to the slow one first*/
+    if (disk->tier != NULL && tier_flush(disk) != 0)
+    {
+        printf("sync error\n");
+        return -1;
+    }
+
+    if (fflush(disk->fp) != 0 || fdatasync(fileno(disk->fp)) != 0)
+    {
+        printf("sync error\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Calls on the disk of init_fresh_disk and init_disk                */
+/*------------------------------------------------------------------*/
+int init_fresh_disk(char *filename, int block_size, int num_blocks)
+{
+    disk_close(default_disk);
+    default_disk = disk_open(filename, block_size, num_blocks, 1);
+    return default_disk == NULL ? -1 : 0;
+}
+
+int init_disk(char *filename, int block_size, int num_blocks)
+{
+    disk_close(default_disk);
+    default_disk = disk_open(filename, block_size, num_blocks, 0);
+    return default_disk == NULL ? -1 : 0;
+}
+
+int read_blocks(int start_address, int nblocks, void *buffer)
+{
+    return disk_read_blocks(default_disk, start_address, nblocks, buffer);
+}
+
+int write_blocks(int start_address, int nblocks, void *buffer)
+{
+    return disk_write_blocks(default_disk, start_address, nblocks, buffer);
+}
+
+int discard_blocks(int start_address, int nblocks)
+{
+    return disk_discard_blocks(default_disk, start_address, nblocks);
+}
+
+int sync_disk()
+{
+    return disk_sync(default_disk);
+}
+
+int close_disk()
+{
+    disk_close(default_disk);
+    default_disk = NULL;
+    return 0;
+}
@@ -1,5 +1,47 @@
+/*Handle on an emulated disk, several disks can be open at the same time*/
+typedef struct DISK disk_t;
+
+/*Write policies of a tiered disk*/
+/*Write through: every write reaches the slow image, the fast one only speeds up reads*/
+#define DISK_TIER_WRITETHROUGH 0
+/*Write back: blocks on the fast image are only written there, the slow image gets them when*/
+/*they are demoted, on disk_sync and on disk_close                                           */
+#define DISK_TIER_WRITEBACK 1
+
+/*Counters of a tiered disk*/
+typedef struct DISK_TIER_STATS
+{
+    /*Blocks read from the fast image and from the slow one*/
+    long hits;
+    long misses;
+    long promotions;
+    long demotions;
+    /*Dirty blocks of the fast image written to the slow one*/
+    long writebacks;
+    int cached_blocks;
+    int dirty_blocks;
+} disk_tier_stats;
+
+disk_t* disk_open(char *filename, int block_size, int num_blocks, int fresh);
+int disk_read_blocks(disk_t *disk, int start_address, int nblocks, void *buffer);
+int disk_write_blocks(disk_t *disk, int start_address, int nblocks, void *buffer);
+int disk_discard_blocks(disk_t *disk, int start_address, int nblocks);
+int disk_copy_blocks(disk_t *disk, int src_address, int dst_address, int nblocks);
+int disk_sync(disk_t *disk);
+int disk_close(disk_t *disk);
+
+/*Tiered disk, a fast image caching the hot blocks of the disk file*/
+disk_t* disk_open_tiered(char *filename, char *cache_filename, int block_size, int num_blocks,
+                         int cache_blocks, int policy, int fresh);
+int disk_tier_migrate(disk_t *disk);
+int disk_pin_blocks(disk_t *disk, int start_address, int nblocks);
+int disk_get_tier_stats(disk_t *disk, disk_tier_stats *stats);
+
+/*Calls on a single disk, opened by init_fresh_disk or init_disk*/
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
+int discard_blocks(int start_address, int nblocks);
+int sync_disk();
 int close_disk();
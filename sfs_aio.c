@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "sfs_api.h"
+#include "sfs_aio.h"
+
+// Submission queue, requests waiting for a worker (ring of queue_capacity requests)
+static sfs_aio_request * submissions = NULL;
+static int submission_head = 0;
+static int submission_count = 0;
+// Completion queue, requests done and waiting to be reaped (ring of queue_capacity completions)
+static sfs_aio_completion * completions_queue = NULL;
+static int completion_head = 0;
+static int completion_count = 0;
+static int queue_capacity = 0;
+// Requests submitted and not yet reaped, never more than queue_capacity so the queues can't overflow
+static int in_flight = 0;
+static int stopping = 0;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t submission_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t completion_ready = PTHREAD_COND_INITIALIZER;
+
+static pthread_t * workers = NULL;
+static int num_worker_threads = 0;
+// Readable while the completion queue is not empty
+static int completion_eventfd = -1;
+
+/* Run a request with the synchronous call */
+// The file system of the request serializes it with its other calls
+// Return the value returned by the call
+static int run_request(sfs_aio_request * request)
+{
+    switch(request->opcode)
+    {
+        case SFS_AIO_OPEN:
+            return sfs_fopen_r(request->fs, request->path);
+        case SFS_AIO_CLOSE:
+            return sfs_fclose_r(request->fs, request->fd);
+        case SFS_AIO_READ:
+            return sfs_pread_r(request->fs, request->fd, request->buf, request->length, request->offset);
+        case SFS_AIO_WRITE:
+            return sfs_pwrite_r(request->fs, request->fd, request->buf, request->length, request->offset);
+        case SFS_AIO_MKDIR:
+            return sfs_mkdir_r(request->fs, request->path);
+        case SFS_AIO_FSYNC:
+            return sfs_fsync_r(request->fs, request->fd);
+        default:
+            printf("Unknown asynchronous request %d\n", request->opcode);
+            return -1;
+    }
+}
+
+/* Worker thread, runs requests until the queue is stopped and empty */
+static void * worker_main(void * arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&queue_lock);
+    while(1)
+    {
+        while(submission_count == 0 && !stopping)
+        {
+            pthread_cond_wait(&submission_ready, &queue_lock);
+        }
+        // Requests still queued when stopping are run first
+        if(submission_count == 0)
+        {
+            break;
+        }
+
+        sfs_aio_request request = submissions[submission_head];
+        submission_head = (submission_head + 1) % queue_capacity;
+        submission_count--;
+        pthread_mutex_unlock(&queue_lock);
+
+        int result = run_request(&request);
+
+        pthread_mutex_lock(&queue_lock);
+        int tail = (completion_head + completion_count) % queue_capacity;
+        completions_queue[tail].tag = request.tag;
+        completions_queue[tail].result = result;
+        completion_count++;
+        pthread_cond_broadcast(&completion_ready);
+        eventfd_write(completion_eventfd, 1);
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    return NULL;
+}
+
+int sfs_aio_init(int num_workers, int queue_depth)
+{
+    if(workers != NULL || num_workers < 1 || queue_depth < 1)
+    {
+        return -1;
+    }
+
+    completion_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(completion_eventfd < 0)
+    {
+        return -1;
+    }
+
+    submissions = (sfs_aio_request *) malloc(queue_depth * sizeof(sfs_aio_request));
+    completions_queue = (sfs_aio_completion *) malloc(queue_depth * sizeof(sfs_aio_completion));
+    workers = (pthread_t *) malloc(num_workers * sizeof(pthread_t));
+    queue_capacity = queue_depth;
+    submission_head = 0;
+    submission_count = 0;
+    completion_head = 0;
+    completion_count = 0;
+    in_flight = 0;
+    stopping = 0;
+
+    num_worker_threads = 0;
+    for(int i = 0; i < num_workers; i++)
+    {
+        if(pthread_create(&workers[i], NULL, worker_main, NULL) != 0)
+        {
+            break;
+        }
+        num_worker_threads++;
+    }
+
+    if(num_worker_threads == 0)
+    {
+        sfs_aio_shutdown();
+        return -1;
+    }
+
+    return 0;
+}
+
+int sfs_aio_submit(sfs_aio_request * requests, int num_requests)
+{
+    int submitted = 0;
+
+    pthread_mutex_lock(&queue_lock);
+    while(workers != NULL && !stopping && submitted < num_requests && in_flight < queue_capacity)
+    {
+        int tail = (submission_head + submission_count) % queue_capacity;
+        submissions[tail] = requests[submitted];
+        submission_count++;
+        in_flight++;
+        submitted++;
+    }
+    if(submitted > 0)
+    {
+        pthread_cond_broadcast(&submission_ready);
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    return submitted;
+}
+
+int sfs_aio_reap(sfs_aio_completion * completions, int max_completions, int min_completions)
+{
+    int reaped = 0;
+
+    pthread_mutex_lock(&queue_lock);
+
+    // Can't wait for more completions than requests in flight
+    if(min_completions > in_flight)
+    {
+        min_completions = in_flight;
+    }
+    while(completion_count < min_completions)
+    {
+        pthread_cond_wait(&completion_ready, &queue_lock);
+    }
+
+    while(reaped < max_completions && completion_count > 0)
+    {
+        completions[reaped] = completions_queue[completion_head];
+        completion_head = (completion_head + 1) % queue_capacity;
+        completion_count--;
+        in_flight--;
+        reaped++;
+    }
+
+    // Nothing left to reap, the event file descriptor is no longer readable
+    if(completion_count == 0 && completion_eventfd >= 0)
+    {
+        eventfd_t value;
+        eventfd_read(completion_eventfd, &value);
+    }
+
+    pthread_mutex_unlock(&queue_lock);
+
+    return reaped;
+}
+
+int sfs_aio_eventfd()
+{
+    return completion_eventfd;
+}
+
+void sfs_aio_shutdown()
+{
+    if(workers == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&submission_ready);
+    pthread_mutex_unlock(&queue_lock);
+
+    for(int i = 0; i < num_worker_threads; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+
+    close(completion_eventfd);
+    completion_eventfd = -1;
+    free(workers);
+    workers = NULL;
+    num_worker_threads = 0;
+    free(submissions);
+    submissions = NULL;
+    free(completions_queue);
+    completions_queue = NULL;
+    queue_capacity = 0;
+    in_flight = 0;
+}
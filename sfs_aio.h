@@ -0,0 +1,61 @@
+#ifndef SFS_AIO_H
+#define SFS_AIO_H
+
+#include "sfs_api.h"
+
+// Asynchronous calls to the file system
+// Requests are submitted to a queue and run by a pool of worker threads, the caller
+// reaps their completions later in batches. Requests lock their file system as the
+// calls of sfs_api.h do, so reads of file content run in parallel and requests on
+// different file systems never wait for each other.
+
+// Operations of a request
+#define SFS_AIO_OPEN 0   // sfs_fopen_r(fs, path), creates the file if it does not exist
+#define SFS_AIO_CLOSE 1  // sfs_fclose_r(fs, fd)
+#define SFS_AIO_READ 2   // sfs_pread_r(fs, fd, buf, length, offset)
+#define SFS_AIO_WRITE 3  // sfs_pwrite_r(fs, fd, buf, length, offset)
+#define SFS_AIO_MKDIR 4  // sfs_mkdir_r(fs, path)
+#define SFS_AIO_FSYNC 5  // sfs_fsync_r(fs, fd)
+
+typedef struct SFS_AIO_REQUEST
+{
+    // NULL for the file system of mksfs
+    sfs_t * fs;
+    int opcode;
+    int fd;
+    char * buf;
+    int length;
+    int offset;
+    // Must stay valid until the request completes, as buf
+    char * path;
+    // Returned as is with the completion
+    void * tag;
+} sfs_aio_request;
+
+typedef struct SFS_AIO_COMPLETION
+{
+    void * tag;
+    // Return value of the call
+    int result;
+} sfs_aio_completion;
+
+// Start num_workers threads, at most queue_depth requests can be in flight
+// Return 0 on success, -1 on failure
+int sfs_aio_init(int num_workers, int queue_depth);
+
+// Submit num_requests requests, without waiting for them
+// Return the number of requests queued, fewer if the queue is full
+int sfs_aio_submit(sfs_aio_request * requests, int num_requests);
+
+// Copy up to max_completions completions, waiting until there are at least min_completions
+// Return the number of completions copied
+int sfs_aio_reap(sfs_aio_completion * completions, int max_completions, int min_completions);
+
+// File descriptor that is readable while completions are waiting to be reaped
+int sfs_aio_eventfd();
+
+// Wait for the requests in flight and stop the worker threads
+// Completions that were not reaped are dropped
+void sfs_aio_shutdown();
+
+#endif
@@ -1,1375 +1,7152 @@
 #include <stdio.h>
 #include <stdlib.h> 
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "disk_emu.h" 
 #include "sfs_api.h"
+#include "sfs_lz.h"
+#include "sfs_crc32c.h"
+#include "sfs_pool.h"
 
 
 /*----------------------------------------------------------------------*/
 /*                        Disk structure                                */
 /*                                                                      */
-/*  | 1 |----------16----------|--------------1006--------------| 1 |   */
-/*    ^             ^                           ^                 ^     */
-/* superblock   i-node table               data blocks      free bitmap */
+/*  | 1 |--------32--------|-----------984------------| 1 | 5 | 1 |     */
+/*    ^           ^                      ^              ^   ^   ^       */
+/* superblock i-node table          data blocks         |   |  free     */
+/*                                         reference counts  |  bitmap  */
+/*                                                   checksums          */
 /*----------------------------------------------------------------------*/
+// Blocks of the i node table, and the i nodes they hold
+// Arrays indexed by i node or by table block are sized with these, the const ints below can't size them
+#define NUM_INODE_BLOCKS 32
+#define MAX_INODES (NUM_INODE_BLOCKS * BLOCK_SIZE / sizeof(i_node))
+
 const int super_block_starting_ind = 0;
-const int num_inodes_blcks = 16;
+const int num_inodes_blcks = NUM_INODE_BLOCKS;
 const int i_node_starting_ind = 1;
 const int data_starting_ind = i_node_starting_ind + num_inodes_blcks;
-const int num_data_blcks = NUM_BLOCKS - 1 /*superblock*/ - num_inodes_blcks - 1 /*free bitmap*/;
-const int max_num_inodes = num_inodes_blcks * BLOCK_SIZE/sizeof(i_node);
+const int num_checksum_blcks = 5;
+const int num_data_blcks = NUM_BLOCKS - 1 /*superblock*/ - num_inodes_blcks - 1 /*reference counts*/ - num_checksum_blcks - 1 /*free bitmap*/;
+const int refcount_starting_ind = data_starting_ind + num_data_blcks;
+const int checksum_starting_ind = refcount_starting_ind + 1;
+const int max_num_inodes = MAX_INODES;
 const int num_directptr = 12;
-int dir_entry_per_block = BLOCK_SIZE/sizeof(dir_entry); 
 int inode_per_block = BLOCK_SIZE/sizeof(i_node);
+int indirectptr_per_block = BLOCK_SIZE/sizeof(indirect_ptr);
+// Every checksum block holds the checksums of 255 blocks followed by its own checksum
+int checksum_per_block = BLOCK_SIZE/sizeof(unsigned int) - 1;
 int max_file_size = num_directptr*BLOCK_SIZE + BLOCK_SIZE/sizeof(indirect_ptr) * BLOCK_SIZE;
 
+// Fingerprint index of file data blocks, used to share identical blocks
+#define DEDUP_BUCKETS 4096
+
+// Blocks the write back cache holds before every block in it is written to the disk
+#define WRITEBACK_MAX_BLOCKS 256
+// Free data blocks reserved ahead of a file appended to, so its blocks follow each other on the disk
+#define RESERVE_WINDOW_BLOCKS 16
+// The log of log-structured mode fills the data blocks one segment of this many blocks at a time
+#define SEGMENT_BLOCKS 32
+// Segments with more blocks in use than this free too little space to be worth cleaning
+#define CLEAN_MAX_USED_BLOCKS 24
+// The segment cleaner wakes up this often, and moves up to CLEANER_BUDGET blocks each time
+// while fewer than CLEANER_MIN_FREE_SEGMENTS segments are free
+#define CLEANER_INTERVAL_MS 100
+#define CLEANER_BUDGET 64
+#define CLEANER_MIN_FREE_SEGMENTS 4
+// Levels of internal nodes a directory B+tree can have
+// Far more than needed to index every i node even with one key per internal node
+#define DIR_MAX_DEPTH 16
+
 /*----------------*/
 /* CACHE ELEMENTS */
 /*----------------*/
-// Free bitmap should be initialised with the number of blocks in the disk
-unsigned char * freebitmapCACHE;
-// Our cache will hold the directory contents
-// Size of directory entry is not a factor of Block Size => 
-// There will be internal waste in each block (we will not split directory entry accross multiple blocks)
-// Number of entries per block should be floor of 1024/28 = 36 => real size is 1008 => 16 bytes of internal waste
-// Support 5 directory blocks in the cache => 4*36 = 144 entries
-const int max_cache_directory_entries = 144;
-// Must be hardcoded, compiler does not recognize constant for max_cache_directory_entries
-dir_entry * directoryCACHE[144];
-// Super block cache 
-super_block * superblockCACHE;
-// There are 16 i node blocks and 16 i nodes per block
-// This will hold at most 256 i nodes
-// Must be hardcoded, compiler does not recognize constant for max_num_inodes
-i_node * inodetableCACHE[256];
-
-
-// Open File Descriptor Table
-open_entry * open_fdt[MAX_OPEN_FILE];
-
-int next_file_directory_index = 0;
-
-/* Method to update in the cache and the disk the free bitmap table */
-int update_freebitmap_CACHE_and_DISK(int blockIndex, int flag)
+// Everything known about a mounted file system, one per disk image
+struct SFS_INSTANCE
 {
-    unsigned char * freebitmapCACHE_temp = freebitmapCACHE + blockIndex;
-    if(flag == 1)
+    disk_t * disk;
+    // Free bitmap should be initialised with the number of blocks in the disk
+    unsigned char * freebitmapCACHE;
+    // The free bitmap cache changed since it was last written, it is written once per call
+    int freebitmap_dirty;
+    // Super block cache 
+    super_block * superblockCACHE;
+    // The superblock cache changed since it was last written, it is written once per call
+    int superblock_dirty;
+    // There are 32 i node blocks and 8 i nodes per block
+    // One pointer per i node
+    i_node * inodetableCACHE[MAX_INODES];
+    // CRC32C of every block of the disk, 0 if the block has no checksum (never written or discarded)
+    // The superblock has its own checksum and the checksum blocks check themselves
+    unsigned int * checksumCACHE;
+    // Checksum blocks modified since they were last written
+    int checksum_block_dirty[5];
+    // Checksum verification counters
+    checksum_stats checksumSTATS;
+    // Number of files sharing each data block besides its first owner, 0 if the block is not shared
+    // A shared block is never written in place, the file writing to it gets its own copy
+    unsigned char * refcountCACHE;
+    int refcount_dirty;
+    // A bucket holds the last DATA block index remembered with a fingerprint, -1 if none
+    // Entries are only hints: a block is shared after its content is compared
+    int dedupINDEX[DEDUP_BUCKETS];
+    // Set for the data blocks remembered in the index, cleared when they are freed
+    unsigned char * dedupCANDIDATE;
+
+    // Open File Descriptor Table
+    open_entry * open_fdt[MAX_OPEN_FILE];
+
+    // Index of the next root directory entry returned by sfs_getnextfilename
+    int next_file_directory_index;
+
+    // Freed data blocks are discarded once the metadata of the operation freeing them is on stable storage (online)
+    // Otherwise their space is only returned to the host by sfs_trim
+    int discard_online;
+
+    // Files created while set are compressed
+    int compression_enabled;
+
+    // Full blocks written while set share an identical block already on disk
+    int dedup_enabled;
+
+    // Durability mode given to sfs_mount
+    int durability;
+    // Blocks written and not yet on the disk, NULL if the disk holds the latest content of the block
+    // Only metadata blocks are kept in ordered mode, no block in synchronous mode
+    char * writebackCACHE[NUM_BLOCKS];
+    // I node whose file content each block of the write back cache holds, -1 for metadata
+    int writeback_owner[NUM_BLOCKS];
+    int writeback_count;
+    // Blocks of the write back cache are slots of one allocation, made at mount unless in synchronous mode
+    char * writeback_slots;
+    int writeback_free_slots[WRITEBACK_MAX_BLOCKS];
+    int writeback_num_free_slots;
+    // Runs of adjacent blocks are gathered here to be written with a single request
+    char * writeback_run;
+    // Blocks were written to the disk since it was last synchronized
+    int unsynced_writes;
+    // Freed blocks waiting to be discarded, once the metadata that no longer points to them is on stable storage
+    char discard_pending[NUM_BLOCKS];
+    int num_discard_pending;
+    // I node of the file being written by write_file, owner of the content blocks it writes
+    int writing_inode;
+
+    // Reservation window of every i node: free DATA blocks [start, start + len) kept for the next
+    // blocks appended to the file, len is 0 if the file has no window
+    // Windows are only kept in memory, their blocks stay free on disk
+    int reserve_start[MAX_INODES];
+    int reserve_len[MAX_INODES];
+    // Set for the free data blocks inside a window, other allocations avoid them while they can
+    unsigned char * reservedCACHE;
+
+    // I node sfs_defrag looks at first, where the last call ran out of budget
+    int defrag_next_inode;
+    // Extent compact_free_space is moving over several calls, -1 if none: the len data blocks of the
+    // i node from its block compact_fileblock go to the DATA blocks from compact_target
+    int compact_inode;
+    int compact_fileblock;
+    int compact_target;
+    int compact_len;
+
+    // Blocks are written to the head of the log instead of in place, see sfs_setlogstructured
+    int log_structured;
+    // DATA block the log writes next, blocks are taken from there to the end of its segment
+    int log_head;
+    // Segment cleaner thread, started the first time log-structured mode is set and stopped at unmount
+    pthread_t cleaner;
+    int cleaner_started;
+    int cleaner_stopping;
+    // The cleaner waits on cleaner_wake, signaled when the log moves to another segment
+    pthread_mutex_t cleaner_lock;
+    pthread_cond_t cleaner_wake;
+
+    // Reads of file content at an explicit offset (sfs_pread, sfs_sendfile) share this lock and can run
+    // in parallel, every other call holds it alone, sfs_fread and sfs_readv too as they move the file ptr
+    pthread_rwlock_t lock;
+};
+
+// File system of mksfs, used by the calls without an instance
+sfs_t * default_fs = NULL;
+
+void save_inodetableCACHE_to_DISK(sfs_t * fs, int inodetable_blockIndex);
+void save_superblock(sfs_t * fs);
+void save_freebitmap(sfs_t * fs);
+void save_checksum_blocks(sfs_t * fs);
+int log_allocate_block(sfs_t * fs);
+int in_log_head_segment(sfs_t * fs, int datablock);
+int dir_entry_at(sfs_t * fs, i_node * dir, int n, dir_entry * entry);
+int resolve_path(sfs_t * fs, const char * path, int * parentInodeIndex, char * name);
+
+/* Verify if a buffer only holds zeros */
+int is_zero_buffer(const char * buf, int length)
+{
+    for(int i = 0; i < length; i++)
     {
-        *freebitmapCACHE_temp = '1';
+        if(buf[i] != 0)
+        {
+            return 0;
+        }
     }
-    else if(flag == 0)
+    return 1;
+}
+
+/* Checksum of a block as recorded in the checksum table */
+// 0 means no checksum, a CRC of 0 is recorded as 1
+unsigned int block_checksum(const void * block)
+{
+    unsigned int crc = crc32c(0, block, BLOCK_SIZE);
+    return crc == 0 ? 1 : crc;
+}
+
+/*------------------*/
+/* WRITE BACK CACHE */
+/*------------------*/
+/* Forget the blocks of the write back cache in a range, the disk now holds their latest content */
+void drop_writeback(sfs_t * fs, int start_address, int nblocks)
+{
+    for(int block = start_address; block < start_address + nblocks && block < NUM_BLOCKS; block++)
     {
-        *freebitmapCACHE_temp = '0';
+        if(fs->writebackCACHE[block] != NULL)
+        {
+            fs->writeback_free_slots[fs->writeback_num_free_slots++] = (fs->writebackCACHE[block] - fs->writeback_slots) / BLOCK_SIZE;
+            fs->writebackCACHE[block] = NULL;
+            fs->writeback_count--;
+        }
     }
-    else
+}
+
+/* Forget the pending discards of the blocks in a range, they are written again */
+void cancel_discards(sfs_t * fs, int start_address, int nblocks)
+{
+    for(int block = start_address; block < start_address + nblocks && block < NUM_BLOCKS && fs->num_discard_pending > 0; block++)
     {
-        return -1;
+        if(fs->discard_pending[block])
+        {
+            fs->discard_pending[block] = 0;
+            fs->num_discard_pending--;
+        }
     }
-    write_blocks(NUM_BLOCKS - 1, 1, freebitmapCACHE);
-    return 0;   
 }
 
-void mksfs(int fresh)
+/* Discard the freed blocks waiting for their metadata to reach stable storage */
+// Called once the metadata is written, the disk is synchronized first so a crash never
+// leaves metadata on the disk pointing to a discarded block
+// Every run of adjacent blocks is discarded with a single request to the disk
+void issue_pending_discards(sfs_t * fs)
 {
-    char * filename = "sfs_file";
-
-    char * superblock = (char *) malloc(BLOCK_SIZE);
-    unsigned char * freebitmap = (unsigned char *) malloc(BLOCK_SIZE);
-    
-    if(!fresh)
+    if(fs->num_discard_pending == 0)
     {
-        // Get existing disk
-        init_disk(filename, BLOCK_SIZE, NUM_BLOCKS);
-
-        // Reset the file directory index to the start of the directory
-        next_file_directory_index = 0;
-
-        /*-------------------------*/
-        /* Create superblock cache */
-        /*-------------------------*/
-        // Read superblock from memory
-        char * superblock_disk = (char *) malloc(BLOCK_SIZE);
-        read_blocks(0, 1, superblock_disk);
-        super_block * sb_disk = (super_block *) superblock_disk;
-        super_block * sb_cache = (super_block *) superblock;
-        // Copy disk contents to cache
-        sb_cache->magic = sb_disk->magic;
-        sb_cache->block_size = sb_disk->block_size;
-        sb_cache->file_sys_len = sb_disk->file_sys_len;
-        sb_cache->i_node_len = sb_disk->i_node_len;
-        sb_cache->i_rootdir = sb_disk->i_rootdir;
-        sb_cache->num_inodes = sb_disk->num_inodes; 
-        sb_cache->dir_num_elements = sb_disk->dir_num_elements;
-
-        superblockCACHE = (super_block *) superblock;
-        free(superblock_disk);
-
-        /*--------------------------*/
-        /* Create inode table cache */
-        /*--------------------------*/
-        char * inodetable_disk = (char *) malloc(BLOCK_SIZE);
-        for(int j = 0; j < num_inodes_blcks; j++)
-        {
-            // Copy current inode block from disk
-            read_blocks(i_node_starting_ind + j, 1, inodetable_disk);
-            for(int i = 0; i < inode_per_block; i++)
-            {
-                i_node * in = (i_node *) malloc(sizeof(i_node));
-                in->valid = ((i_node *) (inodetable_disk + i * sizeof(i_node)))->valid;
-                in->num_indirectptr = ((i_node *) (inodetable_disk + i * sizeof(i_node)))->num_indirectptr;
-                in->size = ((i_node *) (inodetable_disk + i * sizeof(i_node)))->size;
-                for(int k = 0; k < num_directptr; k++)
-                {
-                    in->directptr[k] = ((i_node *) (inodetable_disk + i * sizeof(i_node)))->directptr[k];
-                }
-                in->indirectptr = ((i_node *) (inodetable_disk + i * sizeof(i_node)))->indirectptr;
+        return;
+    }
 
-                inodetableCACHE[j*inode_per_block + i] = in;
-            }
-        }
+    if(fs->unsynced_writes)
+    {
+        disk_sync(fs->disk);
+    }
+    fs->unsynced_writes = 1;
 
-        free(inodetable_disk);
-        
-        /*--------------------------*/
-        /* Create freebit map cache */
-        /*--------------------------*/
-        char * freebitmap_disk = (char *) malloc(BLOCK_SIZE);
-        // Copy disk content to cache
-        unsigned char * freebitmap_cache_bit = freebitmap;
-        unsigned char * freebitmap_disk_bit = (unsigned char *) freebitmap_disk;
-        for (int i = 0; i < BLOCK_SIZE; i++)
+    int run_start = -1;
+    for(int block = 0; block <= NUM_BLOCKS; block++)
+    {
+        int pending = block < NUM_BLOCKS && fs->discard_pending[block];
+        if(pending && run_start == -1)
         {
-            *freebitmap_cache_bit = *freebitmap_disk_bit;
-            freebitmap_cache_bit++;
-            freebitmap_disk_bit++;
+            run_start = block;
         }
-
-        freebitmapCACHE = freebitmap;
-        free(freebitmap_disk);
-
-        /*------------------------*/
-        /* Create directory cache */
-        /*------------------------*/
-        char * directory_block_disk = (char *) malloc(BLOCK_SIZE);
-        i_node * dir_inode = inodetableCACHE[superblockCACHE->i_rootdir];
-        int num_dir_entries = dir_inode->size / sizeof(dir_entry);
-        int num_dir_blocks = num_dir_entries / dir_entry_per_block;
-        
-        // Copy all blocks pointed to by the direct pointers of the directory inode
-        for(int i = 0; i < num_dir_blocks && i < num_directptr; i++)
+        else if(!pending && run_start != -1)
         {
-            // Read each direct pointer block
-            read_blocks(data_starting_ind + dir_inode->directptr[i], 1, directory_block_disk);
-            
-            for(int j = 0; j < dir_entry_per_block; j++)
-            {
-                dir_entry * dir_e = (dir_entry *) malloc(sizeof(dir_entry));      
-
-                dir_e->valid = ((dir_entry *) (directory_block_disk + j * sizeof(dir_entry)))->valid;
-                strcpy(dir_e->filename, ((dir_entry *) (directory_block_disk + j * sizeof(dir_entry)))->filename);
-                dir_e->i_node = ((dir_entry *) (directory_block_disk + j * sizeof(dir_entry)))->i_node;
-                
-                
-                directoryCACHE[i * dir_entry_per_block + j] = dir_e;
-            }
+            disk_discard_blocks(fs->disk, run_start, block - run_start);
+            run_start = -1;
         }
-
-        // If there is an indirect pointer block
-        if(dir_inode->indirectptr != -1)
+        if(pending)
         {
-            // Copy all blocks pointed to by the indirect pointers of the directory inode
-            // Get the indirect pointer block
-            char * indirectptr_block_disk = (char *) malloc(BLOCK_SIZE);
-            read_blocks(data_starting_ind + dir_inode->indirectptr, 1, indirectptr_block_disk);
-            
-            // For each pointer in the indirect pointer block, go to their block
-            for(int i = 0; i < (num_dir_blocks - num_directptr) && i < BLOCK_SIZE/sizeof(indirect_ptr); i++)
-            {
-                int datablock_index = ((indirect_ptr *) (indirectptr_block_disk + i * sizeof(indirect_ptr)))->datablockindex;
-                // Read each direct pointer block
-                read_blocks(data_starting_ind + datablock_index, 1, directory_block_disk);
-
-                for(int j = 0; j < dir_entry_per_block; j++)
-                {
-                    dir_entry * dir_e = (dir_entry *) malloc(sizeof(dir_entry));
-                    dir_e->valid = ((dir_entry *) (directory_block_disk + j * sizeof(dir_entry)))->valid;
-                    strcpy(dir_e->filename, ((dir_entry *) (directory_block_disk + j * sizeof(dir_entry)))->filename);
-                    dir_e->i_node = ((dir_entry *) (directory_block_disk + j * sizeof(dir_entry)))->i_node;
-                    directoryCACHE[num_directptr * dir_entry_per_block + i * dir_entry_per_block + j] = dir_e;
-                }
-            }
-
-           free(indirectptr_block_disk);
+            fs->discard_pending[block] = 0;
         }
+    }
+    fs->num_discard_pending = 0;
+}
 
-        free(directory_block_disk);
+/* Write blocks of the write back cache to the disk */
+// Take as argument the i node whose file content is written along with every metadata block,
+// -1 for the metadata blocks only, -2 for every block
+// Every run of adjacent blocks is written with a single request to the disk
+// The superblock and the free bitmap modified since the last flush are saved first, then the checksum
+// blocks are written, so in ordered mode they reach stable storage along with the file content,
+// ahead of the metadata they check
+// Freed blocks are discarded last, every metadata block is written by then
+void flush_writeback(sfs_t * fs, int owner)
+{
+    if(fs->superblock_dirty)
+    {
+        save_superblock(fs);
     }
-    else 
+    save_freebitmap(fs);
+    save_checksum_blocks(fs);
+    if(fs->writeback_count == 0)
     {
-        /*-----------------*/
-        /* Create new disk */
-        /*-----------------*/
-        init_fresh_disk(filename, BLOCK_SIZE, NUM_BLOCKS);
-
-        /*-------------------*/
-        /* Create superblock */
-        /*-------------------*/
-        super_block * sb = (super_block *) superblock;
-        sb->magic = (int) 0xACBD0005;
-        sb->block_size = BLOCK_SIZE;
-        sb->file_sys_len = NUM_BLOCKS;
-        sb->i_node_len = 64;
-        sb->i_rootdir = 0;
-        sb->num_inodes = 1; // Start at 1 because we have the directory i node
-        sb->dir_num_elements = 0;  // Start with 0 elements in the directory
-
-        // The super block is the first block of the disk
-        write_blocks(0, 1, superblock);
-        // Update the cache to reflect the current state of the super block
-        superblockCACHE = (super_block *) superblock;
-
-        /*-------------------------*/
-        /* Create Directory I Node */
-        /*-------------------------*/
-        // Create the i node for the directory, size should be 64 bytes
-        char * i_node_rootdir = (char *) malloc(sizeof(i_node));
-        i_node * in = (i_node *) i_node_rootdir;
-        in->valid = 1; 
-        in->num_indirectptr = 0;
-        // Directory starts by being empty, No directory entries to start with
-        in->size = 0;
-        // Initialize unused pointers at -1
-        for(int i = 0; i < num_directptr; i++)
-        {
-            in->directptr[i] = -1;
-        }
-        in->indirectptr = -1;
+        issue_pending_discards(fs);
+        return;
+    }
 
-        // Write directory i node to i node table
-        write_blocks(i_node_starting_ind, 1, i_node_rootdir);
+    // Ordered mode: the file content metadata points to is on stable storage before the metadata
+    if(fs->durability == SFS_DURABILITY_ORDERED && fs->unsynced_writes)
+    {
+        disk_sync(fs->disk);
+        fs->unsynced_writes = 0;
+    }
 
-        // Start i node table cache 
-        // There will be 256 i nodes at most in the cache
-        inodetableCACHE[0] = (i_node *) i_node_rootdir;
-        // Initialize every other inode element in the cache table to invalid
-        for(int i = 1; i < max_num_inodes; i++)
+    char * run = fs->writeback_run;
+    int run_start = 0;
+    int run_len = 0;
+    for(int block = 0; block <= NUM_BLOCKS; block++)
+    {
+        int selected = block < NUM_BLOCKS && fs->writebackCACHE[block] != NULL &&
+                       (owner == -2 || fs->writeback_owner[block] == -1 || fs->writeback_owner[block] == owner);
+        if(selected)
         {
-            i_node * in = (i_node *) malloc(sizeof(i_node));
-            in->valid = 0;
-            in->num_indirectptr = 0;
-            in->size = 0;
-            for(int j = 0; j < num_directptr; j++)
+            if(run_len == 0)
             {
-                in->directptr[j] = -1;
+                run_start = block;
             }
-            in->indirectptr = -1;
-
-            inodetableCACHE[i] = in;
+            memcpy(run + run_len * BLOCK_SIZE, fs->writebackCACHE[block], BLOCK_SIZE);
+            run_len++;
         }
-
-        /*--------------------*/
-        /* Create free bitmap */
-        /*--------------------*/
-        // Size is number of blocks in disk (will fit in 1 block)
-        unsigned char * freebitmaptemp = freebitmap;
-        // Initialize to 1 every block (FREE)
-        for (int i = 0; i < BLOCK_SIZE; i++)
+        else if(run_len > 0)
         {
-            *freebitmaptemp = '1';
-            freebitmaptemp++;
+            disk_write_blocks(fs->disk, run_start, run_len, run);
+            drop_writeback(fs, run_start, run_len);
+            fs->unsynced_writes = 1;
+            run_len = 0;
         }
-        // Unfree superblock
-        freebitmaptemp = freebitmap;
-        *freebitmaptemp = '0';
+    }
 
-        // Unfree first i node block
-        freebitmaptemp = freebitmap + i_node_starting_ind;
-        *freebitmaptemp = '0';
+    issue_pending_discards(fs);
+}
 
-        // Unfree bitmap block
-        freebitmaptemp = freebitmap + NUM_BLOCKS - 1;
-        *freebitmaptemp = '0';
+/* Write blocks to the disk, or keep them in the write back cache if the durability mode allows it */
+// Take as argument the i node whose file content the blocks hold, -1 for metadata
+// Return the number of blocks written, -1 on failure
+int buffered_write_blocks(sfs_t * fs, int start_address, int nblocks, void * buffer, int owner)
+{
+    // A freed block taken again must not be discarded after its new content is written
+    cancel_discards(fs, start_address, nblocks);
 
-        // Write free bitmap at last block in disk
-        write_blocks(NUM_BLOCKS - 1, 1, freebitmap);
-        // Update the cache to reflect the current state of the freebitmap
-        freebitmapCACHE = freebitmap;
-        
-       // Initialize directory entry cache
-        for(int i = 0; i < max_cache_directory_entries; i++)
+    int cached = fs->durability == SFS_DURABILITY_WRITEBACK ||
+                 (fs->durability == SFS_DURABILITY_ORDERED && owner == -1);
+    if(!cached)
+    {
+        // An older copy in the cache must not be written over this one
+        drop_writeback(fs, start_address, nblocks);
+        fs->unsynced_writes = 1;
+        return disk_write_blocks(fs->disk, start_address, nblocks, buffer);
+    }
+
+    if(start_address < 0 || start_address + nblocks > NUM_BLOCKS)
+    {
+        return -1;
+    }
+
+    for(int i = 0; i < nblocks; i++)
+    {
+        int block = start_address + i;
+        if(fs->writebackCACHE[block] == NULL)
         {
-            dir_entry * dir_e = (dir_entry *) malloc(sizeof(dir_entry));
-            dir_e->valid = 0;
-            dir_e->filename[0] = '\0';
-            directoryCACHE[i] = dir_e;
+            // Every slot is taken, the cache is written to the disk to make room
+            if(fs->writeback_num_free_slots == 0)
+            {
+                flush_writeback(fs, -2);
+            }
+            int slot = fs->writeback_free_slots[--fs->writeback_num_free_slots];
+            fs->writebackCACHE[block] = fs->writeback_slots + slot * BLOCK_SIZE;
+            fs->writeback_count++;
         }
+        memcpy(fs->writebackCACHE[block], (char *) buffer + i*BLOCK_SIZE, BLOCK_SIZE);
+        fs->writeback_owner[block] = owner;
     }
 
-    // We will have a new fdt even if we import an existing file system as it resides in the program memory
-    // Set every element of the open fdt at invalid so that we can override any element in the table
-    for(int i = 0; i < MAX_OPEN_FILE; i++)
+    if(fs->writeback_count >= WRITEBACK_MAX_BLOCKS)
     {
-        open_entry * open_e = (open_entry *) malloc(sizeof(open_entry));
-        open_e->valid = 0;
-        open_fdt[i] = open_e;
+        flush_writeback(fs, -2);
     }
+
+    return nblocks;
 }
 
-int sfs_getnextfilename(char* fname)
+/* Read blocks from the write back cache, or from the disk if they are not in it */
+int buffered_read_blocks(sfs_t * fs, int start_address, int nblocks, void * buffer)
 {
-    int count = -1;
+    int r = disk_read_blocks(fs->disk, start_address, nblocks, buffer);
+    if(r < 0 || fs->writeback_count == 0)
+    {
+        return r;
+    }
 
-    int i = -1;
-    while(count < next_file_directory_index && i < (max_cache_directory_entries - 1))
+    for(int i = 0; i < nblocks; i++)
     {
-        i++;
-        if(directoryCACHE[i]->valid)
+        if(fs->writebackCACHE[start_address + i] != NULL)
         {
-            count++;
+            memcpy((char *) buffer + i*BLOCK_SIZE, fs->writebackCACHE[start_address + i], BLOCK_SIZE);
         }
     }
+    return r;
+}
 
-    if(count == next_file_directory_index)
+/* Bring the blocks of a file and every metadata block to stable storage */
+// Take as argument the i node of the file, -2 for every file
+// Return 0 on success, -1 if the disk could not be synchronized
+int sync_blocks(sfs_t * fs, int owner)
+{
+    flush_writeback(fs, owner);
+    if(!fs->unsynced_writes)
     {
-        memcpy(fname, directoryCACHE[i]->filename, MAX_FILENAME_LEN);
-        next_file_directory_index++;
-        return 1;
+        return 0;
     }
 
-    return 0;
+    fs->unsynced_writes = 0;
+    return disk_sync(fs->disk);
 }
 
-int sfs_getfilesize(const char* path)
+/* Discard blocks on the disk along with their copy in the write back cache */
+// A block freed since the last flush may still be pointed to by the metadata on the disk,
+// the write back cache is synchronized first
+int buffered_discard_blocks(sfs_t * fs, int start_address, int nblocks)
 {
-    for(int i = 0; i < max_cache_directory_entries; i++)
+    for(int block = start_address; block < start_address + nblocks && fs->num_discard_pending > 0; block++)
     {
-        dir_entry * direntry = directoryCACHE[i];
-        if(direntry->valid)
+        if(block >= 0 && block < NUM_BLOCKS && fs->discard_pending[block])
         {
-            // If it is the file we are looking for
-            if(strcmp(direntry->filename, path) == 0)
-            {
-                // Find the associated inode 
-                if(inodetableCACHE[direntry->i_node]->valid)
-                {
-                    // Return the size of the file stored in the file inode
-                    return inodetableCACHE[direntry->i_node]->size;
-                }
-                else
-                {
-                    printf("Invalid inode for the fdt\n");
-                    return -1;
-                }
-                
-            }
+            sync_blocks(fs, -2);
         }
     }
+    drop_writeback(fs, start_address, nblocks);
+    fs->unsynced_writes = 1;
+    return disk_discard_blocks(fs->disk, start_address, nblocks);
+}
 
-    // Return -1 in case of file not found
-    return -1;
+/* End of a call changing the file system */
+// In synchronous mode the changes reach stable storage before the call returns
+void finish_call(sfs_t * fs)
+{
+    if(fs->durability == SFS_DURABILITY_SYNC)
+    {
+        sync_blocks(fs, -2);
+    }
 }
 
-/* Find a random free block in the data blocks using the free bitmap */
-// Return DATA BLOCK index (need be added to starting data block index) on sucess
-// Return -1 if no more free data blocks
-// Take as argument an update free bitmap flag, set to 1 will update the freebitmap in cache and disk
-int find_free_data_block(int updateFreebitmap)
+/* Write the superblock to disk with its checksum */
+// Changes to the superblock only set superblock_dirty, it is written here when the write back cache is flushed
+void save_superblock(sfs_t * fs)
 {
-    // Look at free bitmap from disk 
-    // We want to look at the data blocks in the range [data_starting_ind, index_last_data_block]
-    int data_last_ind = NUM_BLOCKS - 1;
-    int total_data_blocks = data_last_ind - data_starting_ind;
-    // Randomize starting index to verify in the data blocks 
-    int data_index = rand() % (total_data_blocks);
+    fs->superblock_dirty = 0;
+    fs->superblockCACHE->checksum = 0;
+    fs->superblockCACHE->checksum = crc32c(0, fs->superblockCACHE, sizeof(super_block));
+    buffered_write_blocks(fs, super_block_starting_ind, 1, (char *) fs->superblockCACHE, -1);
+}
 
-    for(int i = 0; i < total_data_blocks; i++)
+/* Write the checksum blocks modified since they were last written */
+// The checksum table in memory is their cache, they are written to the disk directly
+// once per call, when the write back cache is flushed
+void save_checksum_blocks(sfs_t * fs)
+{
+    char * checksum_block = NULL;
+
+    for(int j = 0; j < num_checksum_blcks; j++)
     {
-        if(*(freebitmapCACHE + (data_index % total_data_blocks)) == '1')
+        if(!fs->checksum_block_dirty[j])
         {
-            if(updateFreebitmap)
-            {
-                // Make bit unvailable
-                update_freebitmap_CACHE_and_DISK(data_starting_ind + data_index, 0);        
-            }
-            
-            return data_index;
+            continue;
         }
-        else 
+        if(checksum_block == NULL)
         {
-            data_index += 1;
+            checksum_block = (char *) pool_get_buffer();
         }
-    }
-    
-    // No more free data blocks
-    return -1;
-}
-
-/* Save the current inode table cache to the disk */
-// Take as argument the modified block index to save
-void save_inodetableCACHE_to_DISK(int inodetable_blockIndex)
-{
-    // Copy the contents of the block in byte structure
-    char * inode_block = (char *) malloc(BLOCK_SIZE);
 
-    // Copy every inode of the block to be updated
-    for(int i = 0; i < inode_per_block; i++)
-    {
-        char * inode_block_temp = inode_block + i*sizeof(i_node);
-        
-        // Source
-        i_node * incache = inodetableCACHE[inodetable_blockIndex*inode_per_block + i]; 
-        
-        // Target
-        i_node * indisk = (i_node *) inode_block_temp;
-        indisk->valid = incache->valid;
-        indisk->size = incache->size;
-        indisk->num_indirectptr = incache->num_indirectptr;
-        for(int j = 0; j < num_directptr; j++)
+        unsigned int * entries = (unsigned int *) checksum_block;
+        for(int i = 0; i < checksum_per_block; i++)
         {
-            indisk->directptr[j] = incache->directptr[j];
+            int block = j*checksum_per_block + i;
+            entries[i] = block < NUM_BLOCKS ? fs->checksumCACHE[block] : 0;
         }
-        indisk->indirectptr = incache->indirectptr;
+        entries[checksum_per_block] = crc32c(0, checksum_block, checksum_per_block * sizeof(unsigned int));
+
+        disk_write_blocks(fs->disk, checksum_starting_ind + j, 1, checksum_block);
+        fs->unsynced_writes = 1;
+        fs->checksum_block_dirty[j] = 0;
     }
-    write_blocks(i_node_starting_ind + inodetable_blockIndex, 1, inode_block);
-    free(inode_block);
-    
-    // Verify if it is a new block in the free bitmap cache 
-    // If the bit is set to '1', this block was free => update the block to be unavailable
-    if(*(freebitmapCACHE + i_node_starting_ind + inodetable_blockIndex) == '1')
-    {    
-        update_freebitmap_CACHE_and_DISK(i_node_starting_ind + inodetable_blockIndex, 0);
+
+    if(checksum_block != NULL)
+    {
+        pool_put_buffer(checksum_block);
     }
 }
 
-
-void save_directoryCACHE_to_DISK(int dirIndex)
+/* Read the checksum table from disk */
+// A checksum block never written (all zeros) is valid and holds no checksum
+void load_checksum_table(sfs_t * fs)
 {
-    // Represents the block of data of directory to be copied to disk
-    int blockIndex = dirIndex/dir_entry_per_block;
-    // Copy the contents of the block in byte structure
-    char * directory_block = (char *) malloc(BLOCK_SIZE);
+    char * checksum_block = (char *) pool_get_buffer();
 
-    // Actual block to write to memory
-    int dirBlock;
-
-    // Copy every directory entry of the block to be updated
-    for(int i = 0; i < dir_entry_per_block; i++)
+    for(int j = 0; j < num_checksum_blcks; j++)
     {
-        char * dir_block_temp = directory_block + i*sizeof(dir_entry);
-        // Source
-        dir_entry * dir_entry_cache = directoryCACHE[blockIndex*dir_entry_per_block + i]; 
-        
-        // Target
-        dir_entry * dir_entry_disk = (dir_entry *) dir_block_temp;
+        disk_read_blocks(fs->disk, checksum_starting_ind + j, 1, checksum_block);
+        unsigned int * entries = (unsigned int *) checksum_block;
 
-        // Copy from cache to disk
-        dir_entry_disk->valid = dir_entry_cache->valid;
-        strcpy(dir_entry_disk->filename, dir_entry_cache->filename);
-        dir_entry_disk->i_node = dir_entry_cache->i_node;
-    }
+        if(!is_zero_buffer(checksum_block, BLOCK_SIZE) &&
+           entries[checksum_per_block] != crc32c(0, checksum_block, checksum_per_block * sizeof(unsigned int)))
+        {
+            // Nothing in this block can be trusted, its blocks are not verified
+            printf("Checksum mismatch on block %d\n", checksum_starting_ind + j);
+            fs->checksumSTATS.metadata_mismatches++;
+            memset(checksum_block, 0, BLOCK_SIZE);
+        }
 
-    // Find the data block in memory for the inodetable_datablockIndex
-    // If first 12 blocks, it will be the index of the directptr
-    if(blockIndex < num_directptr)
-    {
-        dirBlock = inodetableCACHE[superblockCACHE->i_rootdir]->directptr[blockIndex];
-    }
-    // It is an indirect pointer, must read the indirectptr block
-    else
-    {
-        char * indirectptr = (char *) malloc(BLOCK_SIZE);
-        int indirectptrblock = data_starting_ind + inodetableCACHE[superblockCACHE->i_rootdir]->indirectptr;
-        read_blocks(indirectptrblock, 1, indirectptr);
-        
-        indirect_ptr * indptr = (indirect_ptr *) (indirectptr + (blockIndex - num_directptr) * sizeof(indirect_ptr));
-        dirBlock = indptr->datablockindex;
-        free(indirectptr);
+        for(int i = 0; i < checksum_per_block && j*checksum_per_block + i < NUM_BLOCKS; i++)
+        {
+            fs->checksumCACHE[j*checksum_per_block + i] = entries[i];
+        }
+        fs->checksum_block_dirty[j] = 0;
     }
 
-    write_blocks(data_starting_ind + dirBlock, 1, directory_block);
-    free(directory_block);
+    pool_put_buffer(checksum_block);
+}
 
-    // Verify if it is a new block in the free bitmap cache 
-    // If the bit is set to '1', this block was free => update the block to be unavailable
-    if(*(freebitmapCACHE + data_starting_ind + blockIndex) == '1')
+/* Read blocks from the disk and verify them against their checksum */
+// Return the number of blocks read, -1 if the disk read failed or a block does not match its checksum
+int fs_read_blocks(sfs_t * fs, int start_address, int nblocks, void * buffer)
+{
+    int r = buffered_read_blocks(fs, start_address, nblocks, buffer);
+    if(r < 0)
     {
-        update_freebitmap_CACHE_and_DISK(data_starting_ind + dirBlock, 0);
-    }
-}
-
-/* Save a new data block to the corresponding i node entry*/
-// Update the cache and the disk of the inode
-// Return 0 on success, -1 on failure
-int add_data_block_to_inode(int datablockIndex, int inodeIndex)
-{
-    char * block = (char *) malloc(BLOCK_SIZE);
-    int indirectptr_block;
-
-    if(inodeIndex >= max_num_inodes || inodeIndex < 0)
-    {
-        printf("Out of bound inodeIndex %d\n", inodeIndex);
-        return -1;
+        return r;
     }
 
-    i_node * in = inodetableCACHE[inodeIndex];
-    
-    if(in->valid)
+    for(int i = 0; i < nblocks; i++)
     {
-        for(int i = 0; i < num_directptr; i++)
+        int block = start_address + i;
+        if(fs->checksumCACHE[block] == 0)
         {
-            if(in->directptr[i] < 0)
-            {
-                in->directptr[i] = datablockIndex;
-                return 0;
-            }
+            continue;
         }
 
-        // If not found in directptr, look in indirect ptr
-        // If no indirectptr, add block and add entry
-        if(in->indirectptr < 0)
-        {
-            // Find free data block for indirect ptr block and update the free bit map
-            indirectptr_block = find_free_data_block(1);
-            if(indirectptr_block < 0)
-            {
-                return -1;
-            }
-
-            // Udpate inode in cache
-            in->indirectptr = indirectptr_block;
-            in->num_indirectptr = in->num_indirectptr + 1;
-
-            // Add data block
-            block = (char *) malloc(BLOCK_SIZE);
-            indirect_ptr * indirectptr = (indirect_ptr *) block;
-            indirectptr->datablockindex = datablockIndex;
-        }
-        // Add to existing indirect pointers
-        else
+        // Counters are updated atomically, file content is read from several threads
+        __sync_fetch_and_add(&fs->checksumSTATS.blocks_verified, 1);
+        if(block_checksum((char *) buffer + i*BLOCK_SIZE) != fs->checksumCACHE[block])
         {
-            // Verify if space remaining in the indirect block
-            if(in->num_indirectptr < BLOCK_SIZE/sizeof(indirect_ptr))
+            printf("Checksum mismatch on block %d\n", block);
+            if(block >= data_starting_ind && block < data_starting_ind + num_data_blcks)
             {
-                indirectptr_block = in->indirectptr;
-                in->num_indirectptr = in->num_indirectptr + 1;
-
-                block = (char *) malloc(BLOCK_SIZE);
-                // Copy current block and append
-                read_blocks(indirectptr_block + data_starting_ind, 1, block);
-                // Go to end of entries in block
-                char * block_temp = block + in->num_indirectptr * sizeof(indirect_ptr);
-                indirect_ptr * indirectptr = (indirect_ptr *) block_temp;
-                indirectptr->datablockindex = datablockIndex;
+                __sync_fetch_and_add(&fs->checksumSTATS.data_mismatches, 1);
             }
-            // No space remaining => we are at the max file size
             else
             {
-                return -1;
+                __sync_fetch_and_add(&fs->checksumSTATS.metadata_mismatches, 1);
             }
+            r = -1;
         }
+    }
 
-        // After updating cache and preparing data structures, write to disk
-        write_blocks(indirectptr_block + data_starting_ind, 1, block);
+    return r;
+}
 
-        // Save updated inode table to disk
-        int inodetableblock = inodeIndex/num_inodes_blcks; 
-        save_inodetableCACHE_to_DISK(inodetableblock);
-    }
-    else 
+/* Write blocks to the disk and record their checksum */
+// Take as argument the i node whose file content the blocks hold, -1 for metadata
+// The checksum blocks are only marked modified, they are written at the end of the call
+int fs_write_blocks(sfs_t * fs, int start_address, int nblocks, void * buffer, int owner)
+{
+    for(int i = 0; i < nblocks; i++)
     {
-        printf("Add data block to inode with invalid inode index %d\n", inodeIndex);
-        return -1;
+        int block = start_address + i;
+        fs->checksumCACHE[block] = block_checksum((char *) buffer + i*BLOCK_SIZE);
+        fs->checksum_block_dirty[block/checksum_per_block] = 1;
     }
 
-    return 0;
+    return buffered_write_blocks(fs, start_address, nblocks, buffer, owner);
 }
 
-int add_directory_entry(char * name, int inodeIndex)
+/* Forget the checksum of discarded blocks, they read as zeros from now on */
+void clear_checksums(sfs_t * fs, int start_address, int nblocks)
 {
-    int dirIndex = -1;
-    int dir_data_block_index;
-
-    // Get the i node for the root directory from the superblock
-    int dir_inode_index = superblockCACHE->i_rootdir;
-    // Number of valid elements in the directory
-    int dir_num_elements = superblockCACHE->dir_num_elements;
-
-    // Go to i node of root directory from cache 
-    i_node * directory_in = inodetableCACHE[dir_inode_index];
-
-    // Current size of data in the directory, will need to be updated with the new directory entry
-    int directory_size = directory_in->size;
-    // Total number of directory entries, valid or invalid
-    // This will indicate how many data blocks are used for the directory
-    int total_dir_entries = directory_size/sizeof(dir_entry);
-
-    /*--------------------------------*/
-    /* Find new directory entry index */
-    /*--------------------------------*/
-    // If the number of valid entries == number of valid + invalid entries ==> invalid entries = 0
-    // Therefore we can go to the next to last index
-    if(dir_num_elements == total_dir_entries)
+    for(int i = 0; i < nblocks; i++)
     {
-        dirIndex = dir_num_elements;
-    }
-    // If not, we know between index 0 and index total_dir_entries - 1, there will be an invalid entry we can update
-    // Find this invalid entry
-    else
-    {
-        for(int i = 0; dirIndex < 0 && i < total_dir_entries; i++)
+        int block = start_address + i;
+        if(fs->checksumCACHE[block] != 0)
         {
-            dir_entry * curentry = directoryCACHE[i];
-            if(!(curentry->valid))
-            {
-                dirIndex = i;
-            }
+            fs->checksumCACHE[block] = 0;
+            fs->checksum_block_dirty[block/checksum_per_block] = 1;
         }
     }
+}
 
-    int direntry_block_index = dirIndex/dir_entry_per_block;
-    
-    // Update the data block index to be the new direntry block index
-    // If we need to create a new block index in the directory, we will update this value
-    dir_data_block_index = direntry_block_index;
-
-    // After these steps, dirIndex can either be an existing index in range [0, total_dir_entries[ or a new index = dir_num_elements
-    // If the index is existing, we can update the cache and disk
-    // If not existing, we need to verify if we need to create a new data block for the next entry  
-    if(dirIndex == dir_num_elements)
-    {
-        // Update size of directory i node, contain 1 more entry
-        directory_in->size = directory_size + sizeof(dir_entry);
-        // Save inode modification on the disk
-        save_inodetableCACHE_to_DISK(dir_inode_index/inode_per_block);
-
-        // Verify if new block is necessary
-        // If previous index and new index are not the same block, NEED NEW BLOCK
-        if(dirIndex == 0 || (dirIndex - 1)/dir_entry_per_block != direntry_block_index)
-        {
-            // Find available data block 
-            // The index returned is starting at data block 0. 
-            // Update the data block index to point the newly allocated block in data blocks
-            dir_data_block_index = find_free_data_block(1 /* Flag to update freebitmap */);
-            // Verify if data block was available
-            if(dir_data_block_index < 0)
-            {
-                return -1;
-            }
+/* Copy blocks to other blocks of the disk along with their checksum */
+// The disk copies the blocks without reading them, a block the write back cache holds a newer
+// copy of is read and written again instead. The two ranges must not overlap.
+// Return the number of blocks copied, -1 on failure
+int fs_copy_blocks(sfs_t * fs, int src_address, int dst_address, int nblocks, int owner)
+{
+    int cached = 0;
+    for(int i = 0; i < nblocks; i++)
+    {
+        cached = cached || fs->writebackCACHE[src_address + i] != NULL;
+    }
 
-            // Add new data block to directory inode in CACHE
-            int r = add_data_block_to_inode(dir_data_block_index, dir_inode_index);
-            // Verify if error in the previous method
-            if(r == -1)
+    if(cached)
+    {
+        char * blockbuf = (char *) pool_get_buffer();
+        int r = nblocks;
+        for(int i = 0; i < nblocks && r != -1; i++)
+        {
+            if(fs_read_blocks(fs, src_address + i, 1, blockbuf) < 0 ||
+               fs_write_blocks(fs, dst_address + i, 1, blockbuf, owner) < 0)
             {
-                return -1;
+                r = -1;
             }
-
         }
+        pool_put_buffer(blockbuf);
+        return r;
     }
 
-    /*-------------------------------*/
-    /* Udpate new dir entry in CACHE */
-    /*-------------------------------*/
-    dir_entry * direntry = directoryCACHE[dirIndex];
-    strcpy(direntry->filename, name);
-    direntry->valid = 1;
-    direntry->i_node = inodeIndex;
+    // An older copy in the cache must not be written over this one
+    drop_writeback(fs, dst_address, nblocks);
+    cancel_discards(fs, dst_address, nblocks);
+    fs->unsynced_writes = 1;
+    if(disk_copy_blocks(fs->disk, src_address, dst_address, nblocks) < 0)
+    {
+        return -1;
+    }
 
-    /*--------------------------*/
-    /* Udpate directory in Disk */
-    /*--------------------------*/
-    save_directoryCACHE_to_DISK(dirIndex);
+    // The content is the same, so is its checksum
+    for(int i = 0; i < nblocks; i++)
+    {
+        fs->checksumCACHE[dst_address + i] = fs->checksumCACHE[src_address + i];
+        fs->checksum_block_dirty[(dst_address + i)/checksum_per_block] = 1;
+    }
+    return nblocks;
+}
 
-    /*------------------------*/
-    /* Update directory inode */
-    /*------------------------*/
-    // The size was previously updated if we added a new directory entry in the cache 
-    // It no new directory entry, inode table is up to date
+/* Method to update in the cache and the disk the free bitmap table */
+// The count of free data blocks in the superblock follows the changes of the data blocks
+// Both are written once at the end of the call
+int update_freebitmap_CACHE_and_DISK(sfs_t * fs, int blockIndex, int flag)
+{
+    unsigned char * freebitmapCACHE_temp = fs->freebitmapCACHE + blockIndex;
+    int wasfree = *freebitmapCACHE_temp == '1';
+    if(flag == 1)
+    {
+        *freebitmapCACHE_temp = '1';
+    }
+    else if(flag == 0)
+    {
+        *freebitmapCACHE_temp = '0';
+    }
+    else
+    {
+        return -1;
+    }
+    fs->freebitmap_dirty = 1;
 
-    /*-------------------*/
-    /* Update Superblock */
-    /*-------------------*/
-    // Add new directory entry to directory, update number of directory entries
-    superblockCACHE->dir_num_elements = dir_num_elements + 1;
-    // Udpate superblock to disk
-    write_blocks(0, 1, (char *) superblockCACHE);
+    if(blockIndex >= data_starting_ind && blockIndex < data_starting_ind + num_data_blcks && wasfree != flag)
+    {
+        fs->superblockCACHE->num_free_blocks = fs->superblockCACHE->num_free_blocks + (flag ? 1 : -1);
+        fs->superblock_dirty = 1;
+    }
+    return 0;   
+}
 
-    return 0;
+/* Write the free bitmap to disk if it was modified */
+void save_freebitmap(sfs_t * fs)
+{
+    if(fs->freebitmap_dirty)
+    {
+        fs->freebitmap_dirty = 0;
+        fs_write_blocks(fs, NUM_BLOCKS - 1, 1, fs->freebitmapCACHE, -1);
+    }
 }
 
-int sfs_fcreate(char* name)
+/* Write the reference count table to disk if it was modified */
+void save_refcount_table(sfs_t * fs)
 {
-    int inodeIndex = -1;
-    i_node * file_inode = NULL;
+    if(fs->refcount_dirty)
+    {
+        fs_write_blocks(fs, refcount_starting_ind, 1, fs->refcountCACHE, -1);
+        fs->refcount_dirty = 0;
+    }
+}
 
-    /*---------------------------*/
-    /* Verify inode availability */
-    /*---------------------------*/
-    if(superblockCACHE->num_inodes == max_num_inodes)
+/* Drop one reference to a data block */
+// A shared block loses one of its extra references, any other block is freed in the free bitmap
+// Return 1 if the block was freed, 0 if other files still use it
+int release_data_block(sfs_t * fs, int datablock)
+{
+    if(fs->refcountCACHE[datablock] > 0)
     {
-        // No i node available to create a new file
-        printf("Max inode number reached, cant create new file\n");
-        return -1; 
+        fs->refcountCACHE[datablock]--;
+        fs->refcount_dirty = 1;
+        return 0;
     }
-    
-    /*----------------------*/
-    /* Find available inode */
-    /*----------------------*/
-    for(int i = 0; inodeIndex < 0 && i < max_num_inodes; i++)
+
+    fs->dedupCANDIDATE[datablock] = 0;
+    update_freebitmap_CACHE_and_DISK(fs, data_starting_ind + datablock, 1);
+    return 1;
+}
+
+/* Drop one reference to every block of a list of data blocks */
+// Shared blocks lose one of their extra references, the others are freed in the free bitmap
+// The reference count table is written once for the whole list, the free bitmap at the end of the call
+// Take as argument DATA block indexes, the DISK block indexes of the blocks freed replace them
+// Return the number of blocks freed, they are at the start of the list
+int release_data_blocks(sfs_t * fs, int * blocks, int num_blocks)
+{
+    int num_freed = 0;
+    for(int i = 0; i < num_blocks; i++)
     {
-        i_node * in = inodetableCACHE[i];
-        if(!(in->valid)) 
+        int datablock = blocks[i];
+        if(fs->refcountCACHE[datablock] > 0)
         {
-            inodeIndex = i;
-            file_inode = in;
-        }   
-    }  
+            fs->refcountCACHE[datablock]--;
+            fs->refcount_dirty = 1;
+            continue;
+        }
+        if(fs->freebitmapCACHE[data_starting_ind + datablock] == '1')
+        {
+            continue;
+        }
 
-    /*---------------------------*/
-    /* Update new inode in CACHE */
-    /*---------------------------*/
-    file_inode->valid = 1;
-    // Not yet written to file => size is 0
-    file_inode->size = 0;
-    for (int i = 0; i < num_directptr; i++)
+        fs->dedupCANDIDATE[datablock] = 0;
+        fs->freebitmapCACHE[data_starting_ind + datablock] = '1';
+        blocks[num_freed++] = data_starting_ind + datablock;
+    }
+
+    if(num_freed > 0)
     {
-        file_inode->directptr[i] = -1;
+        fs->freebitmap_dirty = 1;
+        fs->superblockCACHE->num_free_blocks = fs->superblockCACHE->num_free_blocks + num_freed;
+        fs->superblock_dirty = 1;
     }
-    file_inode->indirectptr = -1;
-    file_inode->num_indirectptr = 0;
+    save_refcount_table(fs);
+    return num_freed;
+}
 
-    /*-------------------------------------------*/
-    /* Persist change to inodetableCACHE to DISK */
-    /*-------------------------------------------*/
-    // Get the block index of the inodetable element
-    int inodetable_block_ind = inodeIndex / inode_per_block;
-    save_inodetableCACHE_to_DISK(inodetable_block_ind);
+/* Find a data block holding the same content as block */
+// Return DATA BLOCK index, -1 if no identical block is known or it can't take one more reference
+int dedup_find_block(sfs_t * fs, unsigned int fingerprint, const char * block)
+{
+    int candidate = fs->dedupINDEX[fingerprint % DEDUP_BUCKETS];
 
-    /*------------------*/
-    /* Add to directory */
-    /*------------------*/
-    int r = add_directory_entry(name, inodeIndex);
-    // Verify if error in the previous method
-    if(r == -1)
+    // The block may have been rewritten or freed since it was remembered
+    if(candidate == -1 || !fs->dedupCANDIDATE[candidate] || fs->refcountCACHE[candidate] == 255 ||
+       fs->checksumCACHE[data_starting_ind + candidate] != fingerprint)
     {
         return -1;
     }
 
-    /*-------------------*/
-    /* Update Superblock */
-    /*-------------------*/
-    // Add new i node entry, update number of valid i nodes in the superblock
-    superblockCACHE->num_inodes = superblockCACHE->num_inodes + 1;
-    // Udpate superblock to disk
-    write_blocks(0, 1, (char *) superblockCACHE);
+    // Same fingerprint, compare the content
+    char * candidate_block = (char *) pool_get_buffer();
+    int same = fs_read_blocks(fs, data_starting_ind + candidate, 1, candidate_block) >= 0 &&
+               memcmp(candidate_block, block, BLOCK_SIZE) == 0;
+    pool_put_buffer(candidate_block);
 
-    return inodeIndex;
+    return same ? candidate : -1;
 }
 
-// We can only have one instance of the file opened at a time
-int sfs_fopen(char* name)
+/* Remember a file data block in the fingerprint index */
+void dedup_remember_block(sfs_t * fs, unsigned int fingerprint, int datablock)
 {
-    int fileFound = 0;
-    int inodeIndex = -1;
+    fs->dedupINDEX[fingerprint % DEDUP_BUCKETS] = datablock;
+    fs->dedupCANDIDATE[datablock] = 1;
+}
 
-    // Illegal length
-    if(strlen(name) > MAX_FILENAME_LEN)
+/* Return the space of freed blocks to the host */
+// Take as argument a list of DISK block indexes
+// Their copy in the write back cache is dropped now, the blocks are discarded when the write back
+// cache is next flushed, after the metadata that pointed to them (see issue_pending_discards)
+void discard_freed_blocks(sfs_t * fs, int * blocks, int num_blocks)
+{
+    for(int i = 0; i < num_blocks; i++)
     {
-        printf("Filename provided is too long. Max is %d but name is %ld\n", MAX_FILENAME_LEN, sizeof(name));
-        return -1;
+        drop_writeback(fs, blocks[i], 1);
+        clear_checksums(fs, blocks[i], 1);
+        if(!fs->discard_pending[blocks[i]])
+        {
+            fs->discard_pending[blocks[i]] = 1;
+            fs->num_discard_pending++;
+        }
     }
+}
 
-    // I node of the directory 
-    i_node * dir_i_node = inodetableCACHE[superblockCACHE->i_rootdir];  
-    // Size of directory in data block (valid+invalid), bytes
-    int dir_size = dir_i_node->size;
+/* DISK block holding a block of the i node table */
+int inode_block_location(super_block * sb, int inodetable_blockIndex)
+{
+    if(sb->inode_map[inodetable_blockIndex] != 0)
+    {
+        return sb->inode_map[inodetable_blockIndex];
+    }
+    return i_node_starting_ind + inodetable_blockIndex;
+}
 
-    /*------------------*/
-    /* Find File i node */
-    /*------------------*/
-    int num_dir_entries = dir_size/sizeof(dir_entry);
-    // Look through cache
-    for(int i = 0; !fileFound && i < num_dir_entries; i++)
+/* Method to bring an i node table block in the cache */
+// Blocks that were never written since formatting are not read from the disk,
+// their i nodes are initialized in memory and reach the disk the first time one of them is saved
+void load_inode_block(sfs_t * fs, int inodetable_blockIndex)
+{
+    // One allocation holds every i node of the block
+    i_node * inodes = (i_node *) malloc(inode_per_block * sizeof(i_node));
+
+    if(fs->superblockCACHE->inode_block_init & (1u << inodetable_blockIndex))
+    {
+        char * inodetable_disk = (char *) pool_get_buffer();
+        fs_read_blocks(fs, inode_block_location(fs->superblockCACHE, inodetable_blockIndex), 1, inodetable_disk);
+        memcpy(inodes, inodetable_disk, inode_per_block * sizeof(i_node));
+        pool_put_buffer(inodetable_disk);
+    }
+    else
     {
-        // Get ith element of the directory cache
-        dir_entry * direntry = directoryCACHE[i];
-        if(direntry->valid)
+        for(int i = 0; i < inode_per_block; i++)
         {
-            if(strcmp(name, direntry->filename) == 0)
+            inodes[i].valid = 0;
+            inodes[i].num_indirectptr = 0;
+            inodes[i].size = 0;
+            for(int j = 0; j < num_directptr; j++)
             {
-                inodeIndex = direntry->i_node;
-                fileFound = 1;
+                inodes[i].directptr[j] = -1;
             }
+            inodes[i].indirectptr = -1;
+            inodes[i].flags = 0;
+            memset(inodes[i].inline_data, 0, INLINE_DATA_LEN);
         }
     }
 
-    /*-----------------*/
-    /* Create new file */
-    /*-----------------*/
-    if(!fileFound)
+    for(int i = 0; i < inode_per_block; i++)
     {
-        inodeIndex = sfs_fcreate(name);
+        fs->inodetableCACHE[inodetable_blockIndex*inode_per_block + i] = &inodes[i];
     }
+}
 
-    /*-----------------*/
-    /* Add to open FDT */
-    /*-----------------*/
-    if(inodeIndex > -1)
+/* Return the i node from the cache, loading its block on first access */
+i_node * get_inode(sfs_t * fs, int inodeIndex)
+{
+    if(fs->inodetableCACHE[inodeIndex] == NULL)
     {
-        i_node * file_inode = inodetableCACHE[inodeIndex];
-
-        int openIndex = -1;
-        for(int i = 0; i < MAX_OPEN_FILE; i++)
-        {
-            open_entry * open_e = open_fdt[i];
-            // If entry is valid, verify if it points to the same file
-            if(open_e->valid)
-            {
-                if(open_e->iptr == inodeIndex)
-                {
-                    return i;
-                }
-            }
-            else
-            {
-                // If it is the first invalid entry, set the openIndex so we can add 
-                // the new file entry at this index if it is not already opened
-                if(openIndex == -1)
-                {
-                    openIndex = i;
-                }
-            }
-            
-        }
-        
-        // We can add the entry if we did not find the file in the open file table
-        if(openIndex > -1)
-        {
-            open_fdt[openIndex]->valid = 1;
-            // Start the file ptr in append mode
-            open_fdt[openIndex]->fileptr = file_inode->size;
-            // Associate the inode pointer to the current inode
-            open_fdt[openIndex]->iptr = inodeIndex;
-
-            // Return the open fdt index
-            return openIndex;
-        }
+        load_inode_block(fs, inodeIndex/inode_per_block);
     }
-    
-    // Unsuccessful operation, return error
-    return -1;
+    return fs->inodetableCACHE[inodeIndex];
 }
 
-int sfs_fclose(int fileID)
+/* Drop every i node block from the cache */
+void reset_inodetableCACHE(sfs_t * fs)
 {
-    if(fileID > -1 && fileID < MAX_OPEN_FILE)
+    for(int j = 0; j < num_inodes_blcks; j++)
     {
-        open_entry * open_e = open_fdt[fileID];
-        if(open_e->valid == 0)
+        if(fs->inodetableCACHE[j*inode_per_block] != NULL)
         {
-            // Already closed file
-            return -1;
+            free(fs->inodetableCACHE[j*inode_per_block]);
+        }
+        for(int i = 0; i < inode_per_block; i++)
+        {
+            fs->inodetableCACHE[j*inode_per_block + i] = NULL;
         }
-        open_e->valid = 0;
-
-        return 0;
     }
-
-    // If fileID is not in the appropriate range, return error -1
-    return -1;
 }
 
-int sfs_fwrite(int fileID, const char* buf, int length)
+/* Mount the file system of an open disk, a new one is made on it if fresh is set */
+sfs_t * mount_disk(disk_t * disk, int fresh, int durability)
 {
-    // Get the entry associated with the fileID
-    open_entry * openentry = open_fdt[fileID];
-    // The open entry will point to inode number
-    int inodeIndex = openentry->iptr;
-    int fileptr = openentry->fileptr;
-    // Get the inode from the cache (always up to date)
-    i_node * inode = inodetableCACHE[inodeIndex];
-    // This is the index of the first block, we will need to find which data block it points to in the inode
-    int writeblockindex = fileptr/BLOCK_SIZE;
-    // update fileptr to point to specific block location
-    int fileptr_write = fileptr % BLOCK_SIZE;
+    // Every counter and flag starts at 0, every cache starts empty
+    sfs_t * fs = (sfs_t *) calloc(1, sizeof(sfs_t));
+    fs->discard_online = 1;
+    fs->durability = durability;
+    fs->compact_inode = -1;
+    pthread_rwlock_init(&fs->lock, NULL);
+    pthread_mutex_init(&fs->cleaner_lock, NULL);
+    pthread_cond_init(&fs->cleaner_wake, NULL);
 
-    int remaining_len = length;
-    
-    int datablock;
-    int writesize = 0;
-    char * currentBufSrc = (char *) buf;
+    fs->disk = disk;
+
+    char * superblock = (char *) malloc(BLOCK_SIZE);
+    unsigned char * freebitmap = (unsigned char *) malloc(BLOCK_SIZE);
 
-    if(!openentry->valid)
+    // No block has a checksum until the checksum table is read or blocks are written
+    fs->checksumCACHE = (unsigned int *) calloc(NUM_BLOCKS, sizeof(unsigned int));
+
+    // No block shared until the reference count table is read
+    fs->refcountCACHE = (unsigned char *) calloc(1, BLOCK_SIZE);
+    fs->dedupCANDIDATE = (unsigned char *) calloc(1, num_data_blcks);
+    fs->reservedCACHE = (unsigned char *) calloc(1, num_data_blcks);
+    if(durability != SFS_DURABILITY_SYNC)
     {
-        // If the file was closed, we can't write to it
-        return 0;
+        fs->writeback_slots = (char *) malloc(WRITEBACK_MAX_BLOCKS * BLOCK_SIZE);
+        fs->writeback_run = (char *) malloc(WRITEBACK_MAX_BLOCKS * BLOCK_SIZE);
+        for(int i = 0; i < WRITEBACK_MAX_BLOCKS; i++)
+        {
+            fs->writeback_free_slots[i] = WRITEBACK_MAX_BLOCKS - 1 - i;
+        }
+        fs->writeback_num_free_slots = WRITEBACK_MAX_BLOCKS;
     }
-
-    // File pointer points outside of the maximum scope of the file, max file size was reached
-    if(writeblockindex >= num_directptr + BLOCK_SIZE/sizeof(indirect_ptr))
+    for(int i = 0; i < DEDUP_BUCKETS; i++)
     {
-        return writesize;
+        fs->dedupINDEX[i] = -1;
     }
-
-    while(remaining_len > 0)
+    
+    if(!fresh)
     {
-        /*----------------*/
-        /* Get data block */
-        /*----------------*/
-        if(writeblockindex < num_directptr)
-        {
-            datablock = inode->directptr[writeblockindex];
 
-            // We need to create a new block
-            if(datablock == -1)
-            {
-                datablock = find_free_data_block(1);
-                if(datablock == -1)
-                {
-                    // No more space in the disk
-                    printf("No more space to create a datablock\n");
-                    break;
-                }
-                else
-                {
-                    // Udpate file inode to point to the new data block
-                    inode->directptr[writeblockindex] = datablock;
-                }
-            }
-        }
-        else
+        /*-------------------------*/
+        /* Create superblock cache */
+        /*-------------------------*/
+        // Read superblock from memory
+        char * superblock_disk = (char *) pool_get_buffer();
+        disk_read_blocks(fs->disk, 0, 1, superblock_disk);
+        super_block * sb_disk = (super_block *) superblock_disk;
+        super_block * sb_cache = (super_block *) superblock;
+        // Copy disk contents to cache
+        sb_cache->magic = sb_disk->magic;
+        sb_cache->block_size = sb_disk->block_size;
+        sb_cache->file_sys_len = sb_disk->file_sys_len;
+        sb_cache->i_node_len = sb_disk->i_node_len;
+        sb_cache->i_rootdir = sb_disk->i_rootdir;
+        sb_cache->num_inodes = sb_disk->num_inodes; 
+        sb_cache->dir_num_elements = sb_disk->dir_num_elements;
+        sb_cache->inode_block_init = sb_disk->inode_block_init;
+        memcpy(sb_cache->inode_map, sb_disk->inode_map, sizeof(sb_cache->inode_map));
+        sb_cache->num_free_blocks = sb_disk->num_free_blocks;
+        sb_cache->checksum = sb_disk->checksum;
+
+        // Verify the superblock against its checksum
+        sb_disk->checksum = 0;
+        if(crc32c(0, sb_disk, sizeof(super_block)) != sb_cache->checksum)
         {
-            // This holds the data block of the indirect pointer
-            int indirectptrblock;
+            printf("Checksum mismatch on block %d\n", super_block_starting_ind);
+            fs->checksumSTATS.metadata_mismatches++;
+        }
 
-            // We point at the begining of the first block of the indirect pointers
-            if(inode->indirectptr == -1)
-            {
-                // Find new data block to hold the indirect pointers
-                indirectptrblock = find_free_data_block(1);
-                datablock = find_free_data_block(1);
-                if(indirectptrblock == -1 || datablock == -1)
-                {
-                    // No more space in the disk
-                    printf("invalid block returned\n");
-                    break;
-                }
-                else
-                {
-                    // Update inode to point to new data block
-                    inode->num_indirectptr = inode->num_indirectptr + 1;
-                    inode->indirectptr = indirectptrblock;
-
-                    // Write indirect ptr block to the disk
-                    char * indirectptrblock_todisk = (char *) malloc(BLOCK_SIZE);
-                    indirect_ptr * indptr_entry = (indirect_ptr *) indirectptrblock_todisk;
-                    indptr_entry->datablockindex = datablock;
-                    write_blocks(data_starting_ind + indirectptrblock, 1, indirectptrblock_todisk);
-                    free(indirectptrblock_todisk);                
-                }
-            }
-            else
-            {
-                indirectptrblock = inode->indirectptr;
+        fs->superblockCACHE = (super_block *) superblock;
+        pool_put_buffer(superblock_disk);
 
-                // Find the index of the indirect pointer entry in the indirect pointer
-                int indirectptrIndex = writeblockindex - num_directptr;
+        /*-----------------------------*/
+        /* Create checksum table cache */
+        /*-----------------------------*/
+        // Every other block read is verified against this table
+        load_checksum_table(fs);
 
-                char * indirectptrblock_fromdisk = (char *) malloc(BLOCK_SIZE);
-                read_blocks(data_starting_ind + indirectptrblock, 1, indirectptrblock_fromdisk);
-                
-                if(indirectptrIndex < inode->num_indirectptr)
-                {
-                    // We are looking at an existing block 
-                    // We can simply get the data block index from the pointer 
-                    datablock = ((indirect_ptr *) (indirectptrblock_fromdisk + indirectptrIndex * sizeof(indirect_ptr)))->datablockindex;
-                }
-                else 
-                {
-                    // We need to create a new indirect pointer if remaining space
-                    if(inode->num_indirectptr < BLOCK_SIZE/sizeof(indirect_ptr))
-                    {
-                        // Update number of indirect pointers in the inode of the file 
-                        inode->num_indirectptr = inode->num_indirectptr + 1;
-
-                        // Find free data block for the new file block
-                        datablock = find_free_data_block(1);
-                        indirect_ptr * indptr_entry = (indirect_ptr *) (indirectptrblock_fromdisk + indirectptrIndex * sizeof(indirect_ptr));
-                        indptr_entry->datablockindex = datablock;
-                        write_blocks(data_starting_ind + indirectptrblock, 1, indirectptrblock_fromdisk);
-                        free(indirectptrblock_fromdisk);                        
-                    }
-                    else 
-                    {
-                        // We have reached the maximum file length, can no longer write to file
-                        break;
-                    }
-                }
-            }
+        /*--------------------------*/
+        /* Create inode table cache */
+        /*--------------------------*/
+        // Blocks of the inode table are read on first access
+        reset_inodetableCACHE(fs);
+        
+        /*--------------------------*/
+        /* Create freebit map cache */
+        /*--------------------------*/
+        char * freebitmap_disk = (char *) pool_get_buffer();
+        fs_read_blocks(fs, NUM_BLOCKS - 1, 1, freebitmap_disk);
+        // Copy disk content to cache
+        unsigned char * freebitmap_cache_bit = freebitmap;
+        unsigned char * freebitmap_disk_bit = (unsigned char *) freebitmap_disk;
+        for (int i = 0; i < BLOCK_SIZE; i++)
+        {
+            *freebitmap_cache_bit = *freebitmap_disk_bit;
+            freebitmap_cache_bit++;
+            freebitmap_disk_bit++;
         }
 
-        // Data block should point to the data block on disk to which we need to write
+        fs->freebitmapCACHE = freebitmap;
+        pool_put_buffer(freebitmap_disk);
 
-        // On a single block we can write writelen    
-        int writelen = BLOCK_SIZE - fileptr_write;
+        // The free count is written once per call, the bitmap is what a crash leaves consistent
+        int num_free_blocks = 0;
+        for(int datablock = 0; datablock < num_data_blcks; datablock++)
+        {
+            num_free_blocks = num_free_blocks + (freebitmap[data_starting_ind + datablock] == '1');
+        }
+        sb_cache->num_free_blocks = num_free_blocks;
 
-        /*-------------------------*/
-        /* Get datablock from disk */
-        /*-------------------------*/
-        char * datablock_fromdisk = (char *) malloc(BLOCK_SIZE);
-        // Copy content of current data block
-        read_blocks(data_starting_ind + datablock, 1, datablock_fromdisk);
-        
-        char * datablock_startcopy = datablock_fromdisk + fileptr_write;
+        /*------------------------------------*/
+        /* Create reference count table cache */
+        /*------------------------------------*/
+        fs_read_blocks(fs, refcount_starting_ind, 1, fs->refcountCACHE);
+    }
+    else 
+    {
+        /*-------------------*/
+        /* Create superblock */
+        /*-------------------*/
+        super_block * sb = (super_block *) superblock;
+        sb->magic = (int) 0xACBD0005;
+        sb->block_size = BLOCK_SIZE;
+        sb->file_sys_len = NUM_BLOCKS;
+        sb->i_node_len = sizeof(i_node);
+        sb->i_rootdir = 0;
+        sb->num_inodes = 1; // Start at 1 because we have the directory i node
+        sb->dir_num_elements = 0;  // Start with 0 elements in the directories
+        sb->num_free_blocks = num_data_blcks;  // Every data block is free
+        sb->inode_block_init = 0;  // No i node table block written yet
+        memset(sb->inode_map, 0, sizeof(sb->inode_map));  // Every i node table block at its place
+
+        // Update the cache to reflect the current state of the super block
+        // It reaches the disk when the new file system is synchronized below
+        fs->superblockCACHE = (super_block *) superblock;
 
-        // Copy the smallest buffer size between block remaining space and total buffer remaining
-        if(writelen < remaining_len)
+        /*--------------------*/
+        /* Create free bitmap */
+        /*--------------------*/
+        // Size is number of blocks in disk (will fit in 1 block)
+        unsigned char * freebitmaptemp = freebitmap;
+        // Initialize to 1 every block (FREE)
+        for (int i = 0; i < BLOCK_SIZE; i++)
         {
-            memcpy(datablock_startcopy, currentBufSrc, writelen);
-            // Update the size of the file in the inode with the new write
-            inode->size = inode->size + writelen;
-            writesize = writesize + writelen;
+            *freebitmaptemp = '1';
+            freebitmaptemp++;
+        }
+        // Unfree superblock
+        freebitmaptemp = freebitmap;
+        *freebitmaptemp = '0';
+
+        // Unfree first i node block
+        freebitmaptemp = freebitmap + i_node_starting_ind;
+        *freebitmaptemp = '0';
 
-            // Update buffer to continue writing content 
-            currentBufSrc = currentBufSrc + writelen;
+        // Unfree reference count block, it reads as zeros (no shared block) until first written
+        freebitmaptemp = freebitmap + refcount_starting_ind;
+        *freebitmaptemp = '0';
 
-            // Update the file ptr to the end of the write
-            openentry->fileptr = openentry->fileptr + writelen;
-            
-            // Remaining length of buffer to be written to memory
-            remaining_len = remaining_len - writelen;
-        }
-        else
+        // Unfree checksum blocks
+        for(int i = 0; i < num_checksum_blcks; i++)
         {
-            memcpy(datablock_startcopy, currentBufSrc, remaining_len);
-            // Update the size of the file in the inode with the new write
-            inode->size = inode->size + remaining_len;
-            writesize = writesize + remaining_len;
+            freebitmaptemp = freebitmap + checksum_starting_ind + i;
+            *freebitmaptemp = '0';
+        }
 
-            // Update buffer to continue writing content 
-            currentBufSrc = currentBufSrc + remaining_len;
+        // Unfree bitmap block
+        freebitmaptemp = freebitmap + NUM_BLOCKS - 1;
+        *freebitmaptemp = '0';
 
-            // Update the file ptr to the end of the write
-            openentry->fileptr = openentry->fileptr + remaining_len;
+        // Update the cache to reflect the current state of the freebitmap
+        // It is written at last block in disk when the new file system is synchronized below
+        fs->freebitmapCACHE = freebitmap;
+        fs->freebitmap_dirty = 1;
 
-            // Remaining length of buffer to be written to memory
-            remaining_len = remaining_len - remaining_len;
-        }
+        /*-------------------------*/
+        /* Create Directory I Node */
+        /*-------------------------*/
+        // The i node table is not initialized on disk, only the block holding the
+        // directory i node is written. Every other block is set up on first use.
+        reset_inodetableCACHE(fs);
+        i_node * in = get_inode(fs, sb->i_rootdir);
+        in->valid = 1; 
+        in->flags = INODE_DIR;
+        // Directory starts by being empty, No directory entries to start with
+        // Its B+tree gets a root node with the first entry
+        in->size = 0;
+        // Write directory i node to i node table, this also marks the superblock modified
+        save_inodetableCACHE_to_DISK(fs, sb->i_rootdir/inode_per_block);
+    }
 
-        // Write back to disk the modified content of the block
-        
-        write_blocks(data_starting_ind + datablock, 1, datablock_fromdisk);
-    
-        // Update fileptr_write to 0, because after first block write, the following writes will always be at 
-        // the beginning of the next block, therefore no offset in the block.
-        fileptr_write = 0;
+    // We will have a new fdt even if we import an existing file system as it resides in the program memory
+    // Set every element of the open fdt at invalid so that we can override any element in the table
+    for(int i = 0; i < MAX_OPEN_FILE; i++)
+    {
+        open_entry * open_e = (open_entry *) malloc(sizeof(open_entry));
+        open_e->valid = 0;
+        fs->open_fdt[i] = open_e;
+    }
 
-        // Update the writeblock index to next block in the list of blocks
-        writeblockindex = writeblockindex + 1;
+    // A new file system is on stable storage once mounted, whatever the durability mode
+    if(fresh)
+    {
+        sync_blocks(fs, -2);
     }
-    // Update the file inode on disk
-    save_inodetableCACHE_to_DISK(inodeIndex/inode_per_block);
 
-    return writesize;
+    return fs;
 }
 
-int sfs_fread(int fileID, char* buf, int length)
+sfs_t * sfs_mount(const char * path, int fresh, int durability)
 {
-     // Get the entry associated with the fileID
-    open_entry * openentry = open_fdt[fileID];
-    // The open entry will point to inode number
-    int inodeIndex = openentry->iptr;
-    int fileptr = openentry->fileptr;
-    // Get the inode from the cache (always up to date)
-    i_node * inode = inodetableCACHE[inodeIndex];
-    // This is the index of the first block, we will need to find which data block it points to in the inode
-    int readblockindex = fileptr/BLOCK_SIZE;
-    // update fileptr to point to specific block location
-    int fileptr_read = fileptr % BLOCK_SIZE;
-
-    int datablock;
-    int readsize = 0;
-    char * currentBufDest = (char *) buf;
+    if(durability < SFS_DURABILITY_SYNC || durability > SFS_DURABILITY_WRITEBACK)
+    {
+        return NULL;
+    }
 
-    int remaining_len;
-    
-    // If we want to read less than the file size, remaining length to read is the length
-    if(inode->size > length)
+    disk_t * disk = disk_open((char *) path, BLOCK_SIZE, NUM_BLOCKS, fresh);
+    if(disk == NULL)
     {
-        remaining_len = length;
-    } 
-    // If we want to read a larger size than the file size, only read file size
-    else
+        return NULL;
+    }
+    return mount_disk(disk, fresh, durability);
+}
+
+sfs_t * sfs_mount_tiered(const char * path, const char * cache_path, int cache_blocks, int policy, int fresh, int durability)
+{
+    if(durability < SFS_DURABILITY_SYNC || durability > SFS_DURABILITY_WRITEBACK ||
+       (policy != SFS_TIER_WRITETHROUGH && policy != SFS_TIER_WRITEBACK))
     {
-        remaining_len = inode->size;
+        return NULL;
     }
 
-    if(!openentry->valid)
+    int disk_policy = policy == SFS_TIER_WRITEBACK ? DISK_TIER_WRITEBACK : DISK_TIER_WRITETHROUGH;
+    disk_t * disk = disk_open_tiered((char *) path, (char *) cache_path, BLOCK_SIZE, NUM_BLOCKS, cache_blocks, disk_policy, fresh);
+    if(disk == NULL)
     {
-        // If the file was closed, we can't read from it
-        return 0;
+        return NULL;
     }
 
-    // File pointer points outside of the maximum scope of the file, max file size was reached
-    if(readblockindex >= num_directptr + BLOCK_SIZE/sizeof(indirect_ptr))
+    // Metadata stays on the fast image: the superblock and the i node table before the data blocks,
+    // the reference counts, checksums and free bitmap after them
+    disk_pin_blocks(disk, super_block_starting_ind, data_starting_ind);
+    disk_pin_blocks(disk, refcount_starting_ind, NUM_BLOCKS - refcount_starting_ind);
+
+    return mount_disk(disk, fresh, durability);
+}
+
+void sfs_unmount(sfs_t * fs)
+{
+    // The segment cleaner finishes what it is doing and stops
+    if(fs->cleaner_started)
     {
-        printf("out of bounds read\n");
-        return readsize;
+        pthread_mutex_lock(&fs->cleaner_lock);
+        fs->cleaner_stopping = 1;
+        pthread_cond_signal(&fs->cleaner_wake);
+        pthread_mutex_unlock(&fs->cleaner_lock);
+        pthread_join(fs->cleaner, NULL);
     }
 
-    while(remaining_len > 0)
+    // Blocks still in the write back cache reach the disk
+    sync_blocks(fs, -2);
+
+    reset_inodetableCACHE(fs);
+    for(int i = 0; i < MAX_OPEN_FILE; i++)
     {
-        /*----------------*/
-        /* Get data block */
-        /*----------------*/
-        if(readblockindex < num_directptr)
-        {
-            datablock = inode->directptr[readblockindex];
+        free(fs->open_fdt[i]);
+    }
+    free(fs->superblockCACHE);
+    free(fs->freebitmapCACHE);
+    free(fs->checksumCACHE);
+    free(fs->refcountCACHE);
+    free(fs->dedupCANDIDATE);
+    free(fs->reservedCACHE);
+    free(fs->writeback_slots);
+    free(fs->writeback_run);
+
+    disk_close(fs->disk);
+    pthread_rwlock_destroy(&fs->lock);
+    pthread_mutex_destroy(&fs->cleaner_lock);
+    pthread_cond_destroy(&fs->cleaner_wake);
+    free(fs);
+}
 
-            // We need to create a new block
-            if(datablock == -1)
-            {
-                // No more content to read
-                // At the end of the directptr list
-                printf("No more direct pointers \n");
-                break;
-            }
-        }
-        else
-        {
-            // This holds the data block of the indirect pointer
-            int indirectptrblock;
+int fs_getnextfilename(sfs_t * fs, char* fname)
+{
+    // Entries of the root directory, in the order of its B+tree
+    // fname receives the name with its terminating 0, it must hold MAX_FILENAME_LEN + 1 bytes
+    dir_entry entry;
+    if(dir_entry_at(fs, get_inode(fs, fs->superblockCACHE->i_rootdir), fs->next_file_directory_index, &entry) == -1)
+    {
+        return 0;
+    }
 
-            // We point at the begining of the first block of the indirect pointers
-            if(inode->indirectptr == -1)
-            {
-                // no more content to read
-                // no indirect ptr list
-                printf("No indirect pointers \n");
+    memcpy(fname, entry.filename, entry.name_len + 1);
+    fs->next_file_directory_index++;
+    return 1;
+}
 
-                break;
-            }
-            else
-            {
-                indirectptrblock = inode->indirectptr;
+int fs_getfilesize(sfs_t * fs, const char* path)
+{
+    int dirInodeIndex;
+    char filename[MAX_FILENAME_LEN + 1];
+    int inodeIndex = resolve_path(fs, path, &dirInodeIndex, filename);
 
-                // Find the index of the indirect pointer entry in the indirect pointer
-                int indirectptrIndex = readblockindex - num_directptr;
+    // Return -1 in case of file not found
+    if(inodeIndex == -1)
+    {
+        return -1;
+    }
 
-                char * indirectptrblock_fromdisk = (char *) malloc(BLOCK_SIZE);
-                read_blocks(data_starting_ind + indirectptrblock, 1, indirectptrblock_fromdisk);
+    // Find the associated inode 
+    if(!get_inode(fs, inodeIndex)->valid)
+    {
+        printf("Invalid inode for the fdt\n");
+        return -1;
+    }
 
-                if(indirectptrIndex < inode->num_indirectptr)
-                {
-                    // We are looking at an existing block 
-                    // We can simply get the data block index from the pointer 
-                    datablock = ((indirect_ptr *) (indirectptrblock_fromdisk + indirectptrIndex * sizeof(indirect_ptr)))->datablockindex;
-                }
-                else 
-                {
-                    // no more content to read
-                    // at the end of the indirectptr list
-                    printf("No more indirect pointers \n");
-                    break;
-                }
-            }
-        }
+    // Return the size of the file stored in the file inode
+    // A directory has the number of its entries as size
+    return get_inode(fs, inodeIndex)->size;
+}
 
-        // Data block should point to the data block on disk to which we need to read
+/* Give the blocks left in the reservation window of a file back to other allocations */
+void release_reservation(sfs_t * fs, int inodeIndex)
+{
+    for(int i = 0; i < fs->reserve_len[inodeIndex]; i++)
+    {
+        fs->reservedCACHE[fs->reserve_start[inodeIndex] + i] = 0;
+    }
+    fs->reserve_len[inodeIndex] = 0;
+}
 
-        // On a single block we can read    
-        int readlen = BLOCK_SIZE - fileptr_read;
+/* Give the blocks of every reservation window back, when nothing else is left to allocate */
+// Return the number of blocks given back
+int release_all_reservations(sfs_t * fs)
+{
+    int released = 0;
+    for(int i = 0; i < max_num_inodes; i++)
+    {
+        released = released + fs->reserve_len[i];
+        release_reservation(fs, i);
+    }
+    return released;
+}
 
-        // printf("Readlen %d\n", readlen);
+/* Find a random free block in the data blocks using the free bitmap */
+// Blocks reserved for other files are only used once every other free block is taken
+// Return DATA BLOCK index (need be added to starting data block index) on sucess
+// Return -1 if no more free data blocks
+// Take as argument an update free bitmap flag, set to 1 will update the freebitmap in cache and disk
+int find_free_data_block(sfs_t * fs, int updateFreebitmap)
+{
+    // Full disk, fail without looking at the free bitmap
+    if(fs->superblockCACHE->num_free_blocks == 0)
+    {
+        return -1;
+    }
 
-        /*-------------------------*/
-        /* Get datablock from disk */
-        /*-------------------------*/
-        char * datablock_fromdisk = (char *) malloc(BLOCK_SIZE);
-        // Copy content of current data block
-        read_blocks(data_starting_ind + datablock, 1, datablock_fromdisk);
-        
-        char * datablock_startread = datablock_fromdisk + fileptr_read;
+    // Log-structured mode, blocks are taken in the order of the log
+    if(fs->log_structured && updateFreebitmap)
+    {
+        return log_allocate_block(fs);
+    }
 
-        // Copy the smallest buffer size between block remaining space and total buffer remaining
-        if(readlen < remaining_len)
-        {            
-            memcpy(currentBufDest, datablock_startread, readlen);
-            readsize = readsize + readlen;
+    // Look at free bitmap from disk 
+    // We want to look at the data blocks in the range [data_starting_ind, index_last_data_block]
+    int total_data_blocks = num_data_blcks;
+    // Randomize starting index to verify in the data blocks 
+    int data_index = rand() % (total_data_blocks);
 
-            // Update the buffer destination to continue appending buffer
-            currentBufDest = currentBufDest + readlen;
+    for(int i = 0; i < total_data_blocks; i++)
+    {
+        // Wrap around to the first data block
+        data_index = data_index % total_data_blocks;
 
-            // Update the file ptr to the end of the read
-            openentry->fileptr = openentry->fileptr + readlen;
+        if(*(fs->freebitmapCACHE + data_starting_ind + data_index) == '1' && !fs->reservedCACHE[data_index])
+        {
+            if(updateFreebitmap)
+            {
+                // Make bit unvailable
+                update_freebitmap_CACHE_and_DISK(fs, data_starting_ind + data_index, 0);        
+            }
             
-            // Remaining remaining_len of buffer to be read from memory
-            remaining_len = remaining_len - readlen;
+            return data_index;
         }
-        else
+        else 
         {
-            memcpy(currentBufDest, datablock_startread, remaining_len);
-            readsize = readsize + remaining_len;
-
-            // Update the buffer destination to continue appending buffer
-            currentBufDest = currentBufDest + remaining_len;
-
-            // Update the file ptr to the end of the read
-            openentry->fileptr = openentry->fileptr + remaining_len;
-
-            // Remaining remaining_len of buffer to be read from memory
-            remaining_len = remaining_len - remaining_len;
+            data_index += 1;
         }
+    }
+    
+    // Every free block left is reserved
+    if(release_all_reservations(fs) > 0)
+    {
+        return find_free_data_block(fs, updateFreebitmap);
+    }
 
-        // Update fileptr_read to 0, because after first block read, the following reads will always be at 
-        // the beginning of the next block, therefore no offset in the block.
-        fileptr_read = 0;
+    // No more free data blocks
+    return -1;
+}
 
-        // Update the readblock index to next block in the list of blocks
-        readblockindex = readblockindex + 1;
+/* Find a run of adjacent free data blocks, looking from a goal block onwards */
+// The first run of maxlen blocks is taken, otherwise the longest run found
+// Blocks reserved for other files are only used once every other free block is taken
+// Return DATA BLOCK index of the run and its length in runlen, -1 if no more free data blocks
+int find_free_data_run(sfs_t * fs, int goal, int maxlen, int * runlen)
+{
+    if(fs->superblockCACHE->num_free_blocks == 0)
+    {
+        return -1;
     }
 
-    // Update the file inode on disk
-    save_inodetableCACHE_to_DISK(inodeIndex/inode_per_block);
-
-    return readsize;
-}
+    int best_start = -1;
+    int best_len = 0;
+    int run_start = -1;
+    int run_len = 0;
+    if(goal < 0 || goal >= num_data_blcks)
+    {
+        goal = 0;
+    }
 
-int sfs_fseek(int fileID, int loc)
-{   
-    int inodeIndex = -1;
-    // Verify if fileID is valid
-    if(fileID > -1 && fileID < MAX_OPEN_FILE)
+    // Runs don't wrap around, the scan past the end starts over from the first data block
+    for(int i = 0; i < num_data_blcks && best_len < maxlen; i++)
     {
-        if(open_fdt[fileID]->valid)
+        int data_index = (goal + i) % num_data_blcks;
+        if(data_index == 0)
         {
-            inodeIndex = open_fdt[fileID]->iptr;
-            // Get inode from cache  
-            i_node * in = inodetableCACHE[inodeIndex];
+            run_len = 0;
+        }
 
-            // If loc is out of range
-            if(loc < 0 || loc > in->size)
+        if(*(fs->freebitmapCACHE + data_starting_ind + data_index) == '1' && !fs->reservedCACHE[data_index])
+        {
+            if(run_len == 0)
             {
-                return -1;
+                run_start = data_index;
             }
-            else
+            run_len++;
+            if(run_len > best_len)
             {
-                open_fdt[fileID]->fileptr = 0;
+                best_start = run_start;
+                best_len = run_len;
             }
         }
-        else 
+        else
         {
-            // If the file does not contain valid information
-            return -1;
+            run_len = 0;
         }
     }
-    else 
+
+    if(best_start == -1)
     {
-        // Not valid ID
+        // Every free block left is reserved
+        if(release_all_reservations(fs) > 0)
+        {
+            return find_free_data_run(fs, goal, maxlen, runlen);
+        }
         return -1;
     }
-    
-    return 0;
+
+    *runlen = best_len;
+    return best_start;
 }
 
-int sfs_remove(char* file)
+/* Mark a run of free data blocks as used */
+// The free bitmap is written once at the end of the call
+void take_data_run(sfs_t * fs, int datablock, int len)
 {
-    int dir_inode_index = superblockCACHE->i_rootdir;
-    i_node * dir_inode = inodetableCACHE[dir_inode_index];
-    int dirIndex = -1;
-    
-    
-    /*------------------------*/
-    /* Find file in directory */
-    /*------------------------*/
-    // Loop through all files in the directory
-    for(int i = 0; i < dir_inode->size/sizeof(dir_entry); i++)
+    for(int i = 0; i < len; i++)
+    {
+        *(fs->freebitmapCACHE + data_starting_ind + datablock + i) = '0';
+        fs->reservedCACHE[datablock + i] = 0;
+    }
+    fs->superblockCACHE->num_free_blocks = fs->superblockCACHE->num_free_blocks - len;
+    fs->freebitmap_dirty = 1;
+    fs->superblock_dirty = 1;
+}
+
+/* Save the current inode table cache to the disk */
+// Take as argument the modified block index to save
+void save_inodetableCACHE_to_DISK(sfs_t * fs, int inodetable_blockIndex)
+{
+    // Copy the contents of the block in byte structure
+    char * inode_block = (char *) pool_get_buffer();
+
+    // Copy every inode of the block to be updated
+    for(int i = 0; i < inode_per_block; i++)
+    {
+        char * inode_block_temp = inode_block + i*sizeof(i_node);
+        
+        // Source
+        i_node * incache = fs->inodetableCACHE[inodetable_blockIndex*inode_per_block + i]; 
+        
+        // Target
+        i_node * indisk = (i_node *) inode_block_temp;
+        indisk->valid = incache->valid;
+        indisk->size = incache->size;
+        indisk->num_indirectptr = incache->num_indirectptr;
+        for(int j = 0; j < num_directptr; j++)
+        {
+            indisk->directptr[j] = incache->directptr[j];
+        }
+        indisk->indirectptr = incache->indirectptr;
+        indisk->flags = incache->flags;
+        memcpy(indisk->inline_data, incache->inline_data, INLINE_DATA_LEN);
+    }
+
+    // Log-structured mode, the block is written to the head of the log and the block it left is freed
+    // A block already in the segment the log is filling is written again where it is
+    int location = inode_block_location(fs->superblockCACHE, inodetable_blockIndex);
+    int oldlocation = fs->superblockCACHE->inode_map[inodetable_blockIndex];
+    int relocate = fs->log_structured && (oldlocation == 0 || !in_log_head_segment(fs, oldlocation - data_starting_ind));
+    int datablock = relocate ? log_allocate_block(fs) : -1;
+    if(datablock != -1)
+    {
+        location = data_starting_ind + datablock;
+    }
+    fs_write_blocks(fs, location, 1, inode_block, -1);
+    pool_put_buffer(inode_block);
+
+    if(datablock != -1)
+    {
+        fs->superblockCACHE->inode_map[inodetable_blockIndex] = location;
+        fs->superblock_dirty = 1;
+        if(oldlocation != 0)
+        {
+            release_data_block(fs, oldlocation - data_starting_ind);
+        }
+    }
+
+    // First write of this block since formatting, record it in the superblock
+    if(!(fs->superblockCACHE->inode_block_init & (1u << inodetable_blockIndex)))
+    {
+        fs->superblockCACHE->inode_block_init |= (1u << inodetable_blockIndex);
+        fs->superblock_dirty = 1;
+    }
+    
+    // Verify if it is a new block in the free bitmap cache 
+    // If the bit is set to '1', this block was free => update the block to be unavailable
+    if(*(fs->freebitmapCACHE + i_node_starting_ind + inodetable_blockIndex) == '1')
+    {    
+        update_freebitmap_CACHE_and_DISK(fs, i_node_starting_ind + inodetable_blockIndex, 0);
+    }
+}
+
+
+/* Hash of a name, the key of its entry in a directory */
+unsigned int dir_name_hash(const char * name)
+{
+    return crc32c(0, name, strlen(name));
+}
+
+/* Size of a directory entry packed in a leaf */
+int dir_entry_disk_len(dir_entry * entry)
+{
+    return DIR_ENTRY_HEADER_LEN + entry->name_len;
+}
+
+/* Unpack the directory entry at an offset of a leaf */
+// Return the offset of the next entry
+int dir_leaf_get(dir_node * leaf, int offset, dir_entry * entry)
+{
+    char * packed = leaf->u.entries + offset;
+    memcpy(&entry->hash, packed, sizeof(unsigned int));
+    memcpy(&entry->i_node, packed + 4, sizeof(int));
+    entry->name_len = (unsigned char) packed[8];
+    memcpy(entry->filename, packed + DIR_ENTRY_HEADER_LEN, entry->name_len);
+    entry->filename[entry->name_len] = '\0';
+    return offset + dir_entry_disk_len(entry);
+}
+
+/* Pack a directory entry at an offset of a leaf */
+// Return the offset of the next entry
+int dir_leaf_put(dir_node * leaf, int offset, dir_entry * entry)
+{
+    char * packed = leaf->u.entries + offset;
+    memcpy(packed, &entry->hash, sizeof(unsigned int));
+    memcpy(packed + 4, &entry->i_node, sizeof(int));
+    packed[8] = (unsigned char) entry->name_len;
+    memcpy(packed + DIR_ENTRY_HEADER_LEN, entry->filename, entry->name_len);
+    return offset + dir_entry_disk_len(entry);
+}
+
+/* Unpack every entry of a leaf */
+// entries must hold the number of entries of the leaf
+// Return the number of bytes the entries use in the leaf
+int dir_leaf_unpack(dir_node * leaf, dir_entry * entries)
+{
+    int offset = 0;
+    for(int i = 0; i < leaf->num_keys; i++)
+    {
+        offset = dir_leaf_get(leaf, offset, &entries[i]);
+    }
+    return offset;
+}
+
+/* Pack entries in a leaf, replacing its content */
+// The entries must fit in the leaf
+void dir_leaf_pack(dir_node * leaf, dir_entry * entries, int num_entries)
+{
+    int offset = 0;
+    for(int i = 0; i < num_entries; i++)
+    {
+        offset = dir_leaf_put(leaf, offset, &entries[i]);
+    }
+    // Bytes past the entries are 0
+    memset(leaf->u.entries + offset, 0, sizeof(leaf->u.entries) - offset);
+    leaf->num_keys = num_entries;
+}
+
+/* Read a node of a directory B+tree */
+// Return the node (to be given back to the pool), NULL if its block is corrupted
+dir_node * read_dir_node(sfs_t * fs, int datablock)
+{
+    dir_node * node = (dir_node *) pool_get_buffer();
+    if(fs_read_blocks(fs, data_starting_ind + datablock, 1, node) < 0)
+    {
+        pool_put_buffer(node);
+        return NULL;
+    }
+    return node;
+}
+
+void write_dir_node(sfs_t * fs, int datablock, dir_node * node)
+{
+    fs_write_blocks(fs, data_starting_ind + datablock, 1, node, -1);
+}
+
+/* Child of an internal node where the entries with a hash start */
+// Entries with the same hash can continue in the next children
+int dir_child_position(dir_node * node, unsigned int hash)
+{
+    // First key greater or equal to the hash
+    int low = 0;
+    int high = node->num_keys;
+    while(low < high)
+    {
+        int mid = (low + high) / 2;
+        if(node->u.index.keys[mid] < hash)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/* Find the leaf of a directory B+tree where the entries with a hash start */
+// path receives the DATA block index of the internal nodes from the root, pathpos the child followed in each
+// and pathnodes the nodes themselves if not NULL (to be given back to the pool)
+// Return the leaf (to be given back to the pool), NULL if the directory is empty or a node is corrupted
+dir_node * dir_find_leaf(sfs_t * fs, i_node * dir, unsigned int hash, int * leafblock,
+                         int * path, int * pathpos, dir_node ** pathnodes, int * depth)
+{
+    *depth = 0;
+    int block = dir->directptr[0];
+    if(block == -1)
+    {
+        return NULL;
+    }
+
+    dir_node * node = read_dir_node(fs, block);
+    while(node != NULL && !node->leaf && *depth < DIR_MAX_DEPTH)
+    {
+        int pos = dir_child_position(node, hash);
+        path[*depth] = block;
+        pathpos[*depth] = pos;
+        if(pathnodes != NULL)
+        {
+            pathnodes[*depth] = node;
+        }
+        (*depth)++;
+
+        block = node->u.index.children[pos];
+        if(pathnodes == NULL)
+        {
+            pool_put_buffer(node);
+        }
+        node = read_dir_node(fs, block);
+    }
+
+    if(node != NULL && !node->leaf)
+    {
+        // Deeper than any tree this file system can hold, the tree is corrupted
+        pool_put_buffer(node);
+        node = NULL;
+    }
+
+    if(node == NULL && pathnodes != NULL)
+    {
+        for(int i = 0; i < *depth; i++)
+        {
+            pool_put_buffer(pathnodes[i]);
+        }
+        *depth = 0;
+    }
+
+    *leafblock = block;
+    return node;
+}
+
+/* Find an entry of a directory */
+// Return the leaf holding it (to be given back to the pool) with its DATA block index and the position of the entry
+// Return NULL if there is no entry with this name
+dir_node * dir_find_entry(sfs_t * fs, i_node * dir, const char * name, int * leafblock, int * entrypos)
+{
+    unsigned int hash = dir_name_hash(name);
+    int name_len = strlen(name);
+    int path[DIR_MAX_DEPTH];
+    int pathpos[DIR_MAX_DEPTH];
+    int depth;
+
+    dir_node * node = dir_find_leaf(fs, dir, hash, leafblock, path, pathpos, NULL, &depth);
+    while(node != NULL)
     {
-        //Verify if directory entry is valid
-        if(directoryCACHE[i]->valid)
+        int offset = 0;
+        for(int i = 0; i < node->num_keys; i++)
         {
-            if(strcmp(directoryCACHE[i]->filename, file) == 0)
+            dir_entry entry;
+            offset = dir_leaf_get(node, offset, &entry);
+            if(entry.hash > hash)
+            {
+                pool_put_buffer(node);
+                return NULL;
+            }
+            if(entry.hash == hash && entry.name_len == name_len && memcmp(entry.filename, name, name_len) == 0)
             {
-                dirIndex = i;
+                *entrypos = i;
+                return node;
             }
         }
+
+        // Entries with the same hash can continue in the next leaf
+        int next = node->next;
+        pool_put_buffer(node);
+        if(next == -1)
+        {
+            return NULL;
+        }
+        *leafblock = next;
+        node = read_dir_node(fs, next);
     }
 
-    if(dirIndex == -1)
+    return NULL;
+}
+
+/* Find the i node of an entry of a directory */
+// Return the i node index, -1 if there is no entry with this name
+int dir_lookup(sfs_t * fs, int dirInodeIndex, const char * name)
+{
+    int leafblock;
+    int entrypos;
+    dir_node * leaf = dir_find_entry(fs, get_inode(fs, dirInodeIndex), name, &leafblock, &entrypos);
+    if(leaf == NULL)
     {
-        printf("Could not find file to remove\n");
         return -1;
     }
-    else
+
+    dir_entry * entries = (dir_entry *) malloc(leaf->num_keys * sizeof(dir_entry));
+    dir_leaf_unpack(leaf, entries);
+    int inodeIndex = entries[entrypos].i_node;
+    free(entries);
+    pool_put_buffer(leaf);
+    return inodeIndex;
+}
+
+/* Add an entry to a directory */
+// The name must not be in the directory already
+// Return 0 on success, -1 if there is no space left for the directory
+int dir_insert(sfs_t * fs, int dirInodeIndex, const char * name, int inodeIndex)
+{
+    i_node * dir = get_inode(fs, dirInodeIndex);
+
+    dir_entry newentry;
+    newentry.hash = dir_name_hash(name);
+    newentry.i_node = inodeIndex;
+    newentry.name_len = strlen(name);
+    memcpy(newentry.filename, name, newentry.name_len + 1);
+
+    /*-----------------*/
+    /* Empty directory */
+    /*-----------------*/
+    // The first entry gets a leaf, root of the tree
+    if(dir->directptr[0] == -1)
     {
-        i_node * file_inode = inodetableCACHE[directoryCACHE[dirIndex]->i_node];
-        // Get the number of blocks allocated for the file
-        // It will be the ceiling of the file size divided by the block size
-        int num_block_used = file_inode->size/BLOCK_SIZE + 1;
+        int rootblock = find_free_data_block(fs, 1);
+        if(rootblock == -1)
+        {
+            return -1;
+        }
 
-        /*------------------------------------*/
-        /* Free every data block for the file */
-        /*------------------------------------*/
-        // Iterate through the file's direct pointers
-        for(int i = 0; i < num_block_used && i < num_directptr; i++)
+        dir_node * root = (dir_node *) pool_get_buffer();
+        memset(root, 0, BLOCK_SIZE);
+        root->leaf = 1;
+        root->next = -1;
+        dir_leaf_pack(root, &newentry, 1);
+        write_dir_node(fs, rootblock, root);
+        pool_put_buffer(root);
+
+        dir->directptr[0] = rootblock;
+        dir->size = 1;
+        save_inodetableCACHE_to_DISK(fs, dirInodeIndex/inode_per_block);
+        fs->superblockCACHE->dir_num_elements = fs->superblockCACHE->dir_num_elements + 1;
+        return 0;
+    }
+
+    int path[DIR_MAX_DEPTH];
+    int pathpos[DIR_MAX_DEPTH];
+    dir_node * pathnodes[DIR_MAX_DEPTH];
+    int depth;
+    int leafblock;
+    dir_node * leaf = dir_find_leaf(fs, dir, newentry.hash, &leafblock, path, pathpos, pathnodes, &depth);
+    if(leaf == NULL)
+    {
+        return -1;
+    }
+
+    // Entries of the leaf with the new one
+    dir_entry * entries = (dir_entry *) malloc((leaf->num_keys + 1) * sizeof(dir_entry));
+    int leaf_len = dir_leaf_unpack(leaf, entries);
+    int fits = leaf_len + dir_entry_disk_len(&newentry) <= (int) sizeof(leaf->u.entries);
+
+    /*-------------------------------*/
+    /* Reserve the blocks for splits */
+    /*-------------------------------*/
+    // A full leaf splits, then each full node above it, up to a new root if they all are
+    // The blocks are found first so the tree is never left half split
+    int num_newblocks = 0;
+    if(!fits)
+    {
+        num_newblocks = 1;
+        int d = depth - 1;
+        while(d >= 0 && pathnodes[d]->num_keys == DIR_NODE_KEYS)
+        {
+            num_newblocks++;
+            d--;
+        }
+        if(d < 0)
+        {
+            num_newblocks++;
+        }
+    }
+
+    int newblocks[DIR_MAX_DEPTH + 2];
+    int r = 0;
+    if(num_newblocks > DIR_MAX_DEPTH + 1)
+    {
+        r = -1;
+    }
+    for(int i = 0; r == 0 && i < num_newblocks; i++)
+    {
+        newblocks[i] = find_free_data_block(fs, 1);
+        if(newblocks[i] == -1)
+        {
+            // No more space in the disk, give back the blocks already found
+            for(int j = 0; j < i; j++)
+            {
+                update_freebitmap_CACHE_and_DISK(fs, data_starting_ind + newblocks[j], 1);
+            }
+            r = -1;
+        }
+    }
+    if(r == -1)
+    {
+        free(entries);
+        pool_put_buffer(leaf);
+        for(int i = 0; i < depth; i++)
         {
-            int datablock = file_inode->directptr[i];
-            // Free the data blocks in the freebitmap 
-            // Set datablock to 1 (free)
-            update_freebitmap_CACHE_and_DISK(data_starting_ind + datablock, 1);
-        } 
+            pool_put_buffer(pathnodes[i]);
+        }
+        return -1;
+    }
+
+    /*------------------*/
+    /* Insert in a leaf */
+    /*------------------*/
+    // After the entries with a lower or the same hash
+    int pos = 0;
+    while(pos < leaf->num_keys && entries[pos].hash <= newentry.hash)
+    {
+        pos++;
+    }
+    memmove(&entries[pos + 1], &entries[pos], (leaf->num_keys - pos) * sizeof(dir_entry));
+    entries[pos] = newentry;
+    int num_entries = leaf->num_keys + 1;
+
+    // Key and DATA block index of the new node to add in the parent, if a node was split
+    unsigned int splitkey = 0;
+    int splitblock = -1;
+    int newblockIndex = 0;
 
-        // Verify if there are indirect pointers to free 
-        if(num_block_used > num_directptr)
+    if(fits)
+    {
+        dir_leaf_pack(leaf, entries, num_entries);
+        write_dir_node(fs, leafblock, leaf);
+    }
+    else
+    {
+        // Split the leaf in two, the entries after the middle byte go in a new leaf after it
+        // An entry is at most a quarter of a leaf plus a few bytes, both halves fit
+        int total_len = leaf_len + dir_entry_disk_len(&newentry);
+        int num_left = 0;
+        int left_len = 0;
+        while(left_len + dir_entry_disk_len(&entries[num_left]) <= total_len / 2)
         {
-            int indirectptr_block = file_inode->indirectptr;
+            left_len = left_len + dir_entry_disk_len(&entries[num_left]);
+            num_left++;
+        }
+        if(num_left == 0)
+        {
+            num_left = 1;
+        }
+
+        dir_node * right = (dir_node *) pool_get_buffer();
+        memset(right, 0, BLOCK_SIZE);
+        right->leaf = 1;
+        right->next = leaf->next;
+        dir_leaf_pack(right, &entries[num_left], num_entries - num_left);
 
-            char * indirectptr_fromdisk = (char *) malloc(BLOCK_SIZE);
-            read_blocks(data_starting_ind + indirectptr_block, 1, indirectptr_fromdisk);
+        splitblock = newblocks[newblockIndex++];
+        splitkey = entries[num_left].hash;
 
-            // Iterate through the files indirect pointers
-            for(int i = 0; i < file_inode->num_indirectptr; i++)
+        leaf->next = splitblock;
+        dir_leaf_pack(leaf, entries, num_left);
+
+        write_dir_node(fs, splitblock, right);
+        write_dir_node(fs, leafblock, leaf);
+        pool_put_buffer(right);
+    }
+    free(entries);
+    pool_put_buffer(leaf);
+
+    /*-------------------------------*/
+    /* Insert splits in parent nodes */
+    /*-------------------------------*/
+    for(int d = depth - 1; d >= 0; d--)
+    {
+        dir_node * node = pathnodes[d];
+        if(splitblock != -1)
+        {
+            // The new node goes right after the child that was split
+            int childpos = pathpos[d];
+            if(node->num_keys < DIR_NODE_KEYS)
+            {
+                memmove(&node->u.index.keys[childpos + 1], &node->u.index.keys[childpos],
+                        (node->num_keys - childpos) * sizeof(unsigned int));
+                memmove(&node->u.index.children[childpos + 2], &node->u.index.children[childpos + 1],
+                        (node->num_keys - childpos) * sizeof(int));
+                node->u.index.keys[childpos] = splitkey;
+                node->u.index.children[childpos + 1] = splitblock;
+                node->num_keys++;
+                write_dir_node(fs, path[d], node);
+                splitblock = -1;
+            }
+            else
             {
-                int datablock = ((indirect_ptr *) indirectptr_fromdisk)->datablockindex;  
-                // Free the data blocks in the freebitmap 
-                update_freebitmap_CACHE_and_DISK(data_starting_ind + datablock, 1);
+                // Split the node in two, the middle key goes up to the parent
+                unsigned int keys[DIR_NODE_KEYS + 1];
+                int children[DIR_NODE_KEYS + 2];
+                memcpy(keys, node->u.index.keys, childpos * sizeof(unsigned int));
+                keys[childpos] = splitkey;
+                memcpy(&keys[childpos + 1], &node->u.index.keys[childpos], (DIR_NODE_KEYS - childpos) * sizeof(unsigned int));
+                memcpy(children, node->u.index.children, (childpos + 1) * sizeof(int));
+                children[childpos + 1] = splitblock;
+                memcpy(&children[childpos + 2], &node->u.index.children[childpos + 1], (DIR_NODE_KEYS - childpos) * sizeof(int));
+
+                int mid = (DIR_NODE_KEYS + 1) / 2;
+                dir_node * right = (dir_node *) pool_get_buffer();
+                memset(right, 0, BLOCK_SIZE);
+                right->leaf = 0;
+                right->num_keys = DIR_NODE_KEYS - mid;
+                right->next = -1;
+                memcpy(right->u.index.keys, &keys[mid + 1], right->num_keys * sizeof(unsigned int));
+                memcpy(right->u.index.children, &children[mid + 1], (right->num_keys + 1) * sizeof(int));
+
+                node->num_keys = mid;
+                memcpy(node->u.index.keys, keys, mid * sizeof(unsigned int));
+                memcpy(node->u.index.children, children, (mid + 1) * sizeof(int));
+
+                splitkey = keys[mid];
+                splitblock = newblocks[newblockIndex++];
+                write_dir_node(fs, splitblock, right);
+                write_dir_node(fs, path[d], node);
+                pool_put_buffer(right);
             }
+        }
+        pool_put_buffer(node);
+    }
 
-            free(indirectptr_fromdisk);
-            
-            // Free the indirect pointer block
-            update_freebitmap_CACHE_and_DISK(data_starting_ind + indirectptr_block, 1);
+    /*----------------*/
+    /* Split the root */
+    /*----------------*/
+    // The tree grows by one level, the new root has the old one and the new node as children
+    if(splitblock != -1)
+    {
+        int rootblock = newblocks[newblockIndex++];
+        dir_node * root = (dir_node *) pool_get_buffer();
+        memset(root, 0, BLOCK_SIZE);
+        root->leaf = 0;
+        root->num_keys = 1;
+        root->next = -1;
+        root->u.index.keys[0] = splitkey;
+        root->u.index.children[0] = dir->directptr[0];
+        root->u.index.children[1] = splitblock;
+        write_dir_node(fs, rootblock, root);
+        pool_put_buffer(root);
+
+        dir->directptr[0] = rootblock;
+    }
+
+    dir->size = dir->size + 1;
+    save_inodetableCACHE_to_DISK(fs, dirInodeIndex/inode_per_block);
+    fs->superblockCACHE->dir_num_elements = fs->superblockCACHE->dir_num_elements + 1;
+
+    return 0;
+}
+
+/* Gather every node of a directory B+tree to be freed */
+// The DATA block indexes of the nodes are added to blocks
+void free_dir_tree(sfs_t * fs, int datablock, int * blocks, int * num_blocks)
+{
+    dir_node * node = read_dir_node(fs, datablock);
+    if(node != NULL && !node->leaf)
+    {
+        for(int i = 0; i <= node->num_keys; i++)
+        {
+            free_dir_tree(fs, node->u.index.children[i], blocks, num_blocks);
         }
+    }
+    pool_put_buffer(node);
 
-        /*------------------------------------*/
-        /* Remove file inode from inode table */
-        /*------------------------------------*/
-        // Invalidate cache entry
-        inodetableCACHE[directoryCACHE[dirIndex]->i_node]->valid = 0;
-        // Udpate cache 
-        save_inodetableCACHE_to_DISK(directoryCACHE[dirIndex]->i_node/inode_per_block);
+    blocks[(*num_blocks)++] = datablock;
+}
 
-        /*---------------------------------------*/
-        /* Remove directory entry from directory */
-        /*---------------------------------------*/
-        // Invalidate cache entry
-        directoryCACHE[dirIndex]->valid = 0;
-        // Update disk
-        save_directoryCACHE_to_DISK(dirIndex);
+/* Remove an entry from a directory */
+// Return 0 on success, -1 if there is no entry with this name
+int dir_remove(sfs_t * fs, int dirInodeIndex, const char * name)
+{
+    i_node * dir = get_inode(fs, dirInodeIndex);
+    int leafblock;
+    int entrypos;
+    dir_node * leaf = dir_find_entry(fs, dir, name, &leafblock, &entrypos);
+    if(leaf == NULL)
+    {
+        return -1;
+    }
 
+    dir->size = dir->size - 1;
+    fs->superblockCACHE->dir_num_elements = fs->superblockCACHE->dir_num_elements - 1;
 
-        /*-------------------*/
-        /* Update superblock */
-        /*-------------------*/
-        // Update superblock information in cache
-        superblockCACHE->dir_num_elements = superblockCACHE->dir_num_elements - 1;
-        superblockCACHE->num_inodes = superblockCACHE->num_inodes - 1;
-        // Udpate superblock to disk
-        write_blocks(0, 1, (char *) superblockCACHE);
+    if(dir->size > 0)
+    {
+        // Nodes are not merged when they get emptier, a lookup goes through empty leaves
+        dir_entry * entries = (dir_entry *) malloc(leaf->num_keys * sizeof(dir_entry));
+        dir_leaf_unpack(leaf, entries);
+        memmove(&entries[entrypos], &entries[entrypos + 1], (leaf->num_keys - entrypos - 1) * sizeof(dir_entry));
+        dir_leaf_pack(leaf, entries, leaf->num_keys - 1);
+        free(entries);
+        write_dir_node(fs, leafblock, leaf);
     }
-    
-    // printf("Successfully removed file\n");
+    else
+    {
+        // The last entry is gone, the whole tree is freed
+        int * freed_blocks = (int *) malloc(num_data_blcks * sizeof(int));
+        int num_freed_blocks = 0;
+        free_dir_tree(fs, dir->directptr[0], freed_blocks, &num_freed_blocks);
+        num_freed_blocks = release_data_blocks(fs, freed_blocks, num_freed_blocks);
+        dir->directptr[0] = -1;
+        if(fs->discard_online)
+        {
+            discard_freed_blocks(fs, freed_blocks, num_freed_blocks);
+        }
+        free(freed_blocks);
+    }
+    pool_put_buffer(leaf);
 
+    save_inodetableCACHE_to_DISK(fs, dirInodeIndex/inode_per_block);
     return 0;
-}
\ No newline at end of file
+}
+
+/* Find the nth entry of a directory, in hash order */
+// Return 0 and copy the entry, -1 if the directory has no more entries
+int dir_entry_at(sfs_t * fs, i_node * dir, int n, dir_entry * entry)
+{
+    int block = dir->directptr[0];
+    if(block == -1)
+    {
+        return -1;
+    }
+
+    // Go down to the first leaf, then follow the leaves
+    dir_node * node = read_dir_node(fs, block);
+    while(node != NULL && !node->leaf)
+    {
+        block = node->u.index.children[0];
+        pool_put_buffer(node);
+        node = read_dir_node(fs, block);
+    }
+
+    while(node != NULL)
+    {
+        if(n < node->num_keys)
+        {
+            int offset = 0;
+            for(int i = 0; i <= n; i++)
+            {
+                offset = dir_leaf_get(node, offset, entry);
+            }
+            pool_put_buffer(node);
+            return 0;
+        }
+        n = n - node->num_keys;
+
+        block = node->next;
+        pool_put_buffer(node);
+        node = block == -1 ? NULL : read_dir_node(fs, block);
+    }
+
+    return -1;
+}
+
+/* Find the i node of a path */
+// Paths start at the root directory, their components are separated by '/'
+// name receives the last component (MAX_FILENAME_LEN + 1 bytes), empty for the root directory
+// parentInodeIndex receives the directory that holds or would hold the last component,
+// -1 if one of the directories before it does not exist
+// Return the i node index, -1 if not found
+int resolve_path(sfs_t * fs, const char * path, int * parentInodeIndex, char * name)
+{
+    int inodeIndex = fs->superblockCACHE->i_rootdir;
+    *parentInodeIndex = -1;
+    name[0] = '\0';
+
+    const char * component = path;
+    while(*component != '\0')
+    {
+        while(*component == '/')
+        {
+            component++;
+        }
+        if(*component == '\0')
+        {
+            break;
+        }
+
+        const char * end = strchr(component, '/');
+        if(end == NULL)
+        {
+            end = component + strlen(component);
+        }
+        int len = end - component;
+
+        // Illegal length
+        if(len > MAX_FILENAME_LEN)
+        {
+            printf("Filename provided is too long. Max is %d but name is %d\n", MAX_FILENAME_LEN, len);
+            *parentInodeIndex = -1;
+            return -1;
+        }
+
+        // Every component before the last one must be an existing directory
+        if(inodeIndex == -1 || !(get_inode(fs, inodeIndex)->flags & INODE_DIR))
+        {
+            *parentInodeIndex = -1;
+            return -1;
+        }
+
+        memcpy(name, component, len);
+        name[len] = '\0';
+        *parentInodeIndex = inodeIndex;
+        inodeIndex = dir_lookup(fs, inodeIndex, name);
+
+        component = end;
+    }
+
+    return inodeIndex;
+}
+
+/* Create a file or a directory in a directory */
+// Return the i node index of the new file, -1 on failure
+int sfs_fcreate(sfs_t * fs, int dirInodeIndex, char* name, int flags)
+{
+    int inodeIndex = -1;
+    i_node * file_inode = NULL;
+
+    /*---------------------------*/
+    /* Verify inode availability */
+    /*---------------------------*/
+    if(fs->superblockCACHE->num_inodes == max_num_inodes)
+    {
+        // No i node available to create a new file
+        printf("Max inode number reached, cant create new file\n");
+        return -1; 
+    }
+    
+    /*----------------------*/
+    /* Find available inode */
+    /*----------------------*/
+    for(int i = 0; inodeIndex < 0 && i < max_num_inodes; i++)
+    {
+        i_node * in = get_inode(fs, i);
+        if(!(in->valid)) 
+        {
+            inodeIndex = i;
+            file_inode = in;
+        }   
+    }  
+
+    /*---------------------------*/
+    /* Update new inode in CACHE */
+    /*---------------------------*/
+    file_inode->valid = 1;
+    // Not yet written to file => size is 0
+    file_inode->size = 0;
+    for (int i = 0; i < num_directptr; i++)
+    {
+        file_inode->directptr[i] = -1;
+    }
+    file_inode->indirectptr = -1;
+    file_inode->num_indirectptr = 0;
+    file_inode->flags = flags;
+    memset(file_inode->inline_data, 0, INLINE_DATA_LEN);
+
+    /*-----------------------------------------------*/
+    /* Persist change to fs->inodetableCACHE to DISK */
+    /*-----------------------------------------------*/
+    // Get the block index of the inodetable element
+    int inodetable_block_ind = inodeIndex / inode_per_block;
+    save_inodetableCACHE_to_DISK(fs, inodetable_block_ind);
+
+    /*------------------*/
+    /* Add to directory */
+    /*------------------*/
+    int r = dir_insert(fs, dirInodeIndex, name, inodeIndex);
+    // Verify if error in the previous method
+    if(r == -1)
+    {
+        // No space left for the directory, the i node is available again
+        printf("No more space to add a directory entry\n");
+        file_inode->valid = 0;
+        save_inodetableCACHE_to_DISK(fs, inodetable_block_ind);
+        return -1;
+    }
+
+    /*-------------------*/
+    /* Update Superblock */
+    /*-------------------*/
+    // Add new i node entry, update number of valid i nodes in the superblock
+    // The number of directory entries was updated with the new entry
+    fs->superblockCACHE->num_inodes = fs->superblockCACHE->num_inodes + 1;
+    // Udpate superblock to disk
+    fs->superblock_dirty = 1;
+
+    return inodeIndex;
+}
+
+// We can only have one instance of the file opened at a time
+int fs_fopen(sfs_t * fs, char* name)
+{
+    int dirInodeIndex;
+    char filename[MAX_FILENAME_LEN + 1];
+
+    /*------------------*/
+    /* Find File i node */
+    /*------------------*/
+    int inodeIndex = resolve_path(fs, name, &dirInodeIndex, filename);
+
+    if(inodeIndex > -1 && (get_inode(fs, inodeIndex)->flags & INODE_DIR))
+    {
+        printf("Cant open directory %s as a file\n", name);
+        return -1;
+    }
+
+    /*-----------------*/
+    /* Create new file */
+    /*-----------------*/
+    if(inodeIndex == -1)
+    {
+        if(dirInodeIndex == -1)
+        {
+            printf("Could not find directory of file %s\n", name);
+            return -1;
+        }
+
+        // New files start with their content in the i node, until they outgrow it
+        int flags = INODE_INLINE;
+        if(fs->compression_enabled)
+        {
+            flags = flags | INODE_COMPRESSED;
+        }
+        inodeIndex = sfs_fcreate(fs, dirInodeIndex, filename, flags);
+    }
+
+    /*-----------------*/
+    /* Add to open FDT */
+    /*-----------------*/
+    if(inodeIndex > -1)
+    {
+        i_node * file_inode = get_inode(fs, inodeIndex);
+
+        int openIndex = -1;
+        for(int i = 0; i < MAX_OPEN_FILE; i++)
+        {
+            open_entry * open_e = fs->open_fdt[i];
+            // If entry is valid, verify if it points to the same file
+            if(open_e->valid)
+            {
+                if(open_e->iptr == inodeIndex)
+                {
+                    return i;
+                }
+            }
+            else
+            {
+                // If it is the first invalid entry, set the openIndex so we can add 
+                // the new file entry at this index if it is not already opened
+                if(openIndex == -1)
+                {
+                    openIndex = i;
+                }
+            }
+            
+        }
+        
+        // We can add the entry if we did not find the file in the open file table
+        if(openIndex > -1)
+        {
+            fs->open_fdt[openIndex]->valid = 1;
+            // Start the file ptr in append mode
+            fs->open_fdt[openIndex]->fileptr = file_inode->size;
+            // Associate the inode pointer to the current inode
+            fs->open_fdt[openIndex]->iptr = inodeIndex;
+
+            // Return the open fdt index
+            return openIndex;
+        }
+    }
+    
+    // Unsuccessful operation, return error
+    return -1;
+}
+
+int fs_fclose(sfs_t * fs, int fileID)
+{
+    if(fileID > -1 && fileID < MAX_OPEN_FILE)
+    {
+        open_entry * open_e = fs->open_fdt[fileID];
+        if(open_e->valid == 0)
+        {
+            // Already closed file
+            return -1;
+        }
+        open_e->valid = 0;
+        // The file is done being appended to, for now
+        release_reservation(fs, open_e->iptr);
+
+        return 0;
+    }
+
+    // If fileID is not in the appropriate range, return error -1
+    return -1;
+}
+
+/* Pointers of the indirect block of a file */
+// Loaded on first use during an operation and written back once at the end of it
+typedef struct INDIRECT_BLOCK_MAP
+{
+    int loaded;
+    int dirty;
+    // The indirect block was taken during the operation, it is not moved to the head of the log again
+    int fresh;
+    // The indirect block failed its checksum or holds pointers out of the data blocks, its entries read as holes
+    int damaged;
+    int datablockindex[BLOCK_SIZE/sizeof(indirect_ptr)];
+} indirect_map;
+
+void init_indirect_map(indirect_map * map)
+{
+    map->loaded = 0;
+    map->dirty = 0;
+    map->fresh = 0;
+    map->damaged = 0;
+}
+
+/* Load the indirect pointer entries of the i node in the map */
+// Entries past the number of indirect pointers of the i node are holes (-1)
+// A block that fails its checksum or points out of the data blocks leaves every entry a hole
+// and the map damaged, it is never written back and the blocks it points to are left to fsck
+// Return 0 on success, -1 if the map is damaged
+int load_indirect_map(sfs_t * fs, i_node * in, indirect_map * map)
+{
+    if(map->loaded)
+    {
+        return map->damaged ? -1 : 0;
+    }
+
+    for(int i = 0; i < indirectptr_per_block; i++)
+    {
+        map->datablockindex[i] = -1;
+    }
+
+    if(in->indirectptr != -1)
+    {
+        char * indirectptr_fromdisk = (char *) pool_get_buffer();
+        if(fs_read_blocks(fs, data_starting_ind + in->indirectptr, 1, indirectptr_fromdisk) < 0 ||
+           in->num_indirectptr > indirectptr_per_block)
+        {
+            map->damaged = 1;
+        }
+        for(int i = 0; i < in->num_indirectptr && !map->damaged; i++)
+        {
+            int datablock = ((indirect_ptr *) (indirectptr_fromdisk + i * sizeof(indirect_ptr)))->datablockindex;
+            if(datablock < COMPRESSED_BLOCK || datablock >= num_data_blcks)
+            {
+                map->damaged = 1;
+                break;
+            }
+            map->datablockindex[i] = datablock;
+        }
+        pool_put_buffer(indirectptr_fromdisk);
+
+        if(map->damaged)
+        {
+            printf("Indirect pointer block %d of a file is damaged\n", data_starting_ind + in->indirectptr);
+            for(int i = 0; i < indirectptr_per_block; i++)
+            {
+                map->datablockindex[i] = -1;
+            }
+        }
+    }
+
+    map->loaded = 1;
+    return map->damaged ? -1 : 0;
+}
+
+/* Write the indirect pointer block of the i node if the map was modified */
+// In log-structured mode the block moves to the head of the log, unless it is already in the segment
+// the log is filling, the i node is updated in memory and the caller saves it
+void save_indirect_map(sfs_t * fs, i_node * in, indirect_map * map)
+{
+    if(!map->dirty || map->damaged)
+    {
+        return;
+    }
+
+    if(fs->log_structured && !map->fresh && !in_log_head_segment(fs, in->indirectptr))
+    {
+        int datablock = log_allocate_block(fs);
+        if(datablock != -1)
+        {
+            release_data_block(fs, in->indirectptr);
+            in->indirectptr = datablock;
+            map->fresh = 1;
+        }
+    }
+
+    char * indirectptr_todisk = (char *) pool_get_buffer();
+    for(int i = 0; i < indirectptr_per_block; i++)
+    {
+        ((indirect_ptr *) (indirectptr_todisk + i * sizeof(indirect_ptr)))->datablockindex = map->datablockindex[i];
+    }
+    fs_write_blocks(fs, data_starting_ind + in->indirectptr, 1, indirectptr_todisk, -1);
+    pool_put_buffer(indirectptr_todisk);
+
+    map->dirty = 0;
+}
+
+/* Find the data block holding a block of a file */
+// Return DATA BLOCK index, or -1 if the file block is a hole (never written)
+int get_file_block(sfs_t * fs, i_node * in, indirect_map * map, int fileblockIndex)
+{
+    if(fileblockIndex < num_directptr)
+    {
+        return in->directptr[fileblockIndex];
+    }
+
+    // Nothing past the direct pointers was ever written
+    if(in->indirectptr == -1 || fileblockIndex - num_directptr >= in->num_indirectptr)
+    {
+        return -1;
+    }
+
+    load_indirect_map(fs, in, map);
+    return map->datablockindex[fileblockIndex - num_directptr];
+}
+
+/* Unmap the blocks of a file from a block to its end */
+// Pointers from fileblockIndex on become holes, the indirect pointer block goes too once none of its entries is left
+// The i node and the map are updated in memory only, the caller saves them before releasing the blocks
+// blocks receives the DATA block indexes unmapped, it must hold num_directptr + indirectptr_per_block + 1 entries
+// Return the number of blocks unmapped
+int unmap_file_blocks(sfs_t * fs, i_node * in, indirect_map * map, int fileblockIndex, int * blocks)
+{
+    int num_blocks = 0;
+
+    // Holes and compressed block markers have no block to free
+    for(int i = fileblockIndex; i < num_directptr; i++)
+    {
+        if(in->directptr[i] >= 0)
+        {
+            blocks[num_blocks++] = in->directptr[i];
+        }
+        in->directptr[i] = -1;
+    }
+
+    // The blocks of a damaged indirect pointer block stay allocated, fsck recovers them
+    if(in->indirectptr != -1 && load_indirect_map(fs, in, map) == 0)
+    {
+        int first = fileblockIndex > num_directptr ? fileblockIndex - num_directptr : 0;
+        for(int i = first; i < in->num_indirectptr; i++)
+        {
+            if(map->datablockindex[i] >= 0)
+            {
+                blocks[num_blocks++] = map->datablockindex[i];
+            }
+            map->datablockindex[i] = -1;
+            map->dirty = 1;
+        }
+
+        if(first == 0)
+        {
+            blocks[num_blocks++] = in->indirectptr;
+            in->indirectptr = -1;
+            in->num_indirectptr = 0;
+            map->dirty = 0;
+        }
+        else if(first < in->num_indirectptr)
+        {
+            in->num_indirectptr = first;
+        }
+    }
+
+    return num_blocks;
+}
+
+/* Make sure the i node has an indirect pointer block */
+// Return 0 on success, -1 if no data block is available for it or it is damaged
+int ensure_indirect_block(sfs_t * fs, i_node * in, indirect_map * map)
+{
+    if(load_indirect_map(fs, in, map) == -1)
+    {
+        return -1;
+    }
+
+    if(in->indirectptr == -1)
+    {
+        int indirectptrblock = find_free_data_block(fs, 1);
+        if(indirectptrblock == -1)
+        {
+            return -1;
+        }
+        in->indirectptr = indirectptrblock;
+        // Every entry of the new block is a hole
+        map->dirty = 1;
+        map->fresh = 1;
+    }
+
+    return 0;
+}
+
+/* Point a block of a file to a data block (or -1 for a hole, COMPRESSED_BLOCK in a compressed cluster) */
+// The i node and the map are updated in memory only, the caller saves them
+// Return 0 on success, -1 if the block is past the max file size or the indirect pointer block can't be allocated or is damaged
+int set_file_block(sfs_t * fs, i_node * in, indirect_map * map, int fileblockIndex, int datablock)
+{
+    if(fileblockIndex < num_directptr)
+    {
+        in->directptr[fileblockIndex] = datablock;
+        return 0;
+    }
+
+    int indirectptrIndex = fileblockIndex - num_directptr;
+    if(indirectptrIndex >= indirectptr_per_block)
+    {
+        return -1;
+    }
+
+    // Nothing to record for a hole if nothing past the direct pointers was ever written
+    if(datablock == -1 && in->indirectptr == -1)
+    {
+        return 0;
+    }
+
+    // First block past the direct pointers, the indirect pointer block is needed
+    if(ensure_indirect_block(fs, in, map) == -1)
+    {
+        return -1;
+    }
+
+    map->datablockindex[indirectptrIndex] = datablock;
+    map->dirty = 1;
+    // Entries in use go up to the last mapped block, the ones in between can be holes
+    if(datablock != -1 && indirectptrIndex >= in->num_indirectptr)
+    {
+        in->num_indirectptr = indirectptrIndex + 1;
+    }
+
+    return 0;
+}
+
+/* Allocate a data block for a hole of the file being written */
+// A block appended to the file is taken from its reservation window, a new window is
+// reserved after the previous block of the file when the old one is used up
+// The i node and the map are updated in memory only, the caller saves them
+// Return DATA BLOCK index on success, -1 if the disk is full or the block is past the max file size
+int map_file_block(sfs_t * fs, i_node * in, indirect_map * map, int fileblockIndex)
+{
+    int inodeIndex = fs->writing_inode;
+
+    // Block following the previous block of the file on the disk
+    int goal = -1;
+    if(fileblockIndex > 0)
+    {
+        int prevblock = get_file_block(fs, in, map, fileblockIndex - 1);
+        if(prevblock >= 0)
+        {
+            goal = prevblock + 1;
+        }
+    }
+
+    int datablock = -1;
+    if(fs->log_structured)
+    {
+        // Next block of the log, wherever the previous block of the file is
+        datablock = find_free_data_block(fs, 1);
+        if(datablock == -1)
+        {
+            return -1;
+        }
+    }
+    else if(fs->reserve_len[inodeIndex] > 0 && (goal == -1 || goal == fs->reserve_start[inodeIndex]))
+    {
+        // Next block of the window
+        datablock = fs->reserve_start[inodeIndex];
+        fs->reserve_start[inodeIndex]++;
+        fs->reserve_len[inodeIndex]--;
+        take_data_run(fs, datablock, 1);
+    }
+    else if(fileblockIndex * BLOCK_SIZE >= in->size)
+    {
+        // Appended block out of the window, start a new one
+        release_reservation(fs, inodeIndex);
+        int runlen;
+        datablock = find_free_data_run(fs, goal, RESERVE_WINDOW_BLOCKS, &runlen);
+        if(datablock == -1)
+        {
+            return -1;
+        }
+        take_data_run(fs, datablock, 1);
+
+        fs->reserve_start[inodeIndex] = datablock + 1;
+        fs->reserve_len[inodeIndex] = runlen - 1;
+        for(int i = 1; i < runlen; i++)
+        {
+            fs->reservedCACHE[datablock + i] = 1;
+        }
+    }
+    else
+    {
+        // Hole inside the file, next to the previous block if it is free
+        if(goal >= 0 && goal < num_data_blcks && *(fs->freebitmapCACHE + data_starting_ind + goal) == '1' &&
+           !fs->reservedCACHE[goal])
+        {
+            datablock = goal;
+            take_data_run(fs, datablock, 1);
+        }
+        else
+        {
+            datablock = find_free_data_block(fs, 1);
+        }
+        if(datablock == -1)
+        {
+            return -1;
+        }
+    }
+
+    if(set_file_block(fs, in, map, fileblockIndex, datablock) == -1)
+    {
+        update_freebitmap_CACHE_and_DISK(fs, data_starting_ind + datablock, 1);
+        return -1;
+    }
+
+    return datablock;
+}
+
+/* Move the content of an inline file to a data block */
+// The file then uses blocks like any other file, the i node is updated in memory only
+// Return 0 on success, -1 if no data block is available
+int move_inline_data_to_block(sfs_t * fs, i_node * in)
+{
+    // Nothing but zeros, the first block is a hole
+    if(!is_zero_buffer(in->inline_data, in->size))
+    {
+        int datablock = find_free_data_block(fs, 1);
+        if(datablock == -1)
+        {
+            return -1;
+        }
+
+        char * datablock_todisk = (char *) pool_get_buffer();
+        memset(datablock_todisk, 0, BLOCK_SIZE);
+        memcpy(datablock_todisk, in->inline_data, in->size);
+        fs_write_blocks(fs, data_starting_ind + datablock, 1, datablock_todisk, fs->writing_inode);
+        pool_put_buffer(datablock_todisk);
+
+        in->directptr[0] = datablock;
+    }
+
+    in->flags = in->flags & ~INODE_INLINE;
+    memset(in->inline_data, 0, INLINE_DATA_LEN);
+    return 0;
+}
+
+/* Get the pointers of the blocks of a cluster of a compressed file */
+void get_cluster_slots(sfs_t * fs, i_node * in, indirect_map * map, int cluster, int * slots)
+{
+    for(int i = 0; i < CLUSTER_BLOCKS; i++)
+    {
+        slots[i] = get_file_block(fs, in, map, cluster * CLUSTER_BLOCKS + i);
+    }
+}
+
+/* Verify if a cluster is stored compressed */
+// The blocks following the compressed data of a cluster are marked COMPRESSED_BLOCK,
+// the last block of a compressed cluster is always one of them
+int cluster_is_compressed(int * slots)
+{
+    return slots[CLUSTER_BLOCKS - 1] == COMPRESSED_BLOCK;
+}
+
+/* Read the content of a cluster */
+// clusterbuf holds CLUSTER_BLOCKS blocks, holes and bytes past the compressed data read as zeros
+// Return 0 on success, -1 if a block does not match its checksum or the compressed data is corrupted
+int read_cluster(sfs_t * fs, int * slots, char * clusterbuf)
+{
+    memset(clusterbuf, 0, CLUSTER_BLOCKS * BLOCK_SIZE);
+
+    if(!cluster_is_compressed(slots))
+    {
+        for(int i = 0; i < CLUSTER_BLOCKS; i++)
+        {
+            if(slots[i] >= 0 && fs_read_blocks(fs, data_starting_ind + slots[i], 1, clusterbuf + i * BLOCK_SIZE) < 0)
+            {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    // Compressed stream: length of the compressed data followed by the data
+    char * stream = (char *) pool_get_buffer();
+    int num_stream_blocks = 0;
+    while(num_stream_blocks < CLUSTER_BLOCKS && slots[num_stream_blocks] >= 0)
+    {
+        if(fs_read_blocks(fs, data_starting_ind + slots[num_stream_blocks], 1, stream + num_stream_blocks * BLOCK_SIZE) < 0)
+        {
+            pool_put_buffer(stream);
+            return -1;
+        }
+        num_stream_blocks++;
+    }
+
+    int compressed_len = *((int *) stream);
+    int r = -1;
+    if(compressed_len >= 0 && compressed_len <= num_stream_blocks * BLOCK_SIZE - (int) sizeof(int))
+    {
+        r = lz_decompress(stream + sizeof(int), compressed_len, clusterbuf, CLUSTER_BLOCKS * BLOCK_SIZE);
+    }
+    pool_put_buffer(stream);
+
+    if(r < 0)
+    {
+        printf("Corrupted compressed cluster\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Store the content of a cluster in as few blocks as possible */
+// valid is the number of bytes of the cluster holding file content, the rest of clusterbuf is zeros
+// The cluster is compressed if this saves at least one block, otherwise its blocks are stored as is
+// Blocks already used by the cluster are overwritten before new ones are allocated
+// The i node and the map are updated in memory only, the caller saves them
+// Return 0 on success, -1 if no data block is available (the cluster is left as it was)
+int store_cluster(sfs_t * fs, i_node * in, indirect_map * map, int cluster, int * slots, const char * clusterbuf, int valid)
+{
+    int newslots[CLUSTER_BLOCKS];
+    // Content written to each block needing one
+    const char * blockcontent[CLUSTER_BLOCKS];
+    char * stream = NULL;
+
+    for(int i = 0; i < CLUSTER_BLOCKS; i++)
+    {
+        newslots[i] = -1;
+    }
+
+    if(!is_zero_buffer(clusterbuf, valid))
+    {
+        // Keep the compressed data only if it leaves at least one block of the cluster unused
+        stream = (char *) pool_get_buffer();
+        memset(stream, 0, CLUSTER_BLOCKS * BLOCK_SIZE);
+        int max_compressed_len = (CLUSTER_BLOCKS - 1) * BLOCK_SIZE - sizeof(int);
+        int compressed_len = lz_compress(clusterbuf, valid, stream + sizeof(int), max_compressed_len);
+
+        if(compressed_len >= 0)
+        {
+            *((int *) stream) = compressed_len;
+            int num_stream_blocks = (compressed_len + sizeof(int) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            for(int i = 0; i < CLUSTER_BLOCKS; i++)
+            {
+                newslots[i] = i < num_stream_blocks ? 0 : COMPRESSED_BLOCK;
+                blockcontent[i] = stream + i * BLOCK_SIZE;
+            }
+        }
+        else
+        {
+            // Blocks with nothing but zeros stay holes
+            for(int i = 0; i < CLUSTER_BLOCKS; i++)
+            {
+                int blockvalid = valid - i * BLOCK_SIZE;
+                if(blockvalid > BLOCK_SIZE)
+                {
+                    blockvalid = BLOCK_SIZE;
+                }
+                if(blockvalid > 0 && !is_zero_buffer(clusterbuf + i * BLOCK_SIZE, blockvalid))
+                {
+                    newslots[i] = 0;
+                }
+                blockcontent[i] = clusterbuf + i * BLOCK_SIZE;
+            }
+        }
+    }
+
+    /*---------------------*/
+    /* Find the new blocks */
+    /*---------------------*/
+    // Blocks of the cluster that can be reused, shared blocks are never written in place
+    // and no block is in log-structured mode
+    int oldblocks[CLUSTER_BLOCKS];
+    int num_oldblocks = 0;
+    int sharedblocks[CLUSTER_BLOCKS];
+    int num_sharedblocks = 0;
+    for(int i = 0; i < CLUSTER_BLOCKS; i++)
+    {
+        if(slots[i] >= 0 && (fs->refcountCACHE[slots[i]] > 0 || fs->log_structured))
+        {
+            sharedblocks[num_sharedblocks++] = slots[i];
+        }
+        else if(slots[i] >= 0)
+        {
+            oldblocks[num_oldblocks++] = slots[i];
+        }
+    }
+
+    // The indirect pointer block must exist before anything is written
+    int has_blocks = 0;
+    for(int i = 0; i < CLUSTER_BLOCKS; i++)
+    {
+        has_blocks = has_blocks || newslots[i] >= 0;
+    }
+    if(has_blocks && cluster * CLUSTER_BLOCKS >= num_directptr && ensure_indirect_block(fs, in, map) == -1)
+    {
+        pool_put_buffer(stream);
+        return -1;
+    }
+
+    int reused = 0;
+    int allocated[CLUSTER_BLOCKS];
+    int num_allocated = 0;
+    for(int i = 0; i < CLUSTER_BLOCKS; i++)
+    {
+        if(newslots[i] < 0)
+        {
+            continue;
+        }
+
+        if(reused < num_oldblocks)
+        {
+            newslots[i] = oldblocks[reused++];
+        }
+        else
+        {
+            newslots[i] = find_free_data_block(fs, 1);
+            if(newslots[i] == -1)
+            {
+                // Give back the blocks allocated for this cluster
+                for(int j = 0; j < num_allocated; j++)
+                {
+                    update_freebitmap_CACHE_and_DISK(fs, data_starting_ind + allocated[j], 1);
+                }
+                pool_put_buffer(stream);
+                return -1;
+            }
+            allocated[num_allocated++] = newslots[i];
+        }
+    }
+
+    /*----------------------*/
+    /* Write the new blocks */
+    /*----------------------*/
+    for(int i = 0; i < CLUSTER_BLOCKS; i++)
+    {
+        if(newslots[i] >= 0)
+        {
+            fs_write_blocks(fs, data_starting_ind + newslots[i], 1, (void *) blockcontent[i], fs->writing_inode);
+        }
+        set_file_block(fs, in, map, cluster * CLUSTER_BLOCKS + i, newslots[i]);
+    }
+
+    // Blocks of the cluster no longer needed
+    int unused[2 * CLUSTER_BLOCKS];
+    int num_unused = 0;
+    for(int i = reused; i < num_oldblocks; i++)
+    {
+        unused[num_unused++] = oldblocks[i];
+    }
+    for(int i = 0; i < num_sharedblocks; i++)
+    {
+        unused[num_unused++] = sharedblocks[i];
+    }
+    release_data_blocks(fs, unused, num_unused);
+
+    pool_put_buffer(stream);
+    return 0;
+}
+
+/* Position in the buffers holding the content of a read or a write */
+typedef struct IO_CURSOR
+{
+    const sfs_iovec * iov;
+    int iovcnt;
+    // Buffer of the next byte and offset of the byte in it
+    int index;
+    int pos;
+} io_cursor;
+
+void init_io_cursor(io_cursor * cursor, const sfs_iovec * iov, int iovcnt)
+{
+    cursor->iov = iov;
+    cursor->iovcnt = iovcnt;
+    cursor->index = 0;
+    cursor->pos = 0;
+}
+
+/* Bytes following each other at the cursor, up to the end of its buffer */
+// Return a pointer to them and their count in len, 0 past the last buffer
+char * io_cursor_span(io_cursor * cursor, int * len)
+{
+    // Empty buffers are skipped
+    while(cursor->index < cursor->iovcnt && cursor->pos == cursor->iov[cursor->index].len)
+    {
+        cursor->index++;
+        cursor->pos = 0;
+    }
+    if(cursor->index == cursor->iovcnt)
+    {
+        *len = 0;
+        return NULL;
+    }
+
+    *len = cursor->iov[cursor->index].len - cursor->pos;
+    return (char *) cursor->iov[cursor->index].base + cursor->pos;
+}
+
+/* Copy length bytes from the buffers at the cursor to dst, or only skip them if dst is NULL */
+void io_cursor_read(io_cursor * cursor, char * dst, int length)
+{
+    while(length > 0)
+    {
+        int len;
+        char * span = io_cursor_span(cursor, &len);
+        if(len == 0)
+        {
+            return;
+        }
+        if(len > length)
+        {
+            len = length;
+        }
+        if(dst != NULL)
+        {
+            memcpy(dst, span, len);
+            dst = dst + len;
+        }
+        cursor->pos = cursor->pos + len;
+        length = length - len;
+    }
+}
+
+/* Copy length bytes of src to the buffers at the cursor, or zeros if src is NULL */
+void io_cursor_write(io_cursor * cursor, const char * src, int length)
+{
+    while(length > 0)
+    {
+        int len;
+        char * span = io_cursor_span(cursor, &len);
+        if(len == 0)
+        {
+            return;
+        }
+        if(len > length)
+        {
+            len = length;
+        }
+        if(src != NULL)
+        {
+            memcpy(span, src, len);
+            src = src + len;
+        }
+        else
+        {
+            memset(span, 0, len);
+        }
+        cursor->pos = cursor->pos + len;
+        length = length - len;
+    }
+}
+
+/* Total length of a list of buffers */
+// Return -1 if the list is too long, a buffer has a negative length or the total does not fit an int
+int iovec_length(const sfs_iovec * iov, int iovcnt)
+{
+    if(iovcnt < 0 || iovcnt > SFS_IOV_MAX || (iovcnt > 0 && iov == NULL))
+    {
+        return -1;
+    }
+
+    int length = 0;
+    for(int i = 0; i < iovcnt; i++)
+    {
+        if(iov[i].len < 0 || iov[i].len > 0x7FFFFFFF - length)
+        {
+            return -1;
+        }
+        length = length + iov[i].len;
+    }
+    return length;
+}
+
+/* Write to a compressed file */
+// Every cluster touched is read, modified, then compressed and stored again
+// The i node and the map are updated in memory only, the caller saves them
+// Return the number of bytes written
+int write_compressed(sfs_t * fs, i_node * inode, indirect_map * map, int fileptr, io_cursor * src, int length)
+{
+    int cluster_size = CLUSTER_BLOCKS * BLOCK_SIZE;
+    char * clusterbuf = (char *) pool_get_buffer();
+    int writesize = 0;
+
+    while(writesize < length)
+    {
+        int cluster = fileptr / cluster_size;
+        int cluster_start = cluster * cluster_size;
+        int offset = fileptr - cluster_start;
+
+        int writelen = cluster_size - offset;
+        if(writelen > length - writesize)
+        {
+            writelen = length - writesize;
+        }
+
+        // Bytes of the cluster holding file content before and after the write
+        int oldvalid = inode->size - cluster_start;
+        if(oldvalid < 0)
+        {
+            oldvalid = 0;
+        }
+        if(oldvalid > cluster_size)
+        {
+            oldvalid = cluster_size;
+        }
+        int newvalid = offset + writelen > oldvalid ? offset + writelen : oldvalid;
+
+        int slots[CLUSTER_BLOCKS];
+        get_cluster_slots(fs, inode, map, cluster, slots);
+
+        // The current content is only needed if the write does not replace all of it
+        if(offset == 0 && writelen >= oldvalid)
+        {
+            memset(clusterbuf, 0, cluster_size);
+        }
+        else if(read_cluster(fs, slots, clusterbuf) == -1)
+        {
+            break;
+        }
+
+        io_cursor_read(src, clusterbuf + offset, writelen);
+
+        if(store_cluster(fs, inode, map, cluster, slots, clusterbuf, newvalid) == -1)
+        {
+            // No more space in the disk
+            printf("No more space to create a datablock\n");
+            break;
+        }
+
+        writesize = writesize + writelen;
+        fileptr = fileptr + writelen;
+        if(fileptr > inode->size)
+        {
+            inode->size = fileptr;
+        }
+    }
+
+    pool_put_buffer(clusterbuf);
+    return writesize;
+}
+
+/* Write in a file at an offset, from the buffers of a list one after the other */
+// The file grows if the write goes past its end
+// Blocks written to adjacent data blocks are gathered and written with a single request
+// Return the number of bytes written
+int write_file_vec(sfs_t * fs, int inodeIndex, const sfs_iovec * iov, int iovcnt, int length, int offset)
+{
+    int fileptr = offset;
+    // Get the inode from the cache (always up to date)
+    i_node * inode = get_inode(fs, inodeIndex);
+    // Content blocks written from now on belong to this file
+    fs->writing_inode = inodeIndex;
+
+    int writesize = 0;
+    io_cursor src;
+    init_io_cursor(&src, iov, iovcnt);
+
+    // Content past the maximum file size can not be written
+    int remaining_len = length;
+    if(remaining_len > max_file_size - fileptr)
+    {
+        remaining_len = max_file_size - fileptr;
+    }
+
+    /*-------------*/
+    /* Inline file */
+    /*-------------*/
+    if(inode->flags & INODE_INLINE)
+    {
+        if(fileptr + remaining_len <= INLINE_DATA_LEN)
+        {
+            // Still fits in the i node, only the i node table is written
+            io_cursor_read(&src, inode->inline_data + fileptr, remaining_len);
+            fileptr = fileptr + remaining_len;
+            if(fileptr > inode->size)
+            {
+                inode->size = fileptr;
+            }
+            save_inodetableCACHE_to_DISK(fs, inodeIndex/inode_per_block);
+            return remaining_len;
+        }
+
+        // The file outgrows its i node
+        if(move_inline_data_to_block(fs, inode) == -1)
+        {
+            printf("No more space to create a datablock\n");
+            return 0;
+        }
+    }
+
+    indirect_map map;
+    init_indirect_map(&map);
+    char * datablock_fromdisk = (char *) pool_get_buffer();
+    // Blocks waiting to be written, to the data blocks following run_start
+    char * run = (char *) pool_get_buffer();
+    int run_start = 0;
+    int run_len = 0;
+
+    if(inode->flags & INODE_COMPRESSED)
+    {
+        writesize = write_compressed(fs, inode, &map, fileptr, &src, remaining_len);
+        fileptr = fileptr + writesize;
+        remaining_len = 0;
+    }
+
+    while(remaining_len > 0)
+    {
+        // Block of the file holding the file ptr and offset of the file ptr in this block
+        int writeblockindex = fileptr/BLOCK_SIZE;
+        int fileptr_write = fileptr % BLOCK_SIZE;
+
+        // Copy the smallest size between block remaining space and total buffer remaining
+        int writelen = BLOCK_SIZE - fileptr_write;
+        if(writelen > remaining_len)
+        {
+            writelen = remaining_len;
+        }
+
+        /*----------------*/
+        /* Get data block */
+        /*----------------*/
+        int datablock = get_file_block(fs, inode, &map, writeblockindex);
+
+        if(datablock == -1 || writelen == BLOCK_SIZE)
+        {
+            // The rest of a new block reads as zeros, whatever was on the disk before
+            memset(datablock_fromdisk, 0, BLOCK_SIZE);
+        }
+        else if(fs_read_blocks(fs, data_starting_ind + datablock, 1, datablock_fromdisk) < 0)
+        {
+            // Partial block write, copy content of current data block
+            // A corrupted block is not written over, the rest of it can't be trusted
+            break;
+        }
+        io_cursor_read(&src, datablock_fromdisk + fileptr_write, writelen);
+
+        // Zeros written in a hole already read as zeros, the block stays a hole
+        if(datablock != -1 || !is_zero_buffer(datablock_fromdisk + fileptr_write, writelen))
+        {
+            // A full block identical to one already on disk shares it instead of being written
+            int sharedblock = -1;
+            unsigned int fingerprint = 0;
+            if(fs->dedup_enabled && writelen == BLOCK_SIZE)
+            {
+                fingerprint = block_checksum(datablock_fromdisk);
+                sharedblock = dedup_find_block(fs, fingerprint, datablock_fromdisk);
+            }
+
+            if(sharedblock != -1 && sharedblock != datablock)
+            {
+                if(set_file_block(fs, inode, &map, writeblockindex, sharedblock) == -1)
+                {
+                    printf("No more space to create a datablock\n");
+                    break;
+                }
+                fs->refcountCACHE[sharedblock]++;
+                fs->refcount_dirty = 1;
+                if(datablock != -1)
+                {
+                    release_data_block(fs, datablock);
+                }
+            }
+            else if(sharedblock == -1)
+            {
+                /*-------------------------*/
+                /* Write datablock to disk */
+                /*-------------------------*/
+                // A new block, a copy of a block other files share, or any block in log-structured mode
+                if(datablock == -1 || fs->refcountCACHE[datablock] > 0 || fs->log_structured)
+                {
+                    int oldblock = datablock;
+                    datablock = map_file_block(fs, inode, &map, writeblockindex);
+                    if(datablock == -1)
+                    {
+                        // No more space in the disk
+                        printf("No more space to create a datablock\n");
+                        break;
+                    }
+                    if(oldblock != -1)
+                    {
+                        release_data_block(fs, oldblock);
+                    }
+                }
+
+                // Blocks gathered so far are written first if this one does not follow them
+                if(run_len > 0 && (datablock != run_start + run_len || run_len == POOL_BUFFER_LEN / BLOCK_SIZE))
+                {
+                    fs_write_blocks(fs, data_starting_ind + run_start, run_len, run, fs->writing_inode);
+                    run_len = 0;
+                }
+                if(run_len == 0)
+                {
+                    run_start = datablock;
+                }
+                memcpy(run + run_len * BLOCK_SIZE, datablock_fromdisk, BLOCK_SIZE);
+                run_len++;
+
+                if(fs->dedup_enabled && writelen == BLOCK_SIZE)
+                {
+                    dedup_remember_block(fs, fingerprint, datablock);
+                }
+            }
+        }
+
+        // Update buffer to continue writing content 
+        writesize = writesize + writelen;
+        remaining_len = remaining_len - writelen;
+
+        // Update the file ptr to the end of the write, the file grows if we wrote past its end
+        fileptr = fileptr + writelen;
+        if(fileptr > inode->size)
+        {
+            inode->size = fileptr;
+        }
+    }
+
+    if(run_len > 0)
+    {
+        fs_write_blocks(fs, data_starting_ind + run_start, run_len, run, fs->writing_inode);
+    }
+    pool_put_buffer(run);
+    pool_put_buffer(datablock_fromdisk);
+
+    // Update the file indirect pointers and inode on disk
+    save_indirect_map(fs, inode, &map);
+    save_inodetableCACHE_to_DISK(fs, inodeIndex/inode_per_block);
+    save_refcount_table(fs);
+
+    return writesize;
+}
+
+/* Write in a file at an offset */
+// The file grows if the write goes past its end
+// Return the number of bytes written
+int write_file(sfs_t * fs, int inodeIndex, const char* buf, int length, int offset)
+{
+    sfs_iovec iov;
+    iov.base = (void *) buf;
+    iov.len = length;
+    return write_file_vec(fs, inodeIndex, &iov, 1, length, offset);
+}
+
+int fs_fwrite(sfs_t * fs, int fileID, const char* buf, int length)
+{
+    if(fileID < 0 || fileID >= MAX_OPEN_FILE || !fs->open_fdt[fileID]->valid)
+    {
+        // If the file was closed, we can't write to it
+        return 0;
+    }
+
+    // Get the entry associated with the fileID
+    open_entry * openentry = fs->open_fdt[fileID];
+
+    // Write at the file ptr, then move it to the end of the write
+    int writesize = write_file(fs, openentry->iptr, buf, length, openentry->fileptr);
+    openentry->fileptr = openentry->fileptr + writesize;
+
+    return writesize;
+}
+
+int fs_pwrite(sfs_t * fs, int fileID, const char* buf, int length, int offset)
+{
+    if(fileID < 0 || fileID >= MAX_OPEN_FILE || !fs->open_fdt[fileID]->valid)
+    {
+        // If the file was closed, we can't write to it
+        return 0;
+    }
+    if(offset < 0)
+    {
+        return -1;
+    }
+
+    // The file ptr is left where it is
+    int writesize = write_file(fs, fs->open_fdt[fileID]->iptr, buf, length, offset);
+
+    return writesize;
+}
+
+/* Read from a file at an offset, into the buffers of a list one after the other */
+// Only reads up to the end of the file, holes read as zeros
+// Adjacent data blocks are read with a single request, straight into the buffer when it has room for them
+// Nothing shared is modified, reads can run in parallel
+// Return the number of bytes read
+int read_file_vec(sfs_t * fs, int inodeIndex, const sfs_iovec * iov, int iovcnt, int length, int offset)
+{
+    int fileptr = offset;
+    // Get the inode from the cache (always up to date)
+    i_node * inode = get_inode(fs, inodeIndex);
+
+    int readsize = 0;
+    io_cursor dst;
+    init_io_cursor(&dst, iov, iovcnt);
+
+    // Nothing to read at or past the end of the file
+    if(fileptr >= inode->size)
+    {
+        return 0;
+    }
+
+    // Only read up to the end of the file
+    int remaining_len = length;
+    if(remaining_len > inode->size - fileptr)
+    {
+        remaining_len = inode->size - fileptr;
+    }
+
+    // Content of an inline file is in the cached i node, no disk access
+    if(inode->flags & INODE_INLINE)
+    {
+        io_cursor_write(&dst, inode->inline_data + fileptr, remaining_len);
+        return remaining_len;
+    }
+
+    indirect_map map;
+    init_indirect_map(&map);
+    char * datablock_fromdisk = NULL;
+    // Last cluster of a compressed file read
+    char * clusterbuf = NULL;
+    int cached_cluster = -1;
+
+    while(remaining_len > 0)
+    {
+        // Block of the file holding the file ptr and offset of the file ptr in this block
+        int readblockindex = fileptr/BLOCK_SIZE;
+        int fileptr_read = fileptr % BLOCK_SIZE;
+
+        // Copy the smallest size between block remaining space and total buffer remaining
+        int readlen = BLOCK_SIZE - fileptr_read;
+        if(readlen > remaining_len)
+        {
+            readlen = remaining_len;
+        }
+
+        /*----------------*/
+        /* Get data block */
+        /*----------------*/
+        int datablock = get_file_block(fs, inode, &map, readblockindex);
+        if(map.damaged)
+        {
+            break;
+        }
+
+        // Blocks of a compressed cluster are read from the decompressed cluster
+        int cluster = readblockindex / CLUSTER_BLOCKS;
+        int cluster_compressed = (inode->flags & INODE_COMPRESSED) &&
+            get_file_block(fs, inode, &map, cluster * CLUSTER_BLOCKS + CLUSTER_BLOCKS - 1) == COMPRESSED_BLOCK;
+
+        if(cluster_compressed)
+        {
+            if(cluster != cached_cluster)
+            {
+                if(clusterbuf == NULL)
+                {
+                    clusterbuf = (char *) pool_get_buffer();
+                }
+                int slots[CLUSTER_BLOCKS];
+                get_cluster_slots(fs, inode, &map, cluster, slots);
+                if(read_cluster(fs, slots, clusterbuf) == -1)
+                {
+                    break;
+                }
+                cached_cluster = cluster;
+            }
+            io_cursor_write(&dst, clusterbuf + (readblockindex % CLUSTER_BLOCKS) * BLOCK_SIZE + fileptr_read, readlen);
+        }
+        else if(datablock == -1)
+        {
+            // Holes read as zeros, no disk access
+            io_cursor_write(&dst, NULL, readlen);
+        }
+        else if(readlen == BLOCK_SIZE)
+        {
+            // Whole blocks, as many as follow each other on the disk and fit in the buffer at the cursor
+            // (or in a scratch buffer if not even one fits)
+            int spanlen;
+            char * span = io_cursor_span(&dst, &spanlen);
+            int maxblocks = spanlen >= BLOCK_SIZE ? spanlen / BLOCK_SIZE : POOL_BUFFER_LEN / BLOCK_SIZE;
+            int nblocks = 1;
+            while(nblocks < maxblocks && remaining_len >= (nblocks + 1) * BLOCK_SIZE &&
+                  !(inode->flags & INODE_COMPRESSED) &&
+                  get_file_block(fs, inode, &map, readblockindex + nblocks) == datablock + nblocks)
+            {
+                nblocks++;
+            }
+
+            char * target = span;
+            if(spanlen < BLOCK_SIZE)
+            {
+                if(datablock_fromdisk == NULL)
+                {
+                    datablock_fromdisk = (char *) pool_get_buffer();
+                }
+                target = datablock_fromdisk;
+            }
+
+            // Reading stops at a block that does not match its checksum, the blocks before it are read
+            int valid = nblocks;
+            if(fs_read_blocks(fs, data_starting_ind + datablock, nblocks, target) < 0)
+            {
+                valid = 0;
+                while(valid < nblocks && (fs->checksumCACHE[data_starting_ind + datablock + valid] == 0 ||
+                      block_checksum(target + valid * BLOCK_SIZE) == fs->checksumCACHE[data_starting_ind + datablock + valid]))
+                {
+                    valid++;
+                }
+            }
+
+            if(target == span)
+            {
+                io_cursor_read(&dst, NULL, valid * BLOCK_SIZE);
+            }
+            else
+            {
+                io_cursor_write(&dst, target, valid * BLOCK_SIZE);
+            }
+            readsize = readsize + valid * BLOCK_SIZE;
+            remaining_len = remaining_len - valid * BLOCK_SIZE;
+            fileptr = fileptr + valid * BLOCK_SIZE;
+            if(valid < nblocks)
+            {
+                break;
+            }
+            continue;
+        }
+        else
+        {
+            if(datablock_fromdisk == NULL)
+            {
+                datablock_fromdisk = (char *) pool_get_buffer();
+            }
+            // Copy content of current data block
+            if(fs_read_blocks(fs, data_starting_ind + datablock, 1, datablock_fromdisk) < 0)
+            {
+                break;
+            }
+            io_cursor_write(&dst, datablock_fromdisk + fileptr_read, readlen);
+        }
+
+        // Update the buffer destination to continue appending buffer
+        readsize = readsize + readlen;
+        remaining_len = remaining_len - readlen;
+
+        // Update the file ptr to the end of the read
+        fileptr = fileptr + readlen;
+    }
+
+    pool_put_buffer(datablock_fromdisk);
+    pool_put_buffer(clusterbuf);
+
+    return readsize;
+}
+
+/* Read from a file at an offset */
+// Only reads up to the end of the file, holes read as zeros
+// Return the number of bytes read
+int read_file(sfs_t * fs, int inodeIndex, char* buf, int length, int offset)
+{
+    sfs_iovec iov;
+    iov.base = buf;
+    iov.len = length;
+    return read_file_vec(fs, inodeIndex, &iov, 1, length, offset);
+}
+
+int fs_fread(sfs_t * fs, int fileID, char* buf, int length)
+{
+    if(fileID < 0 || fileID >= MAX_OPEN_FILE || !fs->open_fdt[fileID]->valid)
+    {
+        // If the file was closed, we can't read from it
+        return 0;
+    }
+
+     // Get the entry associated with the fileID
+    open_entry * openentry = fs->open_fdt[fileID];
+
+    // Read at the file ptr, then move it to the end of the read
+    int readsize = read_file(fs, openentry->iptr, buf, length, openentry->fileptr);
+    openentry->fileptr = openentry->fileptr + readsize;
+
+    return readsize;
+}
+
+int fs_pread(sfs_t * fs, int fileID, char* buf, int length, int offset)
+{
+    if(fileID < 0 || fileID >= MAX_OPEN_FILE || !fs->open_fdt[fileID]->valid)
+    {
+        // If the file was closed, we can't read from it
+        return 0;
+    }
+    if(offset < 0)
+    {
+        return -1;
+    }
+
+    // The file ptr is left where it is
+    int readsize = read_file(fs, fs->open_fdt[fileID]->iptr, buf, length, offset);
+
+    return readsize;
+}
+
+int fs_readv(sfs_t * fs, int fileID, const sfs_iovec * iov, int iovcnt)
+{
+    if(fileID < 0 || fileID >= MAX_OPEN_FILE || !fs->open_fdt[fileID]->valid)
+    {
+        // If the file was closed, we can't read from it
+        return 0;
+    }
+    int length = iovec_length(iov, iovcnt);
+    if(length < 0)
+    {
+        return -1;
+    }
+
+    // Read at the file ptr, then move it to the end of the read
+    open_entry * openentry = fs->open_fdt[fileID];
+    int readsize = read_file_vec(fs, openentry->iptr, iov, iovcnt, length, openentry->fileptr);
+    openentry->fileptr = openentry->fileptr + readsize;
+
+    return readsize;
+}
+
+int fs_writev(sfs_t * fs, int fileID, const sfs_iovec * iov, int iovcnt)
+{
+    if(fileID < 0 || fileID >= MAX_OPEN_FILE || !fs->open_fdt[fileID]->valid)
+    {
+        // If the file was closed, we can't write to it
+        return 0;
+    }
+    int length = iovec_length(iov, iovcnt);
+    if(length < 0)
+    {
+        return -1;
+    }
+
+    // Write at the file ptr, then move it to the end of the write
+    open_entry * openentry = fs->open_fdt[fileID];
+    int writesize = write_file_vec(fs, openentry->iptr, iov, iovcnt, length, openentry->fileptr);
+    openentry->fileptr = openentry->fileptr + writesize;
+
+    return writesize;
+}
+
+/* Find the next data or hole offset of a file, starting at loc */
+// With whence SFS_SEEK_DATA, return the first offset >= loc in an allocated block, -1 if there is none
+// With whence SFS_SEEK_HOLE, return the first offset >= loc in a hole, the end of the file counts as a hole
+// Return -1 if loc is not in the file
+int find_data_or_hole(sfs_t * fs, i_node * in, int loc, int whence)
+{
+    if(loc < 0 || loc >= in->size)
+    {
+        return -1;
+    }
+
+    // An inline file has no hole, its only hole is its end
+    if(in->flags & INODE_INLINE)
+    {
+        return whence == SFS_SEEK_HOLE ? in->size : loc;
+    }
+
+    indirect_map map;
+    init_indirect_map(&map);
+
+    int last_block = (in->size - 1)/BLOCK_SIZE;
+    for(int fileblockIndex = loc/BLOCK_SIZE; fileblockIndex <= last_block; fileblockIndex++)
+    {
+        int hole = get_file_block(fs, in, &map, fileblockIndex) == -1;
+        if(hole == (whence == SFS_SEEK_HOLE))
+        {
+            // The first block found starts before loc only if loc is in it
+            int offset = fileblockIndex * BLOCK_SIZE;
+            return offset > loc ? offset : loc;
+        }
+    }
+
+    return whence == SFS_SEEK_HOLE ? in->size : -1;
+}
+
+int fs_lseek(sfs_t * fs, int fileID, int loc, int whence)
+{
+    // Verify if fileID is valid
+    if(fileID < 0 || fileID >= MAX_OPEN_FILE || !fs->open_fdt[fileID]->valid)
+    {
+        return -1;
+    }
+
+    // Get inode from cache  
+    i_node * in = get_inode(fs, fs->open_fdt[fileID]->iptr);
+
+    if(whence == SFS_SEEK_DATA || whence == SFS_SEEK_HOLE)
+    {
+        loc = find_data_or_hole(fs, in, loc, whence);
+    }
+    else if(whence != SFS_SEEK_SET)
+    {
+        return -1;
+    }
+
+    // The file ptr can go past the end of the file, writing there leaves a hole
+    if(loc < 0 || loc > max_file_size)
+    {
+        return -1;
+    }
+
+    fs->open_fdt[fileID]->fileptr = loc;
+    return loc;
+}
+
+int fs_fseek(sfs_t * fs, int fileID, int loc)
+{   
+    if(fs_lseek(fs, fileID, loc, SFS_SEEK_SET) == -1)
+    {
+        return -1;
+    }
+    
+    return 0;
+}
+
+int fs_remove(sfs_t * fs, char* file)
+{
+    int dirInodeIndex;
+    char filename[MAX_FILENAME_LEN + 1];
+
+    /*------------------------*/
+    /* Find file in directory */
+    /*------------------------*/
+    int inodeIndex = resolve_path(fs, file, &dirInodeIndex, filename);
+
+    if(inodeIndex == -1)
+    {
+        printf("Could not find file to remove\n");
+        return -1;
+    }
+    else if(get_inode(fs, inodeIndex)->flags & INODE_DIR)
+    {
+        printf("Cant remove directory %s as a file\n", file);
+        return -1;
+    }
+    else
+    {
+        i_node * file_inode = get_inode(fs, inodeIndex);
+
+        // Every freed block is kept to be discarded once the file is removed
+        int * freed_blocks = (int *) malloc((num_directptr + indirectptr_per_block + 1) * sizeof(int));
+        indirect_map map;
+        init_indirect_map(&map);
+        int num_freed_blocks = unmap_file_blocks(fs, file_inode, &map, 0, freed_blocks);
+
+        release_reservation(fs, inodeIndex);
+
+        /*------------------------------------*/
+        /* Remove file inode from inode table */
+        /*------------------------------------*/
+        // Invalidate cache entry
+        file_inode->valid = 0;
+        // Udpate cache 
+        save_inodetableCACHE_to_DISK(fs, inodeIndex/inode_per_block);
+
+        /*------------------------------------*/
+        /* Free every data block for the file */
+        /*------------------------------------*/
+        // Blocks other files share are kept, the free bitmap is written once
+        num_freed_blocks = release_data_blocks(fs, freed_blocks, num_freed_blocks);
+
+        /*---------------------------------------*/
+        /* Remove directory entry from directory */
+        /*---------------------------------------*/
+        dir_remove(fs, dirInodeIndex, filename);
+
+
+        /*-------------------*/
+        /* Update superblock */
+        /*-------------------*/
+        // Update superblock information in cache
+        // The number of directory entries was updated with the removed entry
+        fs->superblockCACHE->num_inodes = fs->superblockCACHE->num_inodes - 1;
+        // Udpate superblock to disk
+        fs->superblock_dirty = 1;
+
+        /*----------------------------*/
+        /* Return freed space to host */
+        /*----------------------------*/
+        // Only once the file is gone, a crash before this point loses no data
+        if(fs->discard_online)
+        {
+            discard_freed_blocks(fs, freed_blocks, num_freed_blocks);
+        }
+        free(freed_blocks);
+    }
+    
+    // printf("Successfully removed file\n");
+
+    return 0;
+}
+
+int fs_clone(sfs_t * fs, char* src, char* dst)
+{
+    int dirInodeIndex;
+    char filename[MAX_FILENAME_LEN + 1];
+
+    /*-------------------------*/
+    /* Find files in directory */
+    /*-------------------------*/
+    int srcInodeIndex = resolve_path(fs, src, &dirInodeIndex, filename);
+    if(srcInodeIndex == -1 || (get_inode(fs, srcInodeIndex)->flags & INODE_DIR))
+    {
+        printf("Could not find file to clone\n");
+        return -1;
+    }
+
+    if(resolve_path(fs, dst, &dirInodeIndex, filename) != -1)
+    {
+        printf("Clone destination already exists\n");
+        return -1;
+    }
+    if(dirInodeIndex == -1)
+    {
+        printf("Could not find directory of file %s\n", dst);
+        return -1;
+    }
+
+    i_node * src_inode = get_inode(fs, srcInodeIndex);
+    indirect_map map;
+    init_indirect_map(&map);
+    if(load_indirect_map(fs, src_inode, &map) == -1)
+    {
+        printf("Could not read the block pointers of the file to clone\n");
+        return -1;
+    }
+
+    /*-----------------------------*/
+    /* Verify blocks can be shared */
+    /*-----------------------------*/
+    // Holes and compressed block markers have no block to share
+    for(int i = 0; i < num_directptr; i++)
+    {
+        if(src_inode->directptr[i] >= 0 && fs->refcountCACHE[src_inode->directptr[i]] == 255)
+        {
+            printf("Too many copies of the file, cant clone it\n");
+            return -1;
+        }
+    }
+    for(int i = 0; i < src_inode->num_indirectptr; i++)
+    {
+        if(map.datablockindex[i] >= 0 && fs->refcountCACHE[map.datablockindex[i]] == 255)
+        {
+            printf("Too many copies of the file, cant clone it\n");
+            return -1;
+        }
+    }
+
+    // Each file has its own indirect pointer block, the clone gets a copy of the source one
+    int indirectptr = -1;
+    if(src_inode->indirectptr != -1)
+    {
+        indirectptr = find_free_data_block(fs, 1);
+        if(indirectptr == -1)
+        {
+            printf("No more space to create a datablock\n");
+            return -1;
+        }
+    }
+
+    /*------------------*/
+    /* Create the clone */
+    /*------------------*/
+    int inodeIndex = sfs_fcreate(fs, dirInodeIndex, filename, 0);
+    if(inodeIndex == -1)
+    {
+        if(indirectptr != -1)
+        {
+            update_freebitmap_CACHE_and_DISK(fs, data_starting_ind + indirectptr, 1);
+        }
+        return -1;
+    }
+
+    // Same size, flags, block pointers and inline data as the source
+    i_node * file_inode = get_inode(fs, inodeIndex);
+    *file_inode = *src_inode;
+    file_inode->indirectptr = indirectptr;
+    if(indirectptr != -1)
+    {
+        map.dirty = 1;
+        map.fresh = 1;
+        save_indirect_map(fs, file_inode, &map);
+    }
+
+    /*-----------------------*/
+    /* Share the data blocks */
+    /*-----------------------*/
+    // Either file writing to a shared block gets its own copy of it
+    for(int i = 0; i < num_directptr; i++)
+    {
+        if(file_inode->directptr[i] >= 0)
+        {
+            fs->refcountCACHE[file_inode->directptr[i]]++;
+            fs->refcount_dirty = 1;
+        }
+    }
+    for(int i = 0; i < file_inode->num_indirectptr; i++)
+    {
+        if(map.datablockindex[i] >= 0)
+        {
+            fs->refcountCACHE[map.datablockindex[i]]++;
+            fs->refcount_dirty = 1;
+        }
+    }
+
+    save_refcount_table(fs);
+    save_inodetableCACHE_to_DISK(fs, inodeIndex/inode_per_block);
+
+    return 0;
+}
+
+/* Make blocks of a file point to the data blocks of blocks of another file (or of the same one) */
+// Holes of the source become holes, a data block already shared 255 times is copied by the disk instead
+// The blocks the destination used are released once its pointers are saved
+// Return the number of blocks done, fewer if the destination can't grow or the disk is full
+int share_file_blocks(sfs_t * fs, int srcInodeIndex, int srcblockIndex, int dstInodeIndex, int dstblockIndex, int nblocks)
+{
+    i_node * src_inode = get_inode(fs, srcInodeIndex);
+    i_node * dst_inode = get_inode(fs, dstInodeIndex);
+    indirect_map srcmap;
+    indirect_map dstmap;
+    init_indirect_map(&srcmap);
+    init_indirect_map(&dstmap);
+    // A file has a single indirect pointer block, both ranges go through the same map
+    indirect_map * srcmapptr = srcInodeIndex == dstInodeIndex ? &dstmap : &srcmap;
+
+    fs->writing_inode = dstInodeIndex;
+    int * oldblocks = (int *) malloc(nblocks * sizeof(int));
+    int num_oldblocks = 0;
+
+    int done = 0;
+    for(; done < nblocks; done++)
+    {
+        int datablock = get_file_block(fs, src_inode, srcmapptr, srcblockIndex + done);
+        int oldblock = get_file_block(fs, dst_inode, &dstmap, dstblockIndex + done);
+        if(srcmapptr->damaged || dstmap.damaged)
+        {
+            break;
+        }
+        if(datablock == oldblock)
+        {
+            continue;
+        }
+
+        if(datablock == -1 || fs->refcountCACHE[datablock] < 255)
+        {
+            if(set_file_block(fs, dst_inode, &dstmap, dstblockIndex + done, datablock) == -1)
+            {
+                break;
+            }
+            if(datablock != -1)
+            {
+                fs->refcountCACHE[datablock]++;
+                fs->refcount_dirty = 1;
+            }
+        }
+        else
+        {
+            // No reference left to take, the destination gets a copy of its own
+            int newblock = map_file_block(fs, dst_inode, &dstmap, dstblockIndex + done);
+            if(newblock == -1)
+            {
+                break;
+            }
+            if(fs_copy_blocks(fs, data_starting_ind + datablock, data_starting_ind + newblock, 1, dstInodeIndex) == -1)
+            {
+                // The destination reads as zeros where the copy failed, its old content is gone anyway
+                printf("Could not copy block %d\n", data_starting_ind + datablock);
+            }
+        }
+
+        if(oldblock != -1)
+        {
+            oldblocks[num_oldblocks++] = oldblock;
+        }
+    }
+
+    // Blocks shared up to the end of the destination make it grow
+    if(done > 0 && (dstblockIndex + done) * BLOCK_SIZE > dst_inode->size)
+    {
+        dst_inode->size = (dstblockIndex + done) * BLOCK_SIZE;
+    }
+
+    save_indirect_map(fs, dst_inode, &dstmap);
+    save_inodetableCACHE_to_DISK(fs, dstInodeIndex/inode_per_block);
+
+    num_oldblocks = release_data_blocks(fs, oldblocks, num_oldblocks);
+    if(fs->discard_online && num_oldblocks > 0)
+    {
+        discard_freed_blocks(fs, oldblocks, num_oldblocks);
+    }
+    free(oldblocks);
+
+    return done;
+}
+
+int fs_copy_range(sfs_t * fs, int srcID, int srcoffset, int dstID, int dstoffset, int length)
+{
+    if(srcID < 0 || srcID >= MAX_OPEN_FILE || !fs->open_fdt[srcID]->valid ||
+       dstID < 0 || dstID >= MAX_OPEN_FILE || !fs->open_fdt[dstID]->valid)
+    {
+        // If a file was closed, we can't copy from or to it
+        return 0;
+    }
+    if(srcoffset < 0 || dstoffset < 0 || length < 0)
+    {
+        return -1;
+    }
+
+    int srcInodeIndex = fs->open_fdt[srcID]->iptr;
+    int dstInodeIndex = fs->open_fdt[dstID]->iptr;
+
+    // Nothing past the end of the source is copied
+    int srcsize = get_inode(fs, srcInodeIndex)->size;
+    if(srcoffset >= srcsize)
+    {
+        return 0;
+    }
+    if(length > srcsize - srcoffset)
+    {
+        length = srcsize - srcoffset;
+    }
+
+    // A range of a file can't be copied over itself
+    if(srcInodeIndex == dstInodeIndex && srcoffset < dstoffset + length && dstoffset < srcoffset + length)
+    {
+        return -1;
+    }
+
+    char * buf = NULL;
+    int copied = 0;
+    while(copied < length)
+    {
+        int srcpos = srcoffset + copied;
+        int dstpos = dstoffset + copied;
+        int left = length - copied;
+        int flags = get_inode(fs, srcInodeIndex)->flags | get_inode(fs, dstInodeIndex)->flags;
+
+        /*-----------------------------------*/
+        /* Whole blocks, shared by the files */
+        /*-----------------------------------*/
+        if(!(flags & (INODE_INLINE | INODE_COMPRESSED)) && srcpos % BLOCK_SIZE == 0 && dstpos % BLOCK_SIZE == 0 &&
+           left >= BLOCK_SIZE)
+        {
+            int nblocks = left/BLOCK_SIZE;
+            int done = share_file_blocks(fs, srcInodeIndex, srcpos/BLOCK_SIZE, dstInodeIndex, dstpos/BLOCK_SIZE, nblocks);
+            copied = copied + done * BLOCK_SIZE;
+            if(done < nblocks)
+            {
+                break;
+            }
+            continue;
+        }
+
+        /*-------------------------------------*/
+        /* Anything else, copied with a buffer */
+        /*-------------------------------------*/
+        // Up to the next block boundary of the destination, the rest may be shared from there
+        int len = dstpos % BLOCK_SIZE != 0 ? BLOCK_SIZE - dstpos % BLOCK_SIZE : POOL_BUFFER_LEN;
+        if(len > left)
+        {
+            len = left;
+        }
+        if(buf == NULL)
+        {
+            buf = (char *) pool_get_buffer();
+        }
+        int readsize = read_file(fs, srcInodeIndex, buf, len, srcpos);
+        if(readsize <= 0)
+        {
+            break;
+        }
+        int writesize = write_file(fs, dstInodeIndex, buf, readsize, dstpos);
+        copied = copied + writesize;
+        if(writesize < readsize)
+        {
+            break;
+        }
+    }
+
+    if(buf != NULL)
+    {
+        pool_put_buffer(buf);
+    }
+    return copied;
+}
+
+/* Write bytes to a host file descriptor, until all are written or it fails */
+// Return the number of bytes written
+int write_host_fd(int fd, const char * buf, int length)
+{
+    int written = 0;
+    while(written < length)
+    {
+        ssize_t w = write(fd, buf + written, length - written);
+        if(w < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(w <= 0)
+        {
+            break;
+        }
+        written = written + w;
+    }
+    return written;
+}
+
+/* Read a run of DISK blocks into a buffer, return the number of blocks at its start matching their checksum */
+// Blocks without a checksum can't be verified, the count stops at them as at a mismatch
+// Take as argument a pool buffer, the run fits in it
+int read_verified_run(sfs_t * fs, int start_address, int nblocks, char * buf)
+{
+    if(disk_read_blocks(fs->disk, start_address, nblocks, buf) < 0)
+    {
+        return 0;
+    }
+
+    int verified = 0;
+    while(verified < nblocks)
+    {
+        int block = start_address + verified;
+        if(fs->checksumCACHE[block] == 0 || block_checksum(buf + verified*BLOCK_SIZE) != fs->checksumCACHE[block])
+        {
+            break;
+        }
+        __sync_fetch_and_add(&fs->checksumSTATS.blocks_verified, 1);
+        verified++;
+    }
+    return verified;
+}
+
+int fs_sendfile(sfs_t * fs, int out_fd, int fileID, int offset, int count)
+{
+    if(fileID < 0 || fileID >= MAX_OPEN_FILE || !fs->open_fdt[fileID]->valid)
+    {
+        // If the file was closed, we can't read from it
+        return 0;
+    }
+    if(offset < 0 || count < 0)
+    {
+        return -1;
+    }
+
+    int inodeIndex = fs->open_fdt[fileID]->iptr;
+    i_node * in = get_inode(fs, inodeIndex);
+    if(offset >= in->size)
+    {
+        return 0;
+    }
+    if(count > in->size - offset)
+    {
+        count = in->size - offset;
+    }
+
+    // Inline and compressed content only exists in memory once read
+    int plain = !(in->flags & (INODE_INLINE | INODE_COMPRESSED));
+    indirect_map map;
+    init_indirect_map(&map);
+
+    char * buf = NULL;
+    int sent = 0;
+    while(sent < count)
+    {
+        int pos = offset + sent;
+        int fileblockIndex = pos/BLOCK_SIZE;
+        int datablock = plain ? get_file_block(fs, in, &map, fileblockIndex) : -1;
+
+        /*-----------------------------------------*/
+        /* Blocks following each other on the disk */
+        /*-----------------------------------------*/
+        int runlen = 0;
+        if(datablock >= 0 && fs->writebackCACHE[data_starting_ind + datablock] == NULL)
+        {
+            runlen = 1;
+            while(runlen < POOL_BUFFER_LEN / BLOCK_SIZE && sent + runlen * BLOCK_SIZE - pos % BLOCK_SIZE < count)
+            {
+                int next = get_file_block(fs, in, &map, fileblockIndex + runlen);
+                if(next != datablock + runlen || fs->writebackCACHE[data_starting_ind + next] != NULL)
+                {
+                    break;
+                }
+                runlen++;
+            }
+
+            // Read with a single request, the blocks matching their checksum are sent from the buffer
+            // they were verified in. A block that doesn't goes through read_file below, which reports
+            // the mismatch as sfs_pread does
+            if(buf == NULL)
+            {
+                buf = (char *) pool_get_buffer();
+            }
+            runlen = read_verified_run(fs, data_starting_ind + datablock, runlen, buf);
+        }
+        if(runlen > 0)
+        {
+            int len = runlen * BLOCK_SIZE - pos % BLOCK_SIZE;
+            if(len > count - sent)
+            {
+                len = count - sent;
+            }
+            int written = write_host_fd(out_fd, buf + pos % BLOCK_SIZE, len);
+            sent = sent + written;
+            if(written < len)
+            {
+                break;
+            }
+            continue;
+        }
+
+        /*--------------------------------------*/
+        /* Anything else, sent through a buffer */
+        /*--------------------------------------*/
+        // Holes, inline and compressed content, blocks with a newer copy in the write back cache
+        // and blocks that could not be verified
+        int len = plain ? BLOCK_SIZE - pos % BLOCK_SIZE : POOL_BUFFER_LEN;
+        if(len > count - sent)
+        {
+            len = count - sent;
+        }
+        if(buf == NULL)
+        {
+            buf = (char *) pool_get_buffer();
+        }
+        int readsize = read_file(fs, inodeIndex, buf, len, pos);
+        if(readsize <= 0)
+        {
+            break;
+        }
+        int written = write_host_fd(out_fd, buf, readsize);
+        sent = sent + written;
+        if(written < readsize)
+        {
+            break;
+        }
+    }
+
+    if(buf != NULL)
+    {
+        pool_put_buffer(buf);
+    }
+    return sent > 0 || count == 0 ? sent : -1;
+}
+
+int fs_mkdir(sfs_t * fs, char* path)
+{
+    int dirInodeIndex;
+    char dirname[MAX_FILENAME_LEN + 1];
+
+    if(resolve_path(fs, path, &dirInodeIndex, dirname) != -1)
+    {
+        printf("%s already exists\n", path);
+        return -1;
+    }
+    if(dirInodeIndex == -1)
+    {
+        printf("Could not find directory of %s\n", path);
+        return -1;
+    }
+
+    // The directory starts empty, its B+tree gets a root node with the first entry
+    if(sfs_fcreate(fs, dirInodeIndex, dirname, INODE_DIR) == -1)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+int fs_rmdir(sfs_t * fs, char* path)
+{
+    int dirInodeIndex;
+    char dirname[MAX_FILENAME_LEN + 1];
+    int inodeIndex = resolve_path(fs, path, &dirInodeIndex, dirname);
+
+    if(inodeIndex == -1 || !(get_inode(fs, inodeIndex)->flags & INODE_DIR))
+    {
+        printf("Could not find directory to remove\n");
+        return -1;
+    }
+    // The root directory has no parent
+    if(dirInodeIndex == -1)
+    {
+        printf("Cant remove the root directory\n");
+        return -1;
+    }
+    // Only empty directories are removed, they have no B+tree left
+    if(get_inode(fs, inodeIndex)->size > 0)
+    {
+        printf("Directory %s is not empty\n", path);
+        return -1;
+    }
+
+    /*-----------------------------------------*/
+    /* Remove directory inode from inode table */
+    /*-----------------------------------------*/
+    get_inode(fs, inodeIndex)->valid = 0;
+    save_inodetableCACHE_to_DISK(fs, inodeIndex/inode_per_block);
+
+    /*---------------------------------------*/
+    /* Remove directory entry from directory */
+    /*---------------------------------------*/
+    dir_remove(fs, dirInodeIndex, dirname);
+
+    /*-------------------*/
+    /* Update superblock */
+    /*-------------------*/
+    fs->superblockCACHE->num_inodes = fs->superblockCACHE->num_inodes - 1;
+    fs->superblock_dirty = 1;
+
+    return 0;
+}
+
+void fs_setdiscard(sfs_t * fs, int online)
+{
+    fs->discard_online = online;
+}
+
+void fs_setcompression(sfs_t * fs, int enabled)
+{
+    fs->compression_enabled = enabled;
+}
+
+int fs_trim(sfs_t * fs)
+{
+    int discarded = 0;
+    int run_start = -1;
+
+    // Blocks freed since the last flush are discarded only once the metadata no longer pointing to them is on the disk
+    sync_blocks(fs, -2);
+
+    // Discard every run of free data blocks, the free bitmap block is the end of the data blocks
+    int data_end_ind = data_starting_ind + num_data_blcks;
+    for(int i = data_starting_ind; i <= data_end_ind; i++)
+    {
+        int isfree = i < data_end_ind && *(fs->freebitmapCACHE + i) == '1';
+        if(isfree && run_start == -1)
+        {
+            run_start = i;
+        }
+        else if(!isfree && run_start != -1)
+        {
+            if(buffered_discard_blocks(fs, run_start, i - run_start) > 0)
+            {
+                clear_checksums(fs, run_start, i - run_start);
+                discarded = discarded + i - run_start;
+            }
+            run_start = -1;
+        }
+    }
+
+    return discarded;
+}
+
+void fs_getchecksumstats(sfs_t * fs, checksum_stats * stats)
+{
+    *stats = fs->checksumSTATS;
+}
+
+void fs_statfs(sfs_t * fs, fs_stats * stats)
+{
+    // Both counts are kept up to date in the superblock, nothing is scanned
+    stats->block_size = BLOCK_SIZE;
+    stats->total_blocks = num_data_blcks;
+    stats->free_blocks = fs->superblockCACHE->num_free_blocks;
+    stats->total_inodes = max_num_inodes;
+    stats->free_inodes = max_num_inodes - fs->superblockCACHE->num_inodes;
+    stats->max_filename_len = MAX_FILENAME_LEN;
+}
+
+void fs_setdedup(sfs_t * fs, int enabled)
+{
+    fs->dedup_enabled = enabled;
+}
+
+/*------------------------*/
+/* ONLINE DEFRAGMENTATION */
+/*------------------------*/
+/* Number of blocks of a file, holes included */
+int file_block_count(i_node * in)
+{
+    int nblocks = (in->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    return nblocks < num_directptr + indirectptr_per_block ? nblocks : num_directptr + indirectptr_per_block;
+}
+
+/* Verify if the blocks of a file can be moved */
+// Blocks of compressed files, directories, files with a damaged indirect pointer block
+// and blocks shared with other files stay where they are
+int file_is_movable(sfs_t * fs, i_node * in, indirect_map * map)
+{
+    if(!in->valid || (in->flags & (INODE_INLINE | INODE_COMPRESSED | INODE_DIR)))
+    {
+        return 0;
+    }
+    if(in->indirectptr != -1 && load_indirect_map(fs, in, map) == -1)
+    {
+        return 0;
+    }
+
+    for(int i = 0; i < file_block_count(in); i++)
+    {
+        int datablock = get_file_block(fs, in, map, i);
+        if(datablock >= 0 && fs->refcountCACHE[datablock] > 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Number of extents of a file, runs of blocks that follow each other on the disk */
+// Holes don't split an extent, a file without data blocks has no extent
+int count_extents(sfs_t * fs, i_node * in, indirect_map * map)
+{
+    int extents = 0;
+    int prevblock = -2;
+    for(int i = 0; i < file_block_count(in); i++)
+    {
+        int datablock = get_file_block(fs, in, map, i);
+        if(datablock < 0)
+        {
+            continue;
+        }
+        if(datablock != prevblock + 1)
+        {
+            extents++;
+        }
+        prevblock = datablock;
+    }
+    return extents;
+}
+
+/* Verify if a data block can receive a block of a file */
+// Free blocks in the reservation window of the file are available to it
+int block_available_to(sfs_t * fs, int inodeIndex, int datablock)
+{
+    if(datablock < 0 || datablock >= num_data_blcks || *(fs->freebitmapCACHE + data_starting_ind + datablock) != '1')
+    {
+        return 0;
+    }
+    return !fs->reservedCACHE[datablock] ||
+           (datablock >= fs->reserve_start[inodeIndex] &&
+            datablock < fs->reserve_start[inodeIndex] + fs->reserve_len[inodeIndex]);
+}
+
+/* Take the free data block a block of a file moves to, or the head of the log if target is -1 */
+// Return DATA block index taken, -1 if the log has no free block left
+int take_move_target(sfs_t * fs, int inodeIndex, int target)
+{
+    if(target == -1)
+    {
+        return log_allocate_block(fs);
+    }
+
+    // Taken from the front of the window of the file, the window moves with it
+    if(fs->reserve_len[inodeIndex] > 0 && target == fs->reserve_start[inodeIndex])
+    {
+        fs->reserve_start[inodeIndex]++;
+        fs->reserve_len[inodeIndex]--;
+    }
+    else if(fs->reservedCACHE[target])
+    {
+        release_reservation(fs, inodeIndex);
+    }
+    take_data_run(fs, target, 1);
+    return target;
+}
+
+/* Move a block of a file to a free data block, or to the head of the log if target is -1 */
+// The copy is written and the pointer switched in memory, the old block is only freed by commit_moves
+// once the pointers are on stable storage, a crash in between loses nothing
+// Return 0 on success, -1 if the block could not be read or the log has no free block left
+int move_file_block(sfs_t * fs, int inodeIndex, indirect_map * map, int fileblockIndex, int target, char * blockbuf)
+{
+    i_node * in = get_inode(fs, inodeIndex);
+    int datablock = get_file_block(fs, in, map, fileblockIndex);
+    if(fs_read_blocks(fs, data_starting_ind + datablock, 1, blockbuf) < 0)
+    {
+        return -1;
+    }
+
+    target = take_move_target(fs, inodeIndex, target);
+    if(target == -1)
+    {
+        return -1;
+    }
+
+    fs->writing_inode = inodeIndex;
+    fs_write_blocks(fs, data_starting_ind + target, 1, blockbuf, inodeIndex);
+    set_file_block(fs, in, map, fileblockIndex, target);
+    return 0;
+}
+
+/* Move the indirect pointer block of a file to a free data block */
+// Its entries are written to the new block by commit_moves, which frees the old one once the i node is saved
+// Return 0 on success, -1 if the log has no free block left or the block is damaged
+int move_indirect_block(sfs_t * fs, int inodeIndex, indirect_map * map, int target)
+{
+    i_node * in = get_inode(fs, inodeIndex);
+    if(load_indirect_map(fs, in, map) == -1)
+    {
+        return -1;
+    }
+
+    target = take_move_target(fs, inodeIndex, target);
+    if(target == -1)
+    {
+        return -1;
+    }
+
+    in->indirectptr = target;
+    map->dirty = 1;
+    // Already at its new place, log-structured mode does not move it again
+    map->fresh = 1;
+    return 0;
+}
+
+/* Save the pointers of a file whose blocks were moved, then free the blocks it left */
+// The copies and the pointers are brought to stable storage first, in every durability mode, so the
+// blocks left can't be written over or discarded while the metadata on the disk still points to them
+// Take as argument a list of the DATA block indexes left
+void commit_moves(sfs_t * fs, int inodeIndex, indirect_map * map, int * oldblocks, int num_oldblocks)
+{
+    save_indirect_map(fs, get_inode(fs, inodeIndex), map);
+    save_inodetableCACHE_to_DISK(fs, inodeIndex/inode_per_block);
+    if(num_oldblocks > 0)
+    {
+        sync_blocks(fs, -2);
+    }
+
+    num_oldblocks = release_data_blocks(fs, oldblocks, num_oldblocks);
+    if(fs->discard_online && num_oldblocks > 0)
+    {
+        discard_freed_blocks(fs, oldblocks, num_oldblocks);
+    }
+}
+
+/* Spread the blocks of a file over the largest runs available to it, moving at most budget blocks */
+// For a file no free run is large enough for. Runs are made of free blocks and of blocks of the file,
+// so they stay the same while blocks move between them and a move split across calls keeps its targets.
+// The largest runs are filled in order from their first block, with the blocks of the file in order.
+// Return the number of blocks moved, -1 if the file would not end up in fewer extents or no block can move
+int spread_file(sfs_t * fs, int inodeIndex, int budget)
+{
+    i_node * in = get_inode(fs, inodeIndex);
+    indirect_map map;
+    init_indirect_map(&map);
+    int nblocks = file_block_count(in);
+
+    /*-----------------------------------*/
+    /* Runs available to the file blocks */
+    /*-----------------------------------*/
+    unsigned char * own = (unsigned char *) calloc(1, num_data_blcks);
+    int k = 0;
+    for(int i = 0; i < nblocks; i++)
+    {
+        int datablock = get_file_block(fs, in, &map, i);
+        if(datablock >= 0)
+        {
+            own[datablock] = 1;
+            k++;
+        }
+    }
+
+    int * run_start = (int *) malloc(num_data_blcks * sizeof(int));
+    int * run_len = (int *) malloc(num_data_blcks * sizeof(int));
+    int num_runs = 0;
+    for(int datablock = 0; datablock < num_data_blcks; datablock++)
+    {
+        if(!own[datablock] && !block_available_to(fs, inodeIndex, datablock))
+        {
+            continue;
+        }
+        if(num_runs > 0 && run_start[num_runs - 1] + run_len[num_runs - 1] == datablock)
+        {
+            run_len[num_runs - 1]++;
+        }
+        else
+        {
+            run_start[num_runs] = datablock;
+            run_len[num_runs] = 1;
+            num_runs++;
+        }
+    }
+
+    /*-----------------------------------------*/
+    /* Target of every block, largest run first */
+    /*-----------------------------------------*/
+    // The runs hold at least every block of the file, its own blocks are part of them
+    int * targets = (int *) malloc(k * sizeof(int));
+    unsigned char * is_target = (unsigned char *) calloc(1, num_data_blcks);
+    int placed = 0;
+    int used_runs = 0;
+    while(placed < k)
+    {
+        int best = 0;
+        for(int r = 1; r < num_runs; r++)
+        {
+            if(run_len[r] > run_len[best])
+            {
+                best = r;
+            }
+        }
+        for(int i = 0; i < run_len[best] && placed < k; i++)
+        {
+            targets[placed++] = run_start[best] + i;
+            is_target[run_start[best] + i] = 1;
+        }
+        run_len[best] = 0;
+        used_runs++;
+    }
+
+    /*-----------------*/
+    /* Move the blocks */
+    /*-----------------*/
+    int moved = 0;
+    if(used_runs < count_extents(fs, in, &map))
+    {
+        char * blockbuf = (char *) pool_get_buffer();
+        int * oldblocks = (int *) malloc(k * sizeof(int));
+        // Block of the file whose target another block of the file still holds
+        int blocked = -1;
+        int j = 0;
+        for(int i = 0; i < nblocks && moved < budget; i++)
+        {
+            int datablock = get_file_block(fs, in, &map, i);
+            if(datablock < 0)
+            {
+                continue;
+            }
+            int target = targets[j++];
+            if(datablock == target)
+            {
+                continue;
+            }
+            // Held by a block of the file, free once that block moved and the move is committed
+            if(!block_available_to(fs, inodeIndex, target))
+            {
+                blocked = blocked == -1 ? i : blocked;
+                continue;
+            }
+            if(move_file_block(fs, inodeIndex, &map, i, target, blockbuf) == -1)
+            {
+                break;
+            }
+            oldblocks[moved++] = datablock;
+        }
+
+        // Blocks of the file hold each other's targets, one of them is set aside on a free block
+        // of the runs that no block goes to
+        for(int datablock = 0; moved == 0 && blocked != -1 && datablock < num_data_blcks; datablock++)
+        {
+            if(!is_target[datablock] && block_available_to(fs, inodeIndex, datablock))
+            {
+                int oldblock = get_file_block(fs, in, &map, blocked);
+                if(move_file_block(fs, inodeIndex, &map, blocked, datablock, blockbuf) == 0)
+                {
+                    oldblocks[moved++] = oldblock;
+                }
+                blocked = -1;
+            }
+        }
+
+        commit_moves(fs, inodeIndex, &map, oldblocks, moved);
+        free(oldblocks);
+        pool_put_buffer(blockbuf);
+    }
+
+    free(is_target);
+    free(targets);
+    free(run_len);
+    free(run_start);
+    free(own);
+    return moved > 0 ? moved : -1;
+}
+
+/* Make the blocks of a file follow each other on the disk, moving at most budget blocks */
+// The file grows in place from its first block when the blocks after it are free, otherwise it is moved
+// to a free run large enough for all its blocks, kept as its reservation window until the move is done
+// When there is no such run, the file is spread over the largest runs it can have, see spread_file
+// Return the number of blocks moved, -1 if the file can't get fewer extents
+int defrag_file(sfs_t * fs, int inodeIndex, int budget)
+{
+    i_node * in = get_inode(fs, inodeIndex);
+    indirect_map map;
+    init_indirect_map(&map);
+
+    if(!file_is_movable(fs, in, &map) || count_extents(fs, in, &map) <= 1)
+    {
+        return 0;
+    }
+
+    /*--------------------*/
+    /* Find where it goes */
+    /*--------------------*/
+    // Every block of the file either is at its place after the first block, or its place is free
+    int nblocks = file_block_count(in);
+    int start = -1;
+    int inplace = 1;
+    int k = 0;
+    for(int i = 0; i < nblocks; i++)
+    {
+        int datablock = get_file_block(fs, in, &map, i);
+        if(datablock < 0)
+        {
+            continue;
+        }
+        if(start == -1)
+        {
+            start = datablock;
+        }
+        else if(datablock != start + k && !block_available_to(fs, inodeIndex, start + k))
+        {
+            inplace = 0;
+        }
+        k++;
+    }
+
+    if(!inplace)
+    {
+        int runlen;
+        release_reservation(fs, inodeIndex);
+        start = find_free_data_run(fs, 0, k, &runlen);
+        if(start == -1 || runlen < k)
+        {
+            return spread_file(fs, inodeIndex, budget);
+        }
+        // The rest of the run is kept for the file until every block is moved
+        fs->reserve_start[inodeIndex] = start;
+        fs->reserve_len[inodeIndex] = runlen;
+        for(int i = 0; i < runlen; i++)
+        {
+            fs->reservedCACHE[start + i] = 1;
+        }
+    }
+
+    /*-----------------*/
+    /* Move the blocks */
+    /*-----------------*/
+    char * blockbuf = (char *) pool_get_buffer();
+    int * oldblocks = (int *) malloc(nblocks * sizeof(int));
+    int moved = 0;
+    k = 0;
+    for(int i = 0; i < nblocks && moved < budget; i++)
+    {
+        int datablock = get_file_block(fs, in, &map, i);
+        if(datablock < 0)
+        {
+            continue;
+        }
+        if(datablock != start + k)
+        {
+            if(move_file_block(fs, inodeIndex, &map, i, start + k, blockbuf) == -1)
+            {
+                break;
+            }
+            oldblocks[moved++] = datablock;
+        }
+        k++;
+    }
+
+    commit_moves(fs, inodeIndex, &map, oldblocks, moved);
+    free(oldblocks);
+    pool_put_buffer(blockbuf);
+    return moved;
+}
+
+/* Move the blocks of the extent compact_free_space is moving, at most budget blocks */
+// The blocks go in order, in batches: the blocks one batch leaves are free for the next one once its
+// pointers are saved. The free blocks of the target still to fill are kept as the reservation window
+// of the file until the next call. The move is given up if the file changed so that no block can move.
+// Return the number of blocks moved
+int continue_compaction(sfs_t * fs, int budget)
+{
+    int inodeIndex = fs->compact_inode;
+    i_node * in = get_inode(fs, inodeIndex);
+    indirect_map map;
+    init_indirect_map(&map);
+    if(!file_is_movable(fs, in, &map))
+    {
+        fs->compact_inode = -1;
+        return 0;
+    }
+
+    char * blockbuf = (char *) pool_get_buffer();
+    int * oldblocks = (int *) malloc(fs->compact_len * sizeof(int));
+    int moved = 0;
+    // First block of the extent not at its place yet, -1 once they all are
+    int pending = -1;
+    int count = 0;
+    while(moved < budget)
+    {
+        count = 0;
+        pending = -1;
+        int k = 0;
+        for(int i = fs->compact_fileblock; i < file_block_count(in) && k < fs->compact_len; i++)
+        {
+            int datablock = get_file_block(fs, in, &map, i);
+            if(datablock < 0)
+            {
+                continue;
+            }
+            int target = fs->compact_target + k;
+            if(datablock != target)
+            {
+                pending = pending == -1 ? k : pending;
+                // Held by a block of the extent until the batch is committed
+                if(moved + count < budget && block_available_to(fs, inodeIndex, target))
+                {
+                    if(move_file_block(fs, inodeIndex, &map, i, target, blockbuf) == -1)
+                    {
+                        break;
+                    }
+                    oldblocks[count++] = datablock;
+                }
+            }
+            k++;
+        }
+        commit_moves(fs, inodeIndex, &map, oldblocks, count);
+        moved = moved + count;
+        if(count == 0)
+        {
+            break;
+        }
+    }
+
+    // Done once every block is at its place, given up when none of the others can move
+    release_reservation(fs, inodeIndex);
+    if(pending == -1 || count == 0)
+    {
+        fs->compact_inode = -1;
+    }
+    else
+    {
+        // Free blocks from the first target still to fill
+        int end = fs->compact_target + fs->compact_len;
+        int start = fs->compact_target + pending;
+        while(start < end && !block_available_to(fs, inodeIndex, start))
+        {
+            start++;
+        }
+        int len = 0;
+        while(start + len < end && block_available_to(fs, inodeIndex, start + len))
+        {
+            fs->reservedCACHE[start + len] = 1;
+            len++;
+        }
+        fs->reserve_start[inodeIndex] = start;
+        fs->reserve_len[inodeIndex] = len;
+    }
+
+    free(oldblocks);
+    pool_put_buffer(blockbuf);
+    return moved;
+}
+
+/* Verify if the blocks of a file between two of its blocks are all holes */
+int only_holes_between(sfs_t * fs, i_node * in, indirect_map * map, int fileblockIndex, int otherIndex)
+{
+    for(int i = fileblockIndex + 1; i < otherIndex; i++)
+    {
+        if(get_file_block(fs, in, map, i) != -1)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Move extents from the end of the data region to the lowest free runs they fit in, moving at most budget blocks */
+// Free space gathers at the end of the data region, leaving large runs for fragmented files
+// Extents only ever move down, whole so no file gets more fragmented: an extent no free run fits slides
+// down into the free blocks right below it, and one longer than what is left of the budget moves in
+// part. continue_compaction moves the rest on later calls, before anything else
+// The indirect pointer block of a file moves on its own, as an extent of one block
+// Return the number of blocks moved
+int compact_free_space(sfs_t * fs, int budget)
+{
+    // File and block of the file held by every data block, -1 if the block can't be moved
+    // The block of the file is -1 for its indirect pointer block
+    int * owner = (int *) malloc(num_data_blcks * sizeof(int));
+    int * ownerblock = (int *) malloc(num_data_blcks * sizeof(int));
+    for(int i = 0; i < num_data_blcks; i++)
+    {
+        owner[i] = -1;
+    }
+    for(int inodeIndex = 0; inodeIndex < max_num_inodes; inodeIndex++)
+    {
+        i_node * in = get_inode(fs, inodeIndex);
+        indirect_map map;
+        init_indirect_map(&map);
+        if(!file_is_movable(fs, in, &map))
+        {
+            continue;
+        }
+        for(int i = 0; i < file_block_count(in); i++)
+        {
+            int datablock = get_file_block(fs, in, &map, i);
+            if(datablock >= 0)
+            {
+                owner[datablock] = inodeIndex;
+                ownerblock[datablock] = i;
+            }
+        }
+        if(in->indirectptr != -1)
+        {
+            owner[in->indirectptr] = inodeIndex;
+            ownerblock[in->indirectptr] = -1;
+        }
+    }
+
+    int moved = 0;
+
+    // Extents from the highest one down
+    int end = num_data_blcks - 1;
+    while(end >= 0 && moved < budget)
+    {
+        if(owner[end] == -1)
+        {
+            end--;
+            continue;
+        }
+        // Blocks following each other in the file, holes apart
+        int inodeIndex = owner[end];
+        i_node * in = get_inode(fs, inodeIndex);
+        indirect_map map;
+        init_indirect_map(&map);
+        int first = end;
+        while(first > 0 && owner[first - 1] == inodeIndex && ownerblock[first] != -1 &&
+              ownerblock[first - 1] != -1 && ownerblock[first - 1] < ownerblock[first] &&
+              only_holes_between(fs, in, &map, ownerblock[first - 1], ownerblock[first]))
+        {
+            first--;
+        }
+        int len = end - first + 1;
+
+        // Lowest free run below the extent, or the free blocks right below it
+        int target = -1;
+        int runlen = 0;
+        for(int i = 0; i + len <= first && target == -1; i++)
+        {
+            runlen = block_available_to(fs, inodeIndex, i) ? runlen + 1 : 0;
+            if(runlen == len)
+            {
+                target = i - len + 1;
+            }
+        }
+        for(int i = first - 1; target == -1 && ownerblock[end] != -1 && i >= 0 && block_available_to(fs, inodeIndex, i); i--)
+        {
+            if(i == 0 || !block_available_to(fs, inodeIndex, i - 1))
+            {
+                target = i;
+            }
+        }
+
+        if(target != -1 && ownerblock[end] == -1)
+        {
+            if(move_indirect_block(fs, inodeIndex, &map, target) == 0)
+            {
+                int oldblock = end;
+                commit_moves(fs, inodeIndex, &map, &oldblock, 1);
+                moved++;
+            }
+        }
+        else if(target != -1)
+        {
+            fs->compact_inode = inodeIndex;
+            fs->compact_fileblock = ownerblock[first];
+            fs->compact_target = target;
+            fs->compact_len = len;
+            moved = moved + continue_compaction(fs, budget - moved);
+        }
+        end = first - 1;
+    }
+
+    free(ownerblock);
+    free(owner);
+    return moved;
+}
+
+int fs_getextents(sfs_t * fs, const char* path)
+{
+    int dirInodeIndex;
+    char name[MAX_FILENAME_LEN + 1];
+    int inodeIndex = resolve_path(fs, path, &dirInodeIndex, name);
+    if(inodeIndex == -1 || (get_inode(fs, inodeIndex)->flags & INODE_DIR))
+    {
+        return -1;
+    }
+
+    indirect_map map;
+    init_indirect_map(&map);
+    return count_extents(fs, get_inode(fs, inodeIndex), &map);
+}
+
+int fs_defrag(sfs_t * fs, int budget)
+{
+    int moved = 0;
+
+    // An extent the last call did not finish moving first
+    if(fs->compact_inode != -1)
+    {
+        moved = continue_compaction(fs, budget);
+    }
+
+    // Fragmented files, from the one the last call stopped in
+    for(int i = 0; i < max_num_inodes && moved < budget; i++)
+    {
+        int inodeIndex = (fs->defrag_next_inode + i) % max_num_inodes;
+        if(inodeIndex == fs->compact_inode)
+        {
+            continue;
+        }
+        int r = defrag_file(fs, inodeIndex, budget - moved);
+        if(r > 0)
+        {
+            moved = moved + r;
+        }
+        if(moved >= budget)
+        {
+            fs->defrag_next_inode = inodeIndex;
+        }
+    }
+
+    // Then free space, once no file can improve, files that found no free run large enough get one on a later call
+    // Compacting while a file is spread over several calls would change its runs, moving back the blocks it set aside
+    if(moved == 0)
+    {
+        moved = compact_free_space(fs, budget);
+    }
+
+    // Nothing moved: done once every file that can move is in one extent, stuck otherwise
+    for(int inodeIndex = 0; moved == 0 && budget > 0 && inodeIndex < max_num_inodes; inodeIndex++)
+    {
+        i_node * in = get_inode(fs, inodeIndex);
+        indirect_map map;
+        init_indirect_map(&map);
+        if(file_is_movable(fs, in, &map) && count_extents(fs, in, &map) > 1)
+        {
+            return SFS_DEFRAG_STUCK;
+        }
+    }
+
+    return moved;
+}
+
+int fs_fallocate(sfs_t * fs, int fileID, int offset, int length)
+{
+    if(fileID < 0 || fileID >= MAX_OPEN_FILE || !fs->open_fdt[fileID]->valid ||
+       offset < 0 || length <= 0 || offset > max_file_size - length)
+    {
+        return -1;
+    }
+
+    int inodeIndex = fs->open_fdt[fileID]->iptr;
+    i_node * inode = get_inode(fs, inodeIndex);
+    // Blocks of a compressed file only exist once their cluster is written
+    if(inode->flags & (INODE_COMPRESSED | INODE_DIR))
+    {
+        return -1;
+    }
+    fs->writing_inode = inodeIndex;
+
+    if((inode->flags & INODE_INLINE) && offset + length <= INLINE_DATA_LEN)
+    {
+        // Bytes past the size of an inline file are already zeros
+        if(offset + length > inode->size)
+        {
+            inode->size = offset + length;
+            save_inodetableCACHE_to_DISK(fs, inodeIndex/inode_per_block);
+        }
+        return 0;
+    }
+
+    indirect_map map;
+    init_indirect_map(&map);
+    int firstblock = offset / BLOCK_SIZE;
+    int lastblock = (offset + length - 1) / BLOCK_SIZE;
+
+    /*-----------------*/
+    /* Count the holes */
+    /*-----------------*/
+    // Nothing is allocated unless every hole can be, the content of an inline file
+    // takes the first block of the file, out of the range unless it starts there
+    int holes = 0;
+    for(int i = firstblock; i <= lastblock; i++)
+    {
+        if(get_file_block(fs, inode, &map, i) == -1)
+        {
+            holes++;
+        }
+    }
+    if((inode->flags & INODE_INLINE) && firstblock > 0 && !is_zero_buffer(inode->inline_data, inode->size))
+    {
+        holes++;
+    }
+    int needindirect = lastblock >= num_directptr && inode->indirectptr == -1;
+    if(holes + needindirect > fs->superblockCACHE->num_free_blocks)
+    {
+        return -1;
+    }
+
+    if((inode->flags & INODE_INLINE) && move_inline_data_to_block(fs, inode) == -1)
+    {
+        return -1;
+    }
+
+    // The indirect pointer block first, so it does not split the runs of the file
+    if(needindirect && ensure_indirect_block(fs, inode, &map) == -1)
+    {
+        return -1;
+    }
+
+    /*------------------------*/
+    /* Fill the holes in runs */
+    /*------------------------*/
+    // Blocks of the file filled, given back if a run can't be found after all
+    int * filled = (int *) malloc((lastblock - firstblock + 1) * sizeof(int));
+    int num_filled = 0;
+    int i = firstblock;
+    while(i <= lastblock)
+    {
+        if(get_file_block(fs, inode, &map, i) != -1)
+        {
+            i++;
+            continue;
+        }
+
+        int runlen = 1;
+        while(i + runlen <= lastblock && get_file_block(fs, inode, &map, i + runlen) == -1)
+        {
+            runlen++;
+        }
+
+        int goal = i > 0 ? get_file_block(fs, inode, &map, i - 1) + 1 : 0;
+        int found;
+        int datablock = find_free_data_run(fs, goal, runlen, &found);
+        if(datablock == -1)
+        {
+            break;
+        }
+        take_data_run(fs, datablock, found);
+
+        // The blocks read as zeros, whatever was on the disk before
+        buffered_discard_blocks(fs, data_starting_ind + datablock, found);
+        clear_checksums(fs, data_starting_ind + datablock, found);
+
+        for(int j = 0; j < found; j++)
+        {
+            set_file_block(fs, inode, &map, i + j, datablock + j);
+            filled[num_filled++] = i + j;
+        }
+        i = i + found;
+    }
+
+    if(i <= lastblock)
+    {
+        for(int j = 0; j < num_filled; j++)
+        {
+            int datablock = get_file_block(fs, inode, &map, filled[j]);
+            set_file_block(fs, inode, &map, filled[j], -1);
+            filled[j] = datablock;
+        }
+        save_indirect_map(fs, inode, &map);
+        save_inodetableCACHE_to_DISK(fs, inodeIndex/inode_per_block);
+        release_data_blocks(fs, filled, num_filled);
+        free(filled);
+        return -1;
+    }
+    free(filled);
+
+    // The file grows to the end of the range, the space past the old size reads as zeros
+    if(offset + length > inode->size)
+    {
+        inode->size = offset + length;
+    }
+
+    save_indirect_map(fs, inode, &map);
+    save_inodetableCACHE_to_DISK(fs, inodeIndex/inode_per_block);
+
+    return 0;
+}
+
+int fs_ftruncate(sfs_t * fs, int fileID, int size)
+{
+    if(fileID < 0 || fileID >= MAX_OPEN_FILE || !fs->open_fdt[fileID]->valid || size < 0 || size > max_file_size)
+    {
+        return -1;
+    }
+
+    int inodeIndex = fs->open_fdt[fileID]->iptr;
+    i_node * inode = get_inode(fs, inodeIndex);
+    fs->writing_inode = inodeIndex;
+
+    /*-------------*/
+    /* Inline file */
+    /*-------------*/
+    if(inode->flags & INODE_INLINE)
+    {
+        if(size <= INLINE_DATA_LEN)
+        {
+            // Bytes past the size of an inline file are zeros
+            if(size < inode->size)
+            {
+                memset(inode->inline_data + size, 0, inode->size - size);
+            }
+            inode->size = size;
+            save_inodetableCACHE_to_DISK(fs, inodeIndex/inode_per_block);
+            return 0;
+        }
+
+        if(move_inline_data_to_block(fs, inode) == -1)
+        {
+            printf("No more space to create a datablock\n");
+            return -1;
+        }
+    }
+
+    /*-----------------*/
+    /* Extend the file */
+    /*-----------------*/
+    // The new bytes are a hole, they read as zeros
+    if(size >= inode->size)
+    {
+        inode->size = size;
+        save_inodetableCACHE_to_DISK(fs, inodeIndex/inode_per_block);
+        return 0;
+    }
+
+    /*-----------------*/
+    /* Shrink the file */
+    /*-----------------*/
+    // Blocks are freed whole, clusters of a compressed file too
+    int unit = inode->flags & INODE_COMPRESSED ? CLUSTER_BLOCKS * BLOCK_SIZE : BLOCK_SIZE;
+    int keptend = (size + unit - 1) / unit * unit;
+
+    // The bytes past the new end in the last block kept are zeroed, so they read as zeros if the file grows again
+    // Shared blocks get their own copy, zeros written in a hole leave it a hole
+    int tailend = keptend < inode->size ? keptend : inode->size;
+    if(tailend > size)
+    {
+        char * zeros = (char *) pool_get_buffer();
+        memset(zeros, 0, tailend - size);
+        int written = write_file(fs, inodeIndex, zeros, tailend - size, size);
+        pool_put_buffer(zeros);
+        if(written != tailend - size)
+        {
+            return -1;
+        }
+    }
+
+    int * freed_blocks = (int *) malloc((num_directptr + indirectptr_per_block + 1) * sizeof(int));
+    indirect_map map;
+    init_indirect_map(&map);
+    int num_freed_blocks = unmap_file_blocks(fs, inode, &map, keptend / BLOCK_SIZE, freed_blocks);
+    inode->size = size;
+    // Blocks appended later get a new window after the last block kept
+    release_reservation(fs, inodeIndex);
+
+    // The file no longer points to the blocks once they are freed
+    save_indirect_map(fs, inode, &map);
+    save_inodetableCACHE_to_DISK(fs, inodeIndex/inode_per_block);
+    num_freed_blocks = release_data_blocks(fs, freed_blocks, num_freed_blocks);
+    if(fs->discard_online)
+    {
+        discard_freed_blocks(fs, freed_blocks, num_freed_blocks);
+    }
+    free(freed_blocks);
+
+    return 0;
+}
+
+int fs_fsync(sfs_t * fs, int fileID)
+{
+    if(fileID < 0 || fileID >= MAX_OPEN_FILE || !fs->open_fdt[fileID]->valid)
+    {
+        return -1;
+    }
+
+    // The metadata of the file system is written along with the content of the file
+    return sync_blocks(fs, fs->open_fdt[fileID]->iptr);
+}
+
+int fs_sync(sfs_t * fs)
+{
+    return sync_blocks(fs, -2);
+}
+
+/*-----------------------*/
+/* LOG-STRUCTURED LAYOUT */
+/*-----------------------*/
+// The data blocks are split in segments the log fills one after the other. Every block written
+// goes to the head of the log and the block it replaces is freed, so writes reach the disk in
+// order whatever the file they belong to. The cleaner moves the blocks left in partly used
+// segments to the head of the log, the segments they leave become free for the log.
+
+/* First DATA block past a segment */
+int segment_end(int segment)
+{
+    int end = (segment + 1) * SEGMENT_BLOCKS;
+    return end < num_data_blcks ? end : num_data_blcks;
+}
+
+/* Verify if a data block is in the segment the log is filling */
+// Metadata blocks there are written again in place, they move once per segment instead of once per save
+int in_log_head_segment(sfs_t * fs, int datablock)
+{
+    return fs->log_head < num_data_blcks && datablock / SEGMENT_BLOCKS == fs->log_head / SEGMENT_BLOCKS;
+}
+
+/* Count the blocks of a segment the log can take (free and outside every reservation window) */
+int segment_free_blocks(sfs_t * fs, int segment)
+{
+    int count = 0;
+    for(int datablock = segment * SEGMENT_BLOCKS; datablock < segment_end(segment); datablock++)
+    {
+        if(*(fs->freebitmapCACHE + data_starting_ind + datablock) == '1' && !fs->reservedCACHE[datablock])
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+/* Count the segments with every block free */
+int count_free_segments(sfs_t * fs)
+{
+    int num_segments = (num_data_blcks + SEGMENT_BLOCKS - 1) / SEGMENT_BLOCKS;
+    int count = 0;
+    for(int segment = 0; segment < num_segments; segment++)
+    {
+        if(segment_free_blocks(fs, segment) == segment_end(segment) - segment * SEGMENT_BLOCKS)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+/* Take the next free data block of the log */
+// Blocks are taken from the head to the end of its segment, then the log goes on in the next free segment
+// Without a free segment left, the log goes through the free blocks of the partly used ones
+// Return DATA BLOCK index, -1 if no more free data blocks
+int log_allocate_block(sfs_t * fs)
+{
+    if(fs->superblockCACHE->num_free_blocks == 0)
+    {
+        return -1;
+    }
+
+    int num_segments = (num_data_blcks + SEGMENT_BLOCKS - 1) / SEGMENT_BLOCKS;
+    int segment = fs->log_head / SEGMENT_BLOCKS;
+    int datablock = -1;
+    for(int i = fs->log_head; i < segment_end(segment) && datablock == -1; i++)
+    {
+        if(*(fs->freebitmapCACHE + data_starting_ind + i) == '1' && !fs->reservedCACHE[i])
+        {
+            datablock = i;
+        }
+    }
+
+    // The head moves to another segment, the cleaner makes sure free ones are left
+    for(int k = 1; k <= num_segments && datablock == -1; k++)
+    {
+        int next = (segment + k) % num_segments;
+        if(segment_free_blocks(fs, next) == segment_end(next) - next * SEGMENT_BLOCKS)
+        {
+            datablock = next * SEGMENT_BLOCKS;
+        }
+    }
+    for(int k = 0; k < num_data_blcks && datablock == -1; k++)
+    {
+        int i = (fs->log_head + k) % num_data_blcks;
+        if(*(fs->freebitmapCACHE + data_starting_ind + i) == '1' && !fs->reservedCACHE[i])
+        {
+            datablock = i;
+        }
+    }
+
+    if(datablock == -1)
+    {
+        // Every free block left is reserved
+        if(release_all_reservations(fs) > 0)
+        {
+            return log_allocate_block(fs);
+        }
+        return -1;
+    }
+
+    if(datablock / SEGMENT_BLOCKS != segment && fs->cleaner_started)
+    {
+        pthread_mutex_lock(&fs->cleaner_lock);
+        pthread_cond_signal(&fs->cleaner_wake);
+        pthread_mutex_unlock(&fs->cleaner_lock);
+    }
+
+    take_data_run(fs, datablock, 1);
+    fs->log_head = datablock + 1;
+    return datablock;
+}
+
+/* Find what every data block holds, for the cleaner */
+// owner receives the file holding each block and ownerblock its block in the file, -1 for its
+// indirect pointer block. Block j of the i node table has -2 - j as owner, the blocks that
+// can't be moved (free, shared, directory nodes, compressed or inline files) have -1
+void find_block_owners(sfs_t * fs, int * owner, int * ownerblock)
+{
+    for(int i = 0; i < num_data_blcks; i++)
+    {
+        owner[i] = -1;
+    }
+
+    for(int inodeIndex = 0; inodeIndex < max_num_inodes; inodeIndex++)
+    {
+        i_node * in = get_inode(fs, inodeIndex);
+        indirect_map map;
+        init_indirect_map(&map);
+        if(!file_is_movable(fs, in, &map))
+        {
+            continue;
+        }
+        for(int i = 0; i < file_block_count(in); i++)
+        {
+            int datablock = get_file_block(fs, in, &map, i);
+            if(datablock >= 0)
+            {
+                owner[datablock] = inodeIndex;
+                ownerblock[datablock] = i;
+            }
+        }
+        if(in->indirectptr != -1)
+        {
+            owner[in->indirectptr] = inodeIndex;
+            ownerblock[in->indirectptr] = -1;
+        }
+    }
+
+    for(int j = 0; j < num_inodes_blcks; j++)
+    {
+        if(fs->superblockCACHE->inode_map[j] != 0)
+        {
+            owner[fs->superblockCACHE->inode_map[j] - data_starting_ind] = -2 - j;
+        }
+    }
+}
+
+/* Move every block in use of a segment to the head of the log */
+// The blocks of a file are moved together, its pointers are saved once for all of them
+// Return the number of blocks moved
+int clean_segment(sfs_t * fs, int segment, int * owner, int * ownerblock, char * blockbuf, int * oldblocks)
+{
+    int start = segment * SEGMENT_BLOCKS;
+    int end = segment_end(segment);
+    int moved = 0;
+
+    for(int datablock = start; datablock < end; datablock++)
+    {
+        int inodeIndex = owner[datablock];
+        if(inodeIndex < 0)
+        {
+            continue;
+        }
+
+        indirect_map map;
+        init_indirect_map(&map);
+        int count = 0;
+        for(int i = datablock; i < end; i++)
+        {
+            if(owner[i] != inodeIndex)
+            {
+                continue;
+            }
+            if(ownerblock[i] == -1)
+            {
+                // Moved to the head of the log when the pointers are saved
+                if(load_indirect_map(fs, get_inode(fs, inodeIndex), &map) == 0)
+                {
+                    map.dirty = 1;
+                    moved++;
+                }
+            }
+            else if(move_file_block(fs, inodeIndex, &map, ownerblock[i], -1, blockbuf) == 0)
+            {
+                oldblocks[count++] = i;
+            }
+            owner[i] = -1;
+        }
+        commit_moves(fs, inodeIndex, &map, oldblocks, count);
+        moved = moved + count;
+    }
+
+    // Blocks of the i node table still in the segment, saving them moves them to the head of the log
+    for(int j = 0; j < num_inodes_blcks; j++)
+    {
+        int location = fs->superblockCACHE->inode_map[j] - data_starting_ind;
+        if(fs->superblockCACHE->inode_map[j] != 0 && location >= start && location < end)
+        {
+            get_inode(fs, j*inode_per_block);
+            save_inodetableCACHE_to_DISK(fs, j);
+            moved++;
+        }
+    }
+
+    return moved;
+}
+
+/* Clean the segments with the fewest blocks in use, moving at most budget blocks */
+// Only segments whose blocks can all be moved are cleaned, they are cleaned whole
+// Segments with more than CLEAN_MAX_USED_BLOCKS blocks in use are left as they are
+// and the cleaning stops once it no longer makes free segments
+// Return the number of blocks moved
+int fs_clean(sfs_t * fs, int budget)
+{
+    if(!fs->log_structured)
+    {
+        return 0;
+    }
+
+    int num_segments = (num_data_blcks + SEGMENT_BLOCKS - 1) / SEGMENT_BLOCKS;
+    int * owner = (int *) malloc(num_data_blcks * sizeof(int));
+    int * ownerblock = (int *) malloc(num_data_blcks * sizeof(int));
+    int * oldblocks = (int *) malloc(SEGMENT_BLOCKS * sizeof(int));
+    char * blockbuf = (char *) pool_get_buffer();
+    int moved = 0;
+
+    while(moved < budget)
+    {
+        find_block_owners(fs, owner, ownerblock);
+
+        // The segment the log writes to is left alone, blocks moved go there
+        int victim = -1;
+        int victim_used = 0;
+        for(int segment = 0; segment < num_segments; segment++)
+        {
+            int len = segment_end(segment) - segment * SEGMENT_BLOCKS;
+            int used = 0;
+            int movable = 1;
+            for(int datablock = segment * SEGMENT_BLOCKS; datablock < segment_end(segment); datablock++)
+            {
+                if(*(fs->freebitmapCACHE + data_starting_ind + datablock) == '0')
+                {
+                    used++;
+                    movable = movable && owner[datablock] != -1;
+                }
+            }
+            if(segment != fs->log_head / SEGMENT_BLOCKS && movable && used > 0 && used < len && used <= CLEAN_MAX_USED_BLOCKS &&
+               (victim == -1 || used < victim_used))
+            {
+                victim = segment;
+                victim_used = used;
+            }
+        }
+
+        // Segments with more blocks than what is left of the budget, or than the free blocks elsewhere, stay as they are
+        if(victim == -1 || moved + victim_used > budget ||
+           fs->superblockCACHE->num_free_blocks - segment_free_blocks(fs, victim) < victim_used)
+        {
+            break;
+        }
+
+        // Moving the blocks frees other blocks of the log (the i node table blocks and indirect pointer
+        // blocks left behind), the cleaning stops once it does not leave one more free segment
+        int free_segments = count_free_segments(fs);
+        int r = clean_segment(fs, victim, owner, ownerblock, blockbuf, oldblocks);
+        moved = moved + r;
+        if(r == 0 || count_free_segments(fs) <= free_segments)
+        {
+            break;
+        }
+    }
+
+    pool_put_buffer(blockbuf);
+    free(oldblocks);
+    free(ownerblock);
+    free(owner);
+    return moved;
+}
+
+/* Segment cleaner thread of a file system */
+// Wakes up every CLEANER_INTERVAL_MS or when the log moves to another segment, and cleans
+// as any call changing the file system while fewer than CLEANER_MIN_FREE_SEGMENTS segments are free
+void * cleaner_main(void * arg)
+{
+    sfs_t * fs = (sfs_t *) arg;
+
+    pthread_mutex_lock(&fs->cleaner_lock);
+    while(!fs->cleaner_stopping)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec = deadline.tv_nsec + CLEANER_INTERVAL_MS * 1000000L;
+        deadline.tv_sec = deadline.tv_sec + deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec = deadline.tv_nsec % 1000000000L;
+        pthread_cond_timedwait(&fs->cleaner_wake, &fs->cleaner_lock, &deadline);
+        if(fs->cleaner_stopping)
+        {
+            break;
+        }
+        pthread_mutex_unlock(&fs->cleaner_lock);
+
+        pthread_rwlock_wrlock(&fs->lock);
+        if(fs->log_structured && count_free_segments(fs) < CLEANER_MIN_FREE_SEGMENTS)
+        {
+            fs_clean(fs, CLEANER_BUDGET);
+            finish_call(fs);
+        }
+        pthread_rwlock_unlock(&fs->lock);
+
+        pthread_mutex_lock(&fs->cleaner_lock);
+    }
+    pthread_mutex_unlock(&fs->cleaner_lock);
+
+    return NULL;
+}
+
+void fs_setlogstructured(sfs_t * fs, int enabled)
+{
+    // Reservation windows are not used by the log, it starts in a free segment
+    if(enabled && !fs->log_structured)
+    {
+        release_all_reservations(fs);
+        fs->log_head = num_data_blcks;
+    }
+    fs->log_structured = enabled;
+
+    if(enabled && !fs->cleaner_started)
+    {
+        fs->cleaner_started = pthread_create(&fs->cleaner, NULL, cleaner_main, fs) == 0;
+    }
+}
+
+/*-------------------*/
+/* FILE SYSTEM CHECK */
+/*-------------------*/
+// The image is read with a single request and checked in memory, the passes over the
+// blocks and the i nodes are split between threads. Repairs are made afterwards on the
+// mounted file system, so every block rewritten gets its checksum.
+
+// Everything found on an image, shared by the threads of a pass
+typedef struct FSCK_STATE
+{
+    char * image;
+    super_block * sb;
+    // Checksum table read from the image, 0 for the blocks without a checksum
+    unsigned int * checksums;
+    int num_threads;
+
+    // I nodes as they will be once repaired, inode_bad is set for the ones that changed
+    i_node inodes[MAX_INODES];
+    int inode_bad[MAX_INODES];
+    // Indirect pointer entries of every file with an indirect block (num_indirectptr of them)
+    int * indirect[MAX_INODES];
+    // Nodes of every directory B+tree and the entries found in its leaves
+    int * dirnodes[MAX_INODES];
+    int num_dirnodes[MAX_INODES];
+    dir_entry * entries[MAX_INODES];
+    int num_entries[MAX_INODES];
+    int max_entries[MAX_INODES];
+    // The B+tree of the directory can't be trusted, it is rebuilt from its entries
+    int dir_damaged[MAX_INODES];
+    // Set for the i nodes a path from the root directory leads to
+    int reachable[MAX_INODES];
+
+    // Uses of every data block counted by each thread of the block pass
+    // The bitmap pass leaves the total of every block in the array of the first thread
+    unsigned short * uses[64];
+    unsigned char * metadata_uses[64];
+    // Expected free bitmap and reference count table
+    unsigned char * freebitmap;
+    unsigned char * refcounts;
+} fsck_state;
+
+// Slice of a pass given to one thread
+typedef struct FSCK_WORKER
+{
+    fsck_state * st;
+    int thread;
+    int begin;
+    int end;
+    fsck_report found;
+} fsck_worker;
+
+// More threads than this don't make a pass over 1024 blocks any faster
+#define FSCK_MAX_THREADS 64
+
+/* Run a pass over count items, split in one slice per thread */
+// The counters found by every thread are added to the report
+void fsck_run_pass(fsck_state * st, int count, void * (*pass)(void *), fsck_report * report)
+{
+    pthread_t threads[FSCK_MAX_THREADS];
+    fsck_worker workers[FSCK_MAX_THREADS];
+    int started[FSCK_MAX_THREADS];
+
+    for(int t = 0; t < st->num_threads; t++)
+    {
+        workers[t].st = st;
+        workers[t].thread = t;
+        workers[t].begin = count * t / st->num_threads;
+        workers[t].end = count * (t + 1) / st->num_threads;
+        memset(&workers[t].found, 0, sizeof(fsck_report));
+        // A slice runs in the calling thread if no thread can be started for it
+        started[t] = pthread_create(&threads[t], NULL, pass, &workers[t]) == 0;
+        if(!started[t])
+        {
+            pass(&workers[t]);
+        }
+    }
+
+    for(int t = 0; t < st->num_threads; t++)
+    {
+        if(started[t])
+        {
+            pthread_join(threads[t], NULL);
+        }
+        report->bad_inodes += workers[t].found.bad_inodes;
+        report->bitmap_errors += workers[t].found.bitmap_errors;
+        report->refcount_errors += workers[t].found.refcount_errors;
+        report->cross_linked_blocks += workers[t].found.cross_linked_blocks;
+        report->checksum_errors += workers[t].found.checksum_errors;
+    }
+}
+
+/* Pass verifying a slice of the blocks against their checksum */
+void * fsck_checksum_pass(void * arg)
+{
+    fsck_worker * w = (fsck_worker *) arg;
+    for(int block = w->begin; block < w->end; block++)
+    {
+        unsigned int checksum = w->st->checksums[block];
+        if(checksum != 0 && block_checksum(w->st->image + block*BLOCK_SIZE) != checksum)
+        {
+            printf("Checksum mismatch on block %d\n", block);
+            w->found.checksum_errors++;
+        }
+    }
+    return NULL;
+}
+
+/* Verify if a block pointer of a file is valid */
+int fsck_valid_pointer(i_node * in, int datablock)
+{
+    return datablock == -1 || (datablock >= 0 && datablock < num_data_blcks) ||
+           (datablock == COMPRESSED_BLOCK && (in->flags & INODE_COMPRESSED));
+}
+
+/* Collect the nodes and entries of a directory B+tree from the image */
+// visited marks the nodes already seen in this tree
+// Return 0, -1 if the tree is damaged (bad pointer, loop, too deep or malformed leaf)
+int fsck_walk_dir(fsck_state * st, int inodeIndex, int datablock, int depth, unsigned char * visited)
+{
+    if(datablock < 0 || datablock >= num_data_blcks || visited[datablock] || depth > DIR_MAX_DEPTH)
+    {
+        return -1;
+    }
+    visited[datablock] = 1;
+    st->dirnodes[inodeIndex][st->num_dirnodes[inodeIndex]++] = datablock;
+
+    dir_node * node = (dir_node *) (st->image + (data_starting_ind + datablock)*BLOCK_SIZE);
+    if(!node->leaf)
+    {
+        if(node->num_keys < 0 || node->num_keys > DIR_NODE_KEYS)
+        {
+            return -1;
+        }
+        for(int i = 0; i <= node->num_keys; i++)
+        {
+            if(fsck_walk_dir(st, inodeIndex, node->u.index.children[i], depth + 1, visited) == -1)
+            {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    if(node->num_keys < 0)
+    {
+        return -1;
+    }
+    int offset = 0;
+    for(int i = 0; i < node->num_keys; i++)
+    {
+        // An entry must fit in the leaf before it is unpacked
+        if(offset + DIR_ENTRY_HEADER_LEN > (int) sizeof(node->u.entries) ||
+           offset + DIR_ENTRY_HEADER_LEN + (unsigned char) node->u.entries[offset + 8] > (int) sizeof(node->u.entries))
+        {
+            return -1;
+        }
+        if(st->num_entries[inodeIndex] == st->max_entries[inodeIndex])
+        {
+            st->max_entries[inodeIndex] = 2 * st->max_entries[inodeIndex] + 16;
+            st->entries[inodeIndex] = (dir_entry *) realloc(st->entries[inodeIndex], st->max_entries[inodeIndex] * sizeof(dir_entry));
+        }
+        dir_entry * entry = &st->entries[inodeIndex][st->num_entries[inodeIndex]];
+        offset = dir_leaf_get(node, offset, entry);
+        // An entry under the wrong hash can't be found by a lookup
+        if(entry->name_len == 0 || entry->hash != dir_name_hash(entry->filename))
+        {
+            return -1;
+        }
+        st->num_entries[inodeIndex]++;
+    }
+    return 0;
+}
+
+/* Pass validating a slice of the i node table */
+// Pointers outside the data blocks are cleared, directories get their nodes and entries collected
+void * fsck_inode_pass(void * arg)
+{
+    fsck_worker * w = (fsck_worker *) arg;
+    fsck_state * st = w->st;
+    unsigned char * visited = (unsigned char *) malloc(num_data_blcks);
+
+    for(int i = w->begin; i < w->end; i++)
+    {
+        i_node * in = &st->inodes[i];
+        int block = i/inode_per_block;
+
+        // I nodes of a block never written are free
+        if(!(st->sb->inode_block_init & (1u << block)))
+        {
+            in->valid = 0;
+            continue;
+        }
+        memcpy(in, st->image + inode_block_location(st->sb, block)*BLOCK_SIZE + (i % inode_per_block)*sizeof(i_node), sizeof(i_node));
+        if(!in->valid)
+        {
+            continue;
+        }
+
+        int bad = 0;
+        if(in->flags & ~(INODE_INLINE | INODE_COMPRESSED | INODE_DIR))
+        {
+            in->flags = in->flags & (INODE_INLINE | INODE_COMPRESSED | INODE_DIR);
+            bad = 1;
+        }
+
+        if(in->flags & INODE_DIR)
+        {
+            /*-----------*/
+            /* Directory */
+            /*-----------*/
+            st->dirnodes[i] = (int *) malloc(num_data_blcks * sizeof(int));
+            memset(visited, 0, num_data_blcks);
+            if(in->directptr[0] != -1 && fsck_walk_dir(st, i, in->directptr[0], 0, visited) == -1)
+            {
+                st->dir_damaged[i] = 1;
+            }
+
+            // Leaves are found in hash order, each one must link to the next
+            int prevleaf = -1;
+            for(int j = 0; j < st->num_dirnodes[i] && !st->dir_damaged[i]; j++)
+            {
+                int datablock = st->dirnodes[i][j];
+                dir_node * node = (dir_node *) (st->image + (data_starting_ind + datablock)*BLOCK_SIZE);
+                if(!node->leaf)
+                {
+                    continue;
+                }
+                if(prevleaf != -1 && ((dir_node *) (st->image + (data_starting_ind + prevleaf)*BLOCK_SIZE))->next != datablock)
+                {
+                    st->dir_damaged[i] = 1;
+                }
+                prevleaf = datablock;
+            }
+            if(prevleaf != -1 && ((dir_node *) (st->image + (data_starting_ind + prevleaf)*BLOCK_SIZE))->next != -1)
+            {
+                st->dir_damaged[i] = 1;
+            }
+
+            if(st->dir_damaged[i] || in->size != st->num_entries[i])
+            {
+                st->dir_damaged[i] = 1;
+                bad = 1;
+            }
+            // Entries are checked once every i node is known
+        }
+        else if(in->flags & INODE_INLINE)
+        {
+            /*-------------*/
+            /* Inline file */
+            /*-------------*/
+            if(in->size < 0 || in->size > INLINE_DATA_LEN)
+            {
+                in->size = in->size < 0 ? 0 : INLINE_DATA_LEN;
+                bad = 1;
+            }
+        }
+        else
+        {
+            /*--------------------------*/
+            /* File with block pointers */
+            /*--------------------------*/
+            if(in->size < 0 || in->size > max_file_size)
+            {
+                in->size = in->size < 0 ? 0 : max_file_size;
+                bad = 1;
+            }
+            for(int j = 0; j < num_directptr; j++)
+            {
+                if(!fsck_valid_pointer(in, in->directptr[j]))
+                {
+                    in->directptr[j] = -1;
+                    bad = 1;
+                }
+            }
+
+            if(in->indirectptr != -1 && (in->indirectptr < 0 || in->indirectptr >= num_data_blcks))
+            {
+                in->indirectptr = -1;
+                bad = 1;
+            }
+            if(in->num_indirectptr < 0 || in->num_indirectptr > indirectptr_per_block ||
+               (in->indirectptr == -1 && in->num_indirectptr != 0))
+            {
+                in->num_indirectptr = in->indirectptr == -1 ? 0 : indirectptr_per_block;
+                bad = 1;
+            }
+
+            if(in->indirectptr != -1)
+            {
+                st->indirect[i] = (int *) malloc(indirectptr_per_block * sizeof(int));
+                memcpy(st->indirect[i], st->image + (data_starting_ind + in->indirectptr)*BLOCK_SIZE, BLOCK_SIZE);
+                for(int j = 0; j < in->num_indirectptr; j++)
+                {
+                    if(!fsck_valid_pointer(in, st->indirect[i][j]))
+                    {
+                        st->indirect[i][j] = -1;
+                        bad = 1;
+                    }
+                }
+            }
+        }
+
+        st->inode_bad[i] = bad;
+        w->found.bad_inodes += bad;
+    }
+
+    free(visited);
+    return NULL;
+}
+
+/* Find the i nodes a path from the root directory leads to */
+// Entries to a free i node, to an i node already in a directory or with the name of an
+// earlier entry are dropped and their directory is rebuilt without them
+void fsck_find_reachable(fsck_state * st, fsck_report * report)
+{
+    int queue[MAX_INODES];
+    int head = 0;
+    int tail = 0;
+
+    st->reachable[st->sb->i_rootdir] = 1;
+    queue[tail++] = st->sb->i_rootdir;
+
+    while(head < tail)
+    {
+        int dirInodeIndex = queue[head++];
+        dir_entry * entries = st->entries[dirInodeIndex];
+
+        for(int k = 0; k < st->num_entries[dirInodeIndex]; k++)
+        {
+            int target = entries[k].i_node;
+            int keep = target >= 0 && target < max_num_inodes && st->inodes[target].valid && !st->reachable[target];
+            for(int j = 0; keep && j < k; j++)
+            {
+                keep = entries[j].i_node == -1 || strcmp(entries[j].filename, entries[k].filename) != 0;
+            }
+
+            if(!keep)
+            {
+                entries[k].i_node = -1;
+                st->dir_damaged[dirInodeIndex] = 1;
+                report->bad_entries++;
+                continue;
+            }
+
+            st->reachable[target] = 1;
+            if(st->inodes[target].flags & INODE_DIR)
+            {
+                queue[tail++] = target;
+            }
+        }
+    }
+
+    for(int i = 0; i < max_num_inodes; i++)
+    {
+        if(st->inodes[i].valid && !st->reachable[i])
+        {
+            report->orphan_inodes++;
+        }
+    }
+}
+
+/* Pass counting the uses of every data block by a slice of the i node table */
+// Only the i nodes kept by the repair are counted, in the arrays of the thread
+void * fsck_block_use_pass(void * arg)
+{
+    fsck_worker * w = (fsck_worker *) arg;
+    fsck_state * st = w->st;
+    unsigned short * uses = st->uses[w->thread];
+    unsigned char * metadata_uses = st->metadata_uses[w->thread];
+
+    for(int i = w->begin; i < w->end; i++)
+    {
+        i_node * in = &st->inodes[i];
+        if(!st->reachable[i] || (in->flags & INODE_INLINE))
+        {
+            continue;
+        }
+
+        if(in->flags & INODE_DIR)
+        {
+            for(int j = 0; j < st->num_dirnodes[i]; j++)
+            {
+                uses[st->dirnodes[i][j]]++;
+                metadata_uses[st->dirnodes[i][j]] = 1;
+            }
+            continue;
+        }
+
+        for(int j = 0; j < num_directptr; j++)
+        {
+            if(in->directptr[j] >= 0)
+            {
+                uses[in->directptr[j]]++;
+            }
+        }
+        if(in->indirectptr != -1)
+        {
+            uses[in->indirectptr]++;
+            metadata_uses[in->indirectptr] = 1;
+            for(int j = 0; j < in->num_indirectptr; j++)
+            {
+                if(st->indirect[i][j] >= 0)
+                {
+                    uses[st->indirect[i][j]]++;
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Pass rebuilding the free bitmap and the reference counts of a slice of the data blocks */
+// Blocks are compared with the tables of the image
+void * fsck_bitmap_pass(void * arg)
+{
+    fsck_worker * w = (fsck_worker *) arg;
+    fsck_state * st = w->st;
+    unsigned char * freebitmap_disk = (unsigned char *) st->image + (NUM_BLOCKS - 1)*BLOCK_SIZE;
+    unsigned char * refcounts_disk = (unsigned char *) st->image + refcount_starting_ind*BLOCK_SIZE;
+
+    for(int datablock = w->begin; datablock < w->end; datablock++)
+    {
+        int uses = 0;
+        int metadata = 0;
+        for(int t = 0; t < st->num_threads; t++)
+        {
+            uses = uses + st->uses[t][datablock];
+            metadata = metadata || st->metadata_uses[t][datablock];
+        }
+        // Only file content can be shared, metadata blocks belong to a single i node
+        if(metadata && uses > 1)
+        {
+            printf("Block %d is used by several files\n", data_starting_ind + datablock);
+            w->found.cross_linked_blocks++;
+        }
+        st->uses[0][datablock] = uses;
+
+        st->freebitmap[data_starting_ind + datablock] = uses > 0 ? '0' : '1';
+        if(freebitmap_disk[data_starting_ind + datablock] != st->freebitmap[data_starting_ind + datablock])
+        {
+            w->found.bitmap_errors++;
+        }
+
+        st->refcounts[datablock] = metadata || uses < 2 ? 0 : (uses - 1 < 255 ? uses - 1 : 255);
+        if(refcounts_disk[datablock] != st->refcounts[datablock])
+        {
+            w->found.refcount_errors++;
+        }
+    }
+
+    return NULL;
+}
+
+/* Write the repairs found by the check to the image */
+// Return the number of problems left, -1 if the image can't be mounted
+int fsck_repair(fsck_state * st, const char * path)
+{
+    sfs_t * fs = sfs_mount(path, 0, SFS_DURABILITY_WRITEBACK);
+    if(fs == NULL)
+    {
+        return -1;
+    }
+    int remaining = 0;
+
+    // Blocks of the i node table are read where the check found them
+    memcpy(fs->superblockCACHE->inode_map, st->sb->inode_map, sizeof(fs->superblockCACHE->inode_map));
+
+    /*---------*/
+    /* I nodes */
+    /*---------*/
+    // Orphans are freed, damaged directories are emptied and filled again below
+    int block_dirty[NUM_INODE_BLOCKS] = {0};
+    for(int i = 0; i < max_num_inodes; i++)
+    {
+        if(!st->inodes[i].valid || (st->reachable[i] && !st->inode_bad[i] && !st->dir_damaged[i]))
+        {
+            continue;
+        }
+
+        i_node * in = get_inode(fs, i);
+        if(!st->reachable[i])
+        {
+            in->valid = 0;
+        }
+        else
+        {
+            *in = st->inodes[i];
+            if(st->indirect[i] != NULL)
+            {
+                indirect_map map;
+                init_indirect_map(&map);
+                for(int j = 0; j < indirectptr_per_block; j++)
+                {
+                    map.datablockindex[j] = j < in->num_indirectptr ? st->indirect[i][j] : -1;
+                }
+                map.loaded = 1;
+                map.dirty = 1;
+                save_indirect_map(fs, in, &map);
+            }
+            if(st->dir_damaged[i])
+            {
+                in->directptr[0] = -1;
+                in->size = 0;
+            }
+        }
+        block_dirty[i/inode_per_block] = 1;
+    }
+    for(int j = 0; j < num_inodes_blcks; j++)
+    {
+        if(block_dirty[j])
+        {
+            save_inodetableCACHE_to_DISK(fs, j);
+        }
+    }
+
+    /*-------------------------------*/
+    /* Free bitmap and shared blocks */
+    /*-------------------------------*/
+    // Blocks of the i node table are in use once they were written
+    for(int j = 0; j < num_inodes_blcks; j++)
+    {
+        st->freebitmap[i_node_starting_ind + j] = fs->superblockCACHE->inode_block_init & (1u << j) ? '0' : '1';
+    }
+
+    int * freed_blocks = (int *) malloc(num_data_blcks * sizeof(int));
+    int num_freed_blocks = 0;
+    int num_free_blocks = 0;
+    for(int datablock = 0; datablock < num_data_blcks; datablock++)
+    {
+        if(st->freebitmap[data_starting_ind + datablock] == '1')
+        {
+            num_free_blocks++;
+            if(fs->freebitmapCACHE[data_starting_ind + datablock] == '0')
+            {
+                fs->dedupCANDIDATE[datablock] = 0;
+                freed_blocks[num_freed_blocks++] = data_starting_ind + datablock;
+            }
+        }
+    }
+    memcpy(fs->freebitmapCACHE, st->freebitmap, BLOCK_SIZE);
+    fs->freebitmap_dirty = 1;
+    fs->superblockCACHE->num_free_blocks = num_free_blocks;
+
+    memcpy(fs->refcountCACHE, st->refcounts, BLOCK_SIZE);
+    fs->refcount_dirty = 1;
+    save_refcount_table(fs);
+
+    /*---------------------*/
+    /* Damaged directories */
+    /*---------------------*/
+    // The nodes of the old tree are freed, unless another file uses them too
+    for(int i = 0; i < max_num_inodes; i++)
+    {
+        if(st->reachable[i] && st->dir_damaged[i])
+        {
+            int num_nodes = 0;
+            for(int j = 0; j < st->num_dirnodes[i]; j++)
+            {
+                int datablock = st->dirnodes[i][j];
+                if(st->uses[0][datablock] == 1)
+                {
+                    freed_blocks[num_freed_blocks + num_nodes++] = datablock;
+                }
+            }
+            num_freed_blocks = num_freed_blocks + release_data_blocks(fs, freed_blocks + num_freed_blocks, num_nodes);
+        }
+    }
+    // Before the new trees take any of the freed blocks
+    if(fs->discard_online)
+    {
+        discard_freed_blocks(fs, freed_blocks, num_freed_blocks);
+    }
+    free(freed_blocks);
+
+    int dir_num_elements = 0;
+    for(int i = 0; i < max_num_inodes; i++)
+    {
+        if(!st->reachable[i] || !(st->inodes[i].flags & INODE_DIR))
+        {
+            continue;
+        }
+        for(int k = 0; k < st->num_entries[i]; k++)
+        {
+            dir_entry * entry = &st->entries[i][k];
+            if(entry->i_node == -1)
+            {
+                continue;
+            }
+            if(st->dir_damaged[i] && dir_insert(fs, i, entry->filename, entry->i_node) == -1)
+            {
+                printf("No more space to add %s back to its directory\n", entry->filename);
+                remaining++;
+                continue;
+            }
+            dir_num_elements++;
+        }
+    }
+
+    /*------------*/
+    /* Superblock */
+    /*------------*/
+    int num_inodes = 0;
+    for(int i = 0; i < max_num_inodes; i++)
+    {
+        num_inodes = num_inodes + st->reachable[i];
+    }
+    fs->superblockCACHE->num_inodes = num_inodes;
+    fs->superblockCACHE->dir_num_elements = dir_num_elements;
+    fs->superblock_dirty = 1;
+
+    // Every repair reaches the disk here
+    sfs_unmount(fs);
+    return remaining;
+}
+
+int sfs_fsck(const char * path, int repair, int num_threads, fsck_report * report)
+{
+    memset(report, 0, sizeof(fsck_report));
+    if(num_threads < 1)
+    {
+        num_threads = 1;
+    }
+    else if(num_threads > FSCK_MAX_THREADS)
+    {
+        num_threads = FSCK_MAX_THREADS;
+    }
+
+    /*----------------*/
+    /* Read the image */
+    /*----------------*/
+    disk_t * disk = disk_open((char *) path, BLOCK_SIZE, NUM_BLOCKS, 0);
+    if(disk == NULL)
+    {
+        return -1;
+    }
+    fsck_state * st = (fsck_state *) calloc(1, sizeof(fsck_state));
+    st->num_threads = num_threads;
+    st->image = (char *) malloc(NUM_BLOCKS * BLOCK_SIZE);
+    int r = disk_read_blocks(disk, 0, NUM_BLOCKS, st->image);
+    disk_close(disk);
+
+    st->sb = (super_block *) st->image;
+    if(r < 0 || st->sb->magic != (int) 0xACBD0005 || st->sb->block_size != BLOCK_SIZE ||
+       st->sb->file_sys_len != NUM_BLOCKS || st->sb->i_node_len != sizeof(i_node) ||
+       st->sb->i_rootdir < 0 || st->sb->i_rootdir >= max_num_inodes)
+    {
+        printf("%s does not hold a file system\n", path);
+        free(st->image);
+        free(st);
+        return -1;
+    }
+
+    /*-----------*/
+    /* Checksums */
+    /*-----------*/
+    super_block sb = *st->sb;
+    sb.checksum = 0;
+    if(crc32c(0, &sb, sizeof(super_block)) != st->sb->checksum)
+    {
+        // Rewritten with the counts of the superblock
+        printf("Checksum mismatch on block %d\n", super_block_starting_ind);
+        report->superblock_errors++;
+    }
+
+    // A checksum block that does not check itself verifies none of its blocks
+    st->checksums = (unsigned int *) calloc(NUM_BLOCKS, sizeof(unsigned int));
+    for(int j = 0; j < num_checksum_blcks; j++)
+    {
+        char * checksum_block = st->image + (checksum_starting_ind + j)*BLOCK_SIZE;
+        unsigned int * entries = (unsigned int *) checksum_block;
+        if(!is_zero_buffer(checksum_block, BLOCK_SIZE) &&
+           entries[checksum_per_block] != crc32c(0, checksum_block, checksum_per_block * sizeof(unsigned int)))
+        {
+            printf("Checksum mismatch on block %d\n", checksum_starting_ind + j);
+            report->checksum_errors++;
+            continue;
+        }
+        for(int i = 0; i < checksum_per_block && j*checksum_per_block + i < NUM_BLOCKS; i++)
+        {
+            st->checksums[j*checksum_per_block + i] = entries[i];
+        }
+    }
+    fsck_run_pass(st, NUM_BLOCKS, fsck_checksum_pass, report);
+
+    /*-------------------------*/
+    /* I nodes and directories */
+    /*-------------------------*/
+    // A block of the i node table mapped outside the data blocks is read at its place in the table
+    for(int j = 0; j < num_inodes_blcks; j++)
+    {
+        int location = st->sb->inode_map[j];
+        if(location != 0 && (location < data_starting_ind || location >= data_starting_ind + num_data_blcks))
+        {
+            printf("Block %d of the i node table is mapped to block %d\n", j, location);
+            st->sb->inode_map[j] = 0;
+            report->superblock_errors++;
+        }
+    }
+    fsck_run_pass(st, max_num_inodes, fsck_inode_pass, report);
+
+    // Without a root directory every file is lost, an empty one takes its place
+    i_node * root = &st->inodes[st->sb->i_rootdir];
+    if(!root->valid || !(root->flags & INODE_DIR))
+    {
+        free(st->indirect[st->sb->i_rootdir]);
+        st->indirect[st->sb->i_rootdir] = NULL;
+        memset(root, 0, sizeof(i_node));
+        root->valid = 1;
+        root->flags = INODE_DIR;
+        for(int j = 0; j < num_directptr; j++)
+        {
+            root->directptr[j] = -1;
+        }
+        root->indirectptr = -1;
+        st->inode_bad[st->sb->i_rootdir] = 1;
+        report->bad_inodes++;
+    }
+
+    fsck_find_reachable(st, report);
+
+    /*----------------------------------*/
+    /* Free bitmap and reference counts */
+    /*----------------------------------*/
+    for(int t = 0; t < num_threads; t++)
+    {
+        st->uses[t] = (unsigned short *) calloc(num_data_blcks, sizeof(unsigned short));
+        st->metadata_uses[t] = (unsigned char *) calloc(num_data_blcks, 1);
+    }
+    fsck_run_pass(st, max_num_inodes, fsck_block_use_pass, report);
+    // Blocks of the i node table written to the log are metadata blocks too
+    for(int j = 0; j < num_inodes_blcks; j++)
+    {
+        if(st->sb->inode_map[j] != 0)
+        {
+            st->uses[0][st->sb->inode_map[j] - data_starting_ind]++;
+            st->metadata_uses[0][st->sb->inode_map[j] - data_starting_ind] = 1;
+        }
+    }
+
+    st->freebitmap = (unsigned char *) malloc(BLOCK_SIZE);
+    st->refcounts = (unsigned char *) calloc(1, BLOCK_SIZE);
+    fsck_run_pass(st, num_data_blcks, fsck_bitmap_pass, report);
+
+    // Blocks outside the data blocks are always in use, but the i node table blocks never written
+    unsigned char * freebitmap_disk = (unsigned char *) st->image + (NUM_BLOCKS - 1)*BLOCK_SIZE;
+    for(int block = 0; block < NUM_BLOCKS; block++)
+    {
+        if(block >= data_starting_ind && block < data_starting_ind + num_data_blcks)
+        {
+            continue;
+        }
+        int inodetable_blockIndex = block - i_node_starting_ind;
+        if(inodetable_blockIndex >= 0 && inodetable_blockIndex < num_inodes_blcks)
+        {
+            st->freebitmap[block] = st->sb->inode_block_init & (1u << inodetable_blockIndex) ? '0' : '1';
+        }
+        else
+        {
+            st->freebitmap[block] = '0';
+        }
+        if(freebitmap_disk[block] != st->freebitmap[block])
+        {
+            report->bitmap_errors++;
+        }
+    }
+
+    /*-------------------*/
+    /* Superblock counts */
+    /*-------------------*/
+    int num_inodes = 0;
+    int dir_num_elements = 0;
+    for(int i = 0; i < max_num_inodes; i++)
+    {
+        num_inodes = num_inodes + st->reachable[i];
+        for(int k = 0; st->reachable[i] && k < st->num_entries[i]; k++)
+        {
+            dir_num_elements = dir_num_elements + (st->entries[i][k].i_node != -1);
+        }
+    }
+    int num_free_blocks = 0;
+    for(int datablock = 0; datablock < num_data_blcks; datablock++)
+    {
+        num_free_blocks = num_free_blocks + (st->freebitmap[data_starting_ind + datablock] == '1');
+    }
+    report->superblock_errors += (st->sb->num_inodes != num_inodes) + (st->sb->dir_num_elements != dir_num_elements) +
+                                 (st->sb->num_free_blocks != num_free_blocks);
+
+    /*--------*/
+    /* Repair */
+    /*--------*/
+    int found = report->bad_inodes + report->orphan_inodes + report->bad_entries + report->bitmap_errors +
+                report->refcount_errors + report->superblock_errors;
+    int remaining = report->cross_linked_blocks + report->checksum_errors;
+    if(!repair)
+    {
+        remaining = remaining + found;
+    }
+    else if(found > 0)
+    {
+        int left = fsck_repair(st, path);
+        remaining = left < 0 ? -1 : remaining + left;
+    }
+
+    for(int i = 0; i < max_num_inodes; i++)
+    {
+        free(st->indirect[i]);
+        free(st->dirnodes[i]);
+        free(st->entries[i]);
+    }
+    for(int t = 0; t < num_threads; t++)
+    {
+        free(st->uses[t]);
+        free(st->metadata_uses[t]);
+    }
+    free(st->freebitmap);
+    free(st->refcounts);
+    free(st->checksums);
+    free(st->image);
+    free(st);
+
+    if(remaining < 0)
+    {
+        return -1;
+    }
+    return remaining > 0 ? 1 : 0;
+}
+
+/*---------------*/
+/* IMAGE BUILDER */
+/*---------------*/
+// The host tree is scanned and sized before the image is created. Directories and i nodes
+// are made on a file system mounted in write back mode, so each metadata block reaches the
+// disk once, when it is unmounted. File content takes the first data blocks in the order
+// of the paths, it is read by several threads into a copy of these blocks and written with
+// a single request.
+
+// A file or directory of the host tree
+typedef struct BUILD_ENTRY
+{
+    // Path in the file system, as resolve_path takes it
+    char * path;
+    char * hostpath;
+    int is_dir;
+    int size;
+    int inodeIndex;
+    // Where the content is read to, inline data of the i node or data blocks
+    char * content;
+    // First DATA block of the content and number of blocks, the indirect pointer block follows them
+    int firstblock;
+    int nblocks;
+} build_entry;
+
+// Everything the threads reading the files share
+typedef struct BUILD_STATE
+{
+    build_entry * entries;
+    int num_entries;
+    int max_entries;
+    // Next entry a thread reads
+    int next_entry;
+    // Content of the data blocks from first_datablock on and their checksum
+    char * data;
+    unsigned int * checksums;
+    int first_datablock;
+    int failed;
+} build_state;
+
+// More threads than this don't read a tree of at most 255 files any faster
+#define BUILD_MAX_THREADS 64
+
+int compare_build_entry(const void * a, const void * b)
+{
+    return strcmp(((const build_entry *) a)->path, ((const build_entry *) b)->path);
+}
+
+/* Add the files and directories under a host directory to the entries */
+// Return 0 on success, -1 if the tree can't be read or does not fit the file system
+int build_scan(build_state * st, const char * hostdir, const char * path)
+{
+    DIR * dir = opendir(hostdir);
+    if(dir == NULL)
+    {
+        printf("Could not open %s\n", hostdir);
+        return -1;
+    }
+
+    int r = 0;
+    struct dirent * d;
+    while(r == 0 && (d = readdir(dir)) != NULL)
+    {
+        if(strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+        {
+            continue;
+        }
+        if(strlen(d->d_name) > MAX_FILENAME_LEN)
+        {
+            printf("File name too long: %s/%s\n", hostdir, d->d_name);
+            r = -1;
+            break;
+        }
+        // The root directory has its own i node
+        if(st->num_entries == max_num_inodes - 1)
+        {
+            printf("Too many files for the file system, at most %d\n", max_num_inodes - 1);
+            r = -1;
+            break;
+        }
+
+        build_entry e;
+        memset(&e, 0, sizeof(build_entry));
+        e.hostpath = (char *) malloc(strlen(hostdir) + strlen(d->d_name) + 2);
+        sprintf(e.hostpath, "%s/%s", hostdir, d->d_name);
+        e.path = (char *) malloc(strlen(path) + strlen(d->d_name) + 2);
+        sprintf(e.path, "%s/%s", path, d->d_name);
+
+        struct stat sb;
+        if(lstat(e.hostpath, &sb) != 0 || !(S_ISDIR(sb.st_mode) || S_ISREG(sb.st_mode)))
+        {
+            // Links, devices and sockets have nothing to pack
+            printf("Skipping %s, not a file or a directory\n", e.hostpath);
+            free(e.hostpath);
+            free(e.path);
+            continue;
+        }
+        if(S_ISREG(sb.st_mode) && sb.st_size > max_file_size)
+        {
+            printf("%s is larger than the max file size %d\n", e.hostpath, max_file_size);
+            free(e.hostpath);
+            free(e.path);
+            r = -1;
+            break;
+        }
+        e.is_dir = S_ISDIR(sb.st_mode);
+        e.size = e.is_dir ? 0 : (int) sb.st_size;
+
+        if(st->num_entries == st->max_entries)
+        {
+            st->max_entries = st->max_entries == 0 ? 64 : st->max_entries * 2;
+            st->entries = (build_entry *) realloc(st->entries, st->max_entries * sizeof(build_entry));
+        }
+        st->entries[st->num_entries++] = e;
+
+        if(e.is_dir)
+        {
+            r = build_scan(st, e.hostpath, e.path);
+        }
+    }
+
+    closedir(dir);
+    return r;
+}
+
+/* Thread reading files into their content, until no entry is left */
+void * build_read_files(void * arg)
+{
+    build_state * st = (build_state *) arg;
+
+    int i;
+    while((i = __sync_fetch_and_add(&st->next_entry, 1)) < st->num_entries)
+    {
+        build_entry * e = &st->entries[i];
+        if(e->is_dir || e->size == 0)
+        {
+            continue;
+        }
+
+        int done = 0;
+        int fd = open(e->hostpath, O_RDONLY);
+        while(fd >= 0 && done < e->size)
+        {
+            ssize_t r = pread(fd, e->content + done, e->size - done, done);
+            if(r < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(r <= 0)
+            {
+                break;
+            }
+            done = done + r;
+        }
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        if(done < e->size)
+        {
+            // The file can't be read or it shrank since the tree was scanned
+            printf("Could not read %s\n", e->hostpath);
+            __sync_fetch_and_add(&st->failed, 1);
+            continue;
+        }
+
+        for(int b = 0; b < e->nblocks; b++)
+        {
+            st->checksums[e->firstblock - st->first_datablock + b] = block_checksum(e->content + b*BLOCK_SIZE);
+        }
+    }
+
+    return NULL;
+}
+
+/* Make the entries on a new file system, then read and write the content of the files */
+// Return 0 on success, -1 on failure
+int build_files(sfs_t * fs, build_state * st, int needed, int num_threads)
+{
+    // The content takes the first data blocks, directories are given the blocks after it
+    st->first_datablock = 0;
+    if(needed > 0)
+    {
+        take_data_run(fs, st->first_datablock, needed);
+    }
+
+    /*----------------------------*/
+    /* Make directories and files */
+    /*----------------------------*/
+    for(int i = 0; i < st->num_entries; i++)
+    {
+        build_entry * e = &st->entries[i];
+        int dirInodeIndex;
+        char name[MAX_FILENAME_LEN + 1];
+        resolve_path(fs, e->path, &dirInodeIndex, name);
+
+        int flags = e->is_dir ? INODE_DIR : (e->nblocks == 0 ? INODE_INLINE : 0);
+        e->inodeIndex = sfs_fcreate(fs, dirInodeIndex, name, flags);
+        if(e->inodeIndex == -1)
+        {
+            return -1;
+        }
+    }
+
+    /*--------------------------*/
+    /* Lay out the file content */
+    /*--------------------------*/
+    // In the order of the paths, the blocks of each file follow each other
+    st->data = (char *) calloc(needed > 0 ? needed : 1, BLOCK_SIZE);
+    st->checksums = (unsigned int *) calloc(needed > 0 ? needed : 1, sizeof(unsigned int));
+    int datablock = st->first_datablock;
+    for(int i = 0; i < st->num_entries; i++)
+    {
+        build_entry * e = &st->entries[i];
+        if(e->is_dir)
+        {
+            continue;
+        }
+
+        i_node * in = get_inode(fs, e->inodeIndex);
+        in->size = e->size;
+        if(e->nblocks == 0)
+        {
+            e->content = in->inline_data;
+            continue;
+        }
+
+        e->firstblock = datablock;
+        e->content = st->data + (datablock - st->first_datablock) * BLOCK_SIZE;
+        for(int b = 0; b < e->nblocks && b < num_directptr; b++)
+        {
+            in->directptr[b] = datablock + b;
+        }
+        datablock = datablock + e->nblocks;
+
+        if(e->nblocks > num_directptr)
+        {
+            char * indirectptr_block = st->data + (datablock - st->first_datablock) * BLOCK_SIZE;
+            in->indirectptr = datablock;
+            in->num_indirectptr = e->nblocks - num_directptr;
+            for(int j = 0; j < indirectptr_per_block; j++)
+            {
+                ((indirect_ptr *) (indirectptr_block + j * sizeof(indirect_ptr)))->datablockindex =
+                    j < in->num_indirectptr ? e->firstblock + num_directptr + j : -1;
+            }
+            st->checksums[datablock - st->first_datablock] = block_checksum(indirectptr_block);
+            datablock++;
+        }
+    }
+
+    /*----------------------------*/
+    /* Read the files in parallel */
+    /*----------------------------*/
+    pthread_t threads[BUILD_MAX_THREADS];
+    int started[BUILD_MAX_THREADS];
+    for(int t = 0; t < num_threads; t++)
+    {
+        started[t] = pthread_create(&threads[t], NULL, build_read_files, st) == 0;
+    }
+    // The calling thread reads too, whatever is left if no thread could be started
+    build_read_files(st);
+    for(int t = 0; t < num_threads; t++)
+    {
+        if(started[t])
+        {
+            pthread_join(threads[t], NULL);
+        }
+    }
+    if(st->failed)
+    {
+        return -1;
+    }
+
+    /*---------------------------*/
+    /* Write the content at once */
+    /*---------------------------*/
+    if(needed > 0)
+    {
+        if(disk_write_blocks(fs->disk, data_starting_ind + st->first_datablock, needed, st->data) < 0)
+        {
+            return -1;
+        }
+        fs->unsynced_writes = 1;
+        for(int b = 0; b < needed; b++)
+        {
+            int block = data_starting_ind + st->first_datablock + b;
+            fs->checksumCACHE[block] = st->checksums[b];
+            fs->checksum_block_dirty[block/checksum_per_block] = 1;
+        }
+    }
+    // Each block of the i node table holding a file is saved once
+    int saved[NUM_INODE_BLOCKS] = {0};
+    for(int i = 0; i < st->num_entries; i++)
+    {
+        int j = st->entries[i].inodeIndex/inode_per_block;
+        if(!st->entries[i].is_dir && !saved[j])
+        {
+            save_inodetableCACHE_to_DISK(fs, j);
+            saved[j] = 1;
+        }
+    }
+
+    return 0;
+}
+
+int sfs_mkimage(const char * path, const char * hostdir, int num_threads)
+{
+    if(num_threads < 1)
+    {
+        num_threads = 1;
+    }
+    else if(num_threads > BUILD_MAX_THREADS)
+    {
+        num_threads = BUILD_MAX_THREADS;
+    }
+
+    /*--------------------*/
+    /* Scan the host tree */
+    /*--------------------*/
+    build_state * st = (build_state *) calloc(1, sizeof(build_state));
+    int r = build_scan(st, hostdir, "");
+    // Parents sort before what they hold, a directory exists before its entries are made
+    if(st->num_entries > 0)
+    {
+        qsort(st->entries, st->num_entries, sizeof(build_entry), compare_build_entry);
+    }
+
+    // Files up to the inline data length keep their content in the i node
+    int needed = 0;
+    for(int i = 0; i < st->num_entries; i++)
+    {
+        build_entry * e = &st->entries[i];
+        if(!e->is_dir && e->size > INLINE_DATA_LEN)
+        {
+            e->nblocks = (e->size + BLOCK_SIZE - 1)/BLOCK_SIZE;
+            needed = needed + e->nblocks + (e->nblocks > num_directptr ? 1 : 0);
+        }
+    }
+    if(r == 0 && needed > num_data_blcks)
+    {
+        printf("%s needs %d data blocks, the file system has %d\n", hostdir, needed, num_data_blcks);
+        r = -1;
+    }
+
+    /*-----------------*/
+    /* Build the image */
+    /*-----------------*/
+    // Metadata stays in the write back cache until the file system is unmounted
+    if(r == 0)
+    {
+        sfs_t * fs = sfs_mount(path, 1, SFS_DURABILITY_WRITEBACK);
+        r = fs != NULL ? build_files(fs, st, needed, num_threads) : -1;
+        if(fs != NULL)
+        {
+            // Every metadata block reaches the disk here
+            sfs_unmount(fs);
+        }
+    }
+
+    if(r == 0)
+    {
+        r = st->num_entries;
+    }
+    for(int i = 0; i < st->num_entries; i++)
+    {
+        free(st->entries[i].path);
+        free(st->entries[i].hostpath);
+    }
+    free(st->entries);
+    free(st->data);
+    free(st->checksums);
+    free(st);
+    return r;
+}
+
+/*--------------------------------*/
+/* Calls on a mounted file system */
+/*--------------------------------*/
+// Every call holds the lock of its file system, reads of file content share it
+// Calls on different file systems run in parallel
+
+/* File system of a call, the one of mksfs if none is given */
+sfs_t * instance(sfs_t * fs)
+{
+    return fs != NULL ? fs : default_fs;
+}
+
+int sfs_getnextfilename_r(sfs_t * fs, char* fname)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_getnextfilename(fs, fname);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_getfilesize_r(sfs_t * fs, const char* path)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_getfilesize(fs, path);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_fopen_r(sfs_t * fs, char* name)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_fopen(fs, name);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_fclose_r(sfs_t * fs, int fileID)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_fclose(fs, fileID);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_fwrite_r(sfs_t * fs, int fileID, const char* buf, int length)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_fwrite(fs, fileID, buf, length);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_fread_r(sfs_t * fs, int fileID, char* buf, int length)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_fread(fs, fileID, buf, length);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_pwrite_r(sfs_t * fs, int fileID, const char* buf, int length, int offset)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_pwrite(fs, fileID, buf, length, offset);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_pread_r(sfs_t * fs, int fileID, char* buf, int length, int offset)
+{
+    fs = instance(fs);
+    pthread_rwlock_rdlock(&fs->lock);
+    int r = fs_pread(fs, fileID, buf, length, offset);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_readv_r(sfs_t * fs, int fileID, const sfs_iovec * iov, int iovcnt)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_readv(fs, fileID, iov, iovcnt);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_writev_r(sfs_t * fs, int fileID, const sfs_iovec * iov, int iovcnt)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_writev(fs, fileID, iov, iovcnt);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_fseek_r(sfs_t * fs, int fileID, int loc)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_fseek(fs, fileID, loc);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_lseek_r(sfs_t * fs, int fileID, int loc, int whence)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_lseek(fs, fileID, loc, whence);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_remove_r(sfs_t * fs, char* file)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_remove(fs, file);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_clone_r(sfs_t * fs, char* src, char* dst)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_clone(fs, src, dst);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_copy_range_r(sfs_t * fs, int srcID, int srcoffset, int dstID, int dstoffset, int length)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_copy_range(fs, srcID, srcoffset, dstID, dstoffset, length);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_sendfile_r(sfs_t * fs, int out_fd, int fileID, int offset, int count)
+{
+    fs = instance(fs);
+    pthread_rwlock_rdlock(&fs->lock);
+    int r = fs_sendfile(fs, out_fd, fileID, offset, count);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_mkdir_r(sfs_t * fs, char* path)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_mkdir(fs, path);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_rmdir_r(sfs_t * fs, char* path)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_rmdir(fs, path);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+void sfs_setdiscard_r(sfs_t * fs, int online)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    fs_setdiscard(fs, online);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+}
+
+void sfs_setcompression_r(sfs_t * fs, int enabled)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    fs_setcompression(fs, enabled);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+}
+
+void sfs_setdedup_r(sfs_t * fs, int enabled)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    fs_setdedup(fs, enabled);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+}
+
+void sfs_getchecksumstats_r(sfs_t * fs, checksum_stats * stats)
+{
+    fs = instance(fs);
+    pthread_rwlock_rdlock(&fs->lock);
+    fs_getchecksumstats(fs, stats);
+    pthread_rwlock_unlock(&fs->lock);
+}
+
+void sfs_statfs_r(sfs_t * fs, fs_stats * stats)
+{
+    fs = instance(fs);
+    pthread_rwlock_rdlock(&fs->lock);
+    fs_statfs(fs, stats);
+    pthread_rwlock_unlock(&fs->lock);
+}
+
+int sfs_trim_r(sfs_t * fs)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_trim(fs);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_getextents_r(sfs_t * fs, const char* path)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_getextents(fs, path);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_defrag_r(sfs_t * fs, int budget)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_defrag(fs, budget);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_fallocate_r(sfs_t * fs, int fileID, int offset, int length)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_fallocate(fs, fileID, offset, length);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_ftruncate_r(sfs_t * fs, int fileID, int size)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_ftruncate(fs, fileID, size);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+void sfs_setlogstructured_r(sfs_t * fs, int enabled)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    fs_setlogstructured(fs, enabled);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+}
+
+int sfs_clean_r(sfs_t * fs, int budget)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_clean(fs, budget);
+    finish_call(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_fsync_r(sfs_t * fs, int fileID)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_fsync(fs, fileID);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+int sfs_sync_r(sfs_t * fs)
+{
+    fs = instance(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int r = fs_sync(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    return r;
+}
+
+
+/*-----------------------------------*/
+/* Calls on the file system of mksfs */
+/*-----------------------------------*/
+void mksfs(int fresh)
+{
+    if(default_fs != NULL)
+    {
+        sfs_unmount(default_fs);
+    }
+    default_fs = sfs_mount("sfs_file", fresh, SFS_DURABILITY_SYNC);
+}
+
+int sfs_getnextfilename(char* fname)
+{
+    return sfs_getnextfilename_r(NULL, fname);
+}
+
+int sfs_getfilesize(const char* path)
+{
+    return sfs_getfilesize_r(NULL, path);
+}
+
+int sfs_fopen(char* name)
+{
+    return sfs_fopen_r(NULL, name);
+}
+
+int sfs_fclose(int fileID)
+{
+    return sfs_fclose_r(NULL, fileID);
+}
+
+int sfs_fwrite(int fileID, const char* buf, int length)
+{
+    return sfs_fwrite_r(NULL, fileID, buf, length);
+}
+
+int sfs_fread(int fileID, char* buf, int length)
+{
+    return sfs_fread_r(NULL, fileID, buf, length);
+}
+
+int sfs_pwrite(int fileID, const char* buf, int length, int offset)
+{
+    return sfs_pwrite_r(NULL, fileID, buf, length, offset);
+}
+
+int sfs_pread(int fileID, char* buf, int length, int offset)
+{
+    return sfs_pread_r(NULL, fileID, buf, length, offset);
+}
+
+int sfs_readv(int fileID, const sfs_iovec * iov, int iovcnt)
+{
+    return sfs_readv_r(NULL, fileID, iov, iovcnt);
+}
+
+int sfs_writev(int fileID, const sfs_iovec * iov, int iovcnt)
+{
+    return sfs_writev_r(NULL, fileID, iov, iovcnt);
+}
+
+int sfs_fseek(int fileID, int loc)
+{
+    return sfs_fseek_r(NULL, fileID, loc);
+}
+
+int sfs_lseek(int fileID, int loc, int whence)
+{
+    return sfs_lseek_r(NULL, fileID, loc, whence);
+}
+
+int sfs_remove(char* file)
+{
+    return sfs_remove_r(NULL, file);
+}
+
+int sfs_clone(char* src, char* dst)
+{
+    return sfs_clone_r(NULL, src, dst);
+}
+
+int sfs_copy_range(int srcID, int srcoffset, int dstID, int dstoffset, int length)
+{
+    return sfs_copy_range_r(NULL, srcID, srcoffset, dstID, dstoffset, length);
+}
+
+int sfs_sendfile(int out_fd, int fileID, int offset, int count)
+{
+    return sfs_sendfile_r(NULL, out_fd, fileID, offset, count);
+}
+
+int sfs_mkdir(char* path)
+{
+    return sfs_mkdir_r(NULL, path);
+}
+
+int sfs_rmdir(char* path)
+{
+    return sfs_rmdir_r(NULL, path);
+}
+
+void sfs_setdiscard(int online)
+{
+    sfs_setdiscard_r(NULL, online);
+}
+
+void sfs_setcompression(int enabled)
+{
+    sfs_setcompression_r(NULL, enabled);
+}
+
+void sfs_setdedup(int enabled)
+{
+    sfs_setdedup_r(NULL, enabled);
+}
+
+void sfs_getchecksumstats(checksum_stats * stats)
+{
+    sfs_getchecksumstats_r(NULL, stats);
+}
+
+void sfs_statfs(fs_stats * stats)
+{
+    sfs_statfs_r(NULL, stats);
+}
+
+int sfs_trim()
+{
+    return sfs_trim_r(NULL);
+}
+
+int sfs_getextents(const char* path)
+{
+    return sfs_getextents_r(NULL, path);
+}
+
+int sfs_defrag(int budget)
+{
+    return sfs_defrag_r(NULL, budget);
+}
+
+int sfs_fallocate(int fileID, int offset, int length)
+{
+    return sfs_fallocate_r(NULL, fileID, offset, length);
+}
+
+int sfs_ftruncate(int fileID, int size)
+{
+    return sfs_ftruncate_r(NULL, fileID, size);
+}
+
+void sfs_setlogstructured(int enabled)
+{
+    sfs_setlogstructured_r(NULL, enabled);
+}
+
+int sfs_clean(int budget)
+{
+    return sfs_clean_r(NULL, budget);
+}
+
+int sfs_fsync(int fileID)
+{
+    return sfs_fsync_r(NULL, fileID);
+}
+
+int sfs_sync()
+{
+    return sfs_sync_r(NULL);
+}
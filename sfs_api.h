@@ -2,10 +2,32 @@
 #define SFS_API_H
 
 // You can add more into this file.
-#define MAX_FILENAME_LEN 20
+#define MAX_FILENAME_LEN 255
 #define BLOCK_SIZE 1024
 #define NUM_BLOCKS 1024
 #define MAX_OPEN_FILE 100
+// Files up to this size are stored in their i node
+#define INLINE_DATA_LEN 60
+
+// Compressed files are stored in clusters of this many blocks
+#define CLUSTER_BLOCKS 4
+
+// Flags of an i node
+#define INODE_INLINE 0x1
+#define INODE_COMPRESSED 0x2
+#define INODE_DIR 0x4
+
+// Block pointer of a compressed file, the block is part of a compressed cluster
+// whose data is held in the blocks before it in the cluster
+#define COMPRESSED_BLOCK -2
+
+// Values of whence for sfs_lseek
+#define SFS_SEEK_SET 0
+#define SFS_SEEK_DATA 3
+#define SFS_SEEK_HOLE 4
+
+// Returned by sfs_defrag when files are left fragmented that no free space is left to improve
+#define SFS_DEFRAG_STUCK -1
 
 typedef struct SUPER_BLOCK
 {
@@ -15,27 +37,83 @@ typedef struct SUPER_BLOCK
     int i_node_len;
     int i_rootdir;
     int num_inodes;
+    // Number of entries in all the directories
     int dir_num_elements;
+    // Bit i is set once block i of the i node table has been written to disk
+    // Blocks with their bit cleared were never initialized and are set up lazily on first use
+    unsigned int inode_block_init;
+    // DISK block holding each block of the i node table, 0 while the block is at its place in the table
+    // Blocks of the table written in log-structured mode move to the data blocks, see sfs_setlogstructured
+    int inode_map[32];
+    // Number of free data blocks, kept in step with the free bitmap
+    // Written once per call along with the rest of the superblock, and counted again from the bitmap at mount
+    int num_free_blocks;
+    // CRC32C of this structure, computed with this field at 0
+    unsigned int checksum;
 } super_block;
 
 typedef struct I_NODE
 {
-    // Total size of i node is 64 bytes => there are 1024/64 = 16 i nodes per block
+    // Total size of i node is 128 bytes => there are 1024/128 = 8 i nodes per block
     int valid;  // If the i node is valid (1), not available to override 
     int num_indirectptr;
     int size;
     int directptr[12];
     int indirectptr;
+    int flags;
+    // Content of the file while it has the INODE_INLINE flag, bytes past the size are 0
+    // The file does not use any data block in this case
+    char inline_data[INLINE_DATA_LEN];
 } i_node;
 
 typedef struct DIRECTORY_ENTRY
 {
-    // Total size of directory entry is 28 bytes
-    char filename[MAX_FILENAME_LEN];
-    int valid;
+    // Hash of the name, the key of the entry in the directory B+tree
+    unsigned int hash;
     int i_node;
+    int name_len;
+    char filename[MAX_FILENAME_LEN + 1];
 } dir_entry;
 
+// On disk, a directory entry is packed in a leaf as its hash (4 bytes), i node (4 bytes),
+// name length (1 byte) and name (without the terminating 0)
+#define DIR_ENTRY_HEADER_LEN 9
+
+// Keys held by an internal node of a directory B+tree
+#define DIR_NODE_KEYS 126
+
+typedef struct DIRECTORY_NODE
+{
+    // A directory is a B+tree of nodes of one block each, keyed by the hash of the entry names
+    // Its i node has the INODE_DIR flag, the first direct pointer is the root node (-1 if empty)
+    // and the size is the number of entries
+    int leaf;
+    int num_keys;
+    // Next leaf in hash order, -1 for the last one
+    int next;
+    union
+    {
+        // Leaf, packed entries sorted by hash
+        char entries[BLOCK_SIZE - 3 * sizeof(int)];
+        // Internal node, child i holds the hashes between keys[i - 1] and keys[i] included
+        struct
+        {
+            unsigned int keys[DIR_NODE_KEYS];
+            int children[DIR_NODE_KEYS + 1];
+        } index;
+    } u;
+} dir_node;
+
+// Buffer of a scatter/gather read or write, see sfs_readv and sfs_writev
+typedef struct SFS_IOVEC
+{
+    void * base;
+    int len;
+} sfs_iovec;
+
+// Buffers a single sfs_readv or sfs_writev can take
+#define SFS_IOV_MAX 1024
+
 typedef struct OPEN_FILE_ENTRY
 {
     int valid;
@@ -43,6 +121,68 @@ typedef struct OPEN_FILE_ENTRY
     int iptr;
 } open_entry;
 
+typedef struct CHECKSUM_STATS
+{
+    // Blocks read that had a checksum to verify
+    int blocks_verified;
+    // Mismatches in the data blocks (file content, indirect pointer and directory blocks)
+    int data_mismatches;
+    // Mismatches in the superblock, i node table, checksum blocks and free bitmap
+    int metadata_mismatches;
+} checksum_stats;
+
+typedef struct FS_STATS
+{
+    int block_size;
+    // Data blocks, the blocks file content and directories are stored in
+    int total_blocks;
+    int free_blocks;
+    // I nodes, one per file or directory
+    int total_inodes;
+    int free_inodes;
+    int max_filename_len;
+} fs_stats;
+
+typedef struct FSCK_REPORT
+{
+    // I nodes with block pointers, sizes or directory trees that had to be fixed
+    int bad_inodes;
+    // Valid i nodes no directory entry leads to (crash while creating a file), freed
+    int orphan_inodes;
+    // Directory entries to a free i node (crash while removing a file), to an i node already
+    // in a directory or with the name of another entry, removed
+    int bad_entries;
+    // Blocks whose bit in the free bitmap disagrees with their use
+    int bitmap_errors;
+    // Data blocks whose reference count disagrees with the number of files sharing them
+    int refcount_errors;
+    // Counts of the superblock that disagree with the file system, or a bad superblock checksum
+    int superblock_errors;
+    // Blocks used as metadata by one file and by another file too, reported only
+    int cross_linked_blocks;
+    // Blocks that don't match their checksum, reported only: their content can't be restored
+    int checksum_errors;
+} fsck_report;
+
+// A mounted file system, see sfs_mount
+typedef struct SFS_INSTANCE sfs_t;
+
+// Durability modes of a mount
+// Synchronous: every call changing the file system is on stable storage when it returns (mksfs)
+#define SFS_DURABILITY_SYNC 0
+// Ordered: file content is written at once, metadata is kept in memory until sfs_fsync or sfs_sync
+// and only reaches the disk once the content it points to is on stable storage
+// Content overwritten in place since the last sync may fail its checksum after a crash
+#define SFS_DURABILITY_ORDERED 1
+// Write back: every block is kept in memory until sfs_fsync or sfs_sync, in no particular order
+#define SFS_DURABILITY_WRITEBACK 2
+
+// Write policies of a tiered mount, see sfs_mount_tiered
+// Write through: every block written reaches the slow image, the fast one only speeds up reads
+#define SFS_TIER_WRITETHROUGH 0
+// Write back: blocks held by the fast image are only written there until they leave it or the disk is synced
+#define SFS_TIER_WRITEBACK 1
+
 typedef struct INDIRECT_PTR_ENTRY
 {
     int datablockindex;
@@ -63,8 +203,168 @@ int sfs_fwrite(int, const char*, int);
 
 int sfs_fread(int, char*, int);
 
+int sfs_pwrite(int, const char*, int, int);
+
+int sfs_pread(int, char*, int, int);
+
+// Read into or write from several buffers at the file ptr, in a single pass over the file
+// The buffers are filled or written one after the other, as if they were a single one
+// Return the number of bytes read or written, -1 if the buffers are not valid
+int sfs_readv(int, const sfs_iovec *, int);
+
+int sfs_writev(int, const sfs_iovec *, int);
+
 int sfs_fseek(int, int);
 
+int sfs_lseek(int, int, int);
+
 int sfs_remove(char*);
 
+int sfs_clone(char*, char*);
+
+// Copy bytes of a file to another open file (or to another range of the same one), as sfs_pread then sfs_pwrite would
+// Whole blocks are shared by both files instead of being copied, the first one written to gets its own copy
+// Take as argument the source file and offset, the destination file and offset, then the number of bytes
+// The file ptrs are left where they are
+// Return the number of bytes copied, -1 if an offset is negative or the ranges overlap in the same file
+int sfs_copy_range(int, int, int, int, int);
+
+// Send bytes of a file from an offset to a host file descriptor (file, pipe or socket)
+// Blocks following each other on the disk are read with a single request and sent once they are
+// verified against their checksum, a block that doesn't match fails the call as it does sfs_pread
+// The file ptr is left where it is
+// Return the number of bytes sent, -1 if none could be sent
+int sfs_sendfile(int, int, int, int);
+
+int sfs_mkdir(char*);
+
+int sfs_rmdir(char*);
+
+void sfs_setdiscard(int);
+
+void sfs_setcompression(int);
+
+void sfs_setdedup(int);
+
+void sfs_getchecksumstats(checksum_stats *);
+
+void sfs_statfs(fs_stats *);
+
+int sfs_trim();
+
+int sfs_getextents(const char*);
+
+// Move at most budget blocks to make files follow each other on the disk and gather free space
+// Return the number of blocks moved, 0 once every file that can move is in one extent,
+// SFS_DEFRAG_STUCK if fragmented files are left but no block can move to improve them
+int sfs_defrag(int);
+
+int sfs_fallocate(int, int, int);
+
+int sfs_ftruncate(int, int);
+
+// Log-structured mode: file content, indirect pointer blocks and i node table blocks are never written
+// in place but appended to the log, filling one segment of free blocks after the other
+// New directory nodes are appended too, existing ones are updated in place as their leaves point to each other
+// A background thread cleans the segments left partly used, so the log always has free segments ahead
+void sfs_setlogstructured(int);
+
+// Move the blocks left in partly used segments of the log to its head, at most budget blocks
+// Return the number of blocks moved
+int sfs_clean(int);
+
+int sfs_fsync(int);
+
+int sfs_sync();
+
+// Check the file system of an image that is not mounted, with num_threads threads
+// Everything found is repaired if repair is set, but for cross linked blocks and checksum errors
+// Return 0 if the file system is consistent (once repaired), 1 if problems are left,
+// -1 if the image can't be read or does not hold a file system
+int sfs_fsck(const char*, int, int, fsck_report *);
+
+// Build a new file system in an image from the files and directories under a host directory
+// The tree is sized first, the image is not created if the content of its files can't fit. The files are laid
+// out in the order of their paths, the blocks of each one following each other, and read by num_threads threads.
+// Every metadata block is written once.
+// Return the number of files and directories packed, -1 on failure
+int sfs_mkimage(const char*, const char*, int);
+
+// Calls on a file system mounted with sfs_mount, a NULL file system is the one of mksfs
+// Each mounted file system is independent, calls on different ones can run in parallel
+
+sfs_t * sfs_mount(const char*, int, int);
+
+// Mount the image of the first path behind a fast image of cache_blocks blocks created at the second path
+// Metadata blocks stay on the fast image, file content is promoted to it and demoted by a background thread
+// as it gets hot or cold. The fast image starts empty at each mount, the image holds everything once unmounted.
+// Take as argument the paths, cache_blocks, the tier write policy, then fresh and the durability mode of sfs_mount
+sfs_t * sfs_mount_tiered(const char*, const char*, int, int, int, int);
+
+void sfs_unmount(sfs_t*);
+
+int sfs_getnextfilename_r(sfs_t*, char*);
+
+int sfs_getfilesize_r(sfs_t*, const char*);
+
+int sfs_fopen_r(sfs_t*, char*);
+
+int sfs_fclose_r(sfs_t*, int);
+
+int sfs_fwrite_r(sfs_t*, int, const char*, int);
+
+int sfs_fread_r(sfs_t*, int, char*, int);
+
+int sfs_pwrite_r(sfs_t*, int, const char*, int, int);
+
+int sfs_pread_r(sfs_t*, int, char*, int, int);
+
+int sfs_readv_r(sfs_t*, int, const sfs_iovec *, int);
+
+int sfs_writev_r(sfs_t*, int, const sfs_iovec *, int);
+
+int sfs_fseek_r(sfs_t*, int, int);
+
+int sfs_lseek_r(sfs_t*, int, int, int);
+
+int sfs_remove_r(sfs_t*, char*);
+
+int sfs_clone_r(sfs_t*, char*, char*);
+
+int sfs_copy_range_r(sfs_t*, int, int, int, int, int);
+
+int sfs_sendfile_r(sfs_t*, int, int, int, int);
+
+int sfs_mkdir_r(sfs_t*, char*);
+
+int sfs_rmdir_r(sfs_t*, char*);
+
+void sfs_setdiscard_r(sfs_t*, int);
+
+void sfs_setcompression_r(sfs_t*, int);
+
+void sfs_setdedup_r(sfs_t*, int);
+
+void sfs_getchecksumstats_r(sfs_t*, checksum_stats *);
+
+void sfs_statfs_r(sfs_t*, fs_stats *);
+
+int sfs_trim_r(sfs_t*);
+
+int sfs_getextents_r(sfs_t*, const char*);
+
+int sfs_defrag_r(sfs_t*, int);
+
+int sfs_fallocate_r(sfs_t*, int, int, int);
+
+int sfs_ftruncate_r(sfs_t*, int, int);
+
+void sfs_setlogstructured_r(sfs_t*, int);
+
+int sfs_clean_r(sfs_t*, int);
+
+int sfs_fsync_r(sfs_t*, int);
+
+int sfs_sync_r(sfs_t*);
+
 #endif
@@ -0,0 +1,114 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "sfs_crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// Reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82F63B78u
+
+// Slicing by 8 tables, table[k][b] is the CRC of byte b followed by k zero bytes
+static uint32_t crc32c_table[8][256];
+static int crc32c_hw = 0;
+
+/* Build the tables and detect the crc32 instruction, before main runs */
+static void crc32c_init(void) __attribute__((constructor));
+static void crc32c_init(void)
+{
+    for(int b = 0; b < 256; b++)
+    {
+        uint32_t crc = b;
+        for(int k = 0; k < 8; k++)
+        {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][b] = crc;
+    }
+
+    for(int b = 0; b < 256; b++)
+    {
+        for(int k = 1; k < 8; k++)
+        {
+            uint32_t prev = crc32c_table[k - 1][b];
+            crc32c_table[k][b] = (prev >> 8) ^ crc32c_table[0][prev & 0xFF];
+        }
+    }
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+/* Table driven version, 8 bytes per step */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char * p, size_t len)
+{
+    while(len >= 8)
+    {
+        uint32_t lo;
+        uint32_t hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo = lo ^ crc;
+        crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^
+              crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF] ^
+              crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+        p = p + 8;
+        len = len - 8;
+    }
+
+    while(len > 0)
+    {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p) & 0xFF];
+        p++;
+        len--;
+    }
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+/* Hardware version, 8 bytes per crc32 instruction */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw_sse42(uint32_t crc, const unsigned char * p, size_t len)
+{
+    uint64_t crc64 = crc;
+    while(len >= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+        p = p + 8;
+        len = len - 8;
+    }
+
+    crc = (uint32_t) crc64;
+    while(len > 0)
+    {
+        crc = _mm_crc32_u8(crc, *p);
+        p++;
+        len--;
+    }
+
+    return crc;
+}
+#endif
+
+unsigned int crc32c(unsigned int crc, const void * buf, size_t len)
+{
+    const unsigned char * p = (const unsigned char *) buf;
+    crc = ~crc;
+
+#if defined(__x86_64__)
+    if(crc32c_hw)
+    {
+        return ~crc32c_hw_sse42(crc, p, len);
+    }
+#endif
+
+    return ~crc32c_sw(crc, p, len);
+}
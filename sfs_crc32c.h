@@ -0,0 +1,10 @@
+#ifndef SFS_CRC32C_H
+#define SFS_CRC32C_H
+
+#include <stddef.h>
+
+// CRC32C (Castagnoli) of len bytes of buf, continuing from crc (0 to start a new checksum)
+// Uses the SSE4.2 crc32 instruction when the processor has it, a table driven version otherwise
+unsigned int crc32c(unsigned int crc, const void * buf, size_t len);
+
+#endif
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+
+// Exit codes, as the ones of fsck
+#define FSCK_OK 0
+#define FSCK_REPAIRED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+void usage()
+{
+    printf("Usage: sfs_fsck [-n | -y] [-j threads] image\n");
+    printf("  -n  check only, the image is not modified (default)\n");
+    printf("  -y  repair every problem found\n");
+    printf("  -j  threads checking the image (default: one per processor)\n");
+}
+
+int main(int argc, char ** argv)
+{
+    int repair = 0;
+    int num_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    const char * path = NULL;
+
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "-n") == 0)
+        {
+            repair = 0;
+        }
+        else if(strcmp(argv[i], "-y") == 0)
+        {
+            repair = 1;
+        }
+        else if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        {
+            num_threads = atoi(argv[++i]);
+        }
+        else if(argv[i][0] != '-' && path == NULL)
+        {
+            path = argv[i];
+        }
+        else
+        {
+            usage();
+            return FSCK_ERROR;
+        }
+    }
+    if(path == NULL)
+    {
+        usage();
+        return FSCK_ERROR;
+    }
+
+    fsck_report report;
+    int r = sfs_fsck(path, repair, num_threads, &report);
+    if(r < 0)
+    {
+        return FSCK_ERROR;
+    }
+
+    printf("%s: %d bad i nodes, %d orphan i nodes, %d bad directory entries\n", path,
+           report.bad_inodes, report.orphan_inodes, report.bad_entries);
+    printf("%s: %d free bitmap errors, %d reference count errors, %d superblock errors\n", path,
+           report.bitmap_errors, report.refcount_errors, report.superblock_errors);
+    printf("%s: %d cross linked blocks, %d checksum errors\n", path,
+           report.cross_linked_blocks, report.checksum_errors);
+
+    int found = report.bad_inodes + report.orphan_inodes + report.bad_entries + report.bitmap_errors +
+                report.refcount_errors + report.superblock_errors + report.cross_linked_blocks + report.checksum_errors;
+    if(r > 0)
+    {
+        printf("%s: file system has problems left\n", path);
+        return FSCK_UNCORRECTED;
+    }
+    if(found > 0)
+    {
+        printf("%s: file system repaired\n", path);
+        return FSCK_REPAIRED;
+    }
+    printf("%s: file system is clean\n", path);
+    return FSCK_OK;
+}
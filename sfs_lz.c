@@ -0,0 +1,236 @@
+#include <string.h>
+
+#include "sfs_lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+// The hash table holds the last position of 2^12 different 4 byte sequences
+#define LZ_HASH_BITS 12
+
+/* Hash of the 4 bytes at p */
+static unsigned int lz_hash(const unsigned char * p)
+{
+    unsigned int v = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Write the extra bytes of a length that did not fit in its token field */
+// Return the new output position, -1 if past dstcap
+static int lz_write_length(unsigned char * out, int op, int dstcap, int len)
+{
+    while(len >= 255)
+    {
+        if(op >= dstcap)
+        {
+            return -1;
+        }
+        out[op++] = 255;
+        len = len - 255;
+    }
+    if(op >= dstcap)
+    {
+        return -1;
+    }
+    out[op++] = len;
+    return op;
+}
+
+/* Write a sequence of literals followed by a match */
+// A match length of 0 writes the last sequence, which only holds literals
+// Return the new output position, -1 if past dstcap
+static int lz_write_sequence(unsigned char * out, int op, int dstcap,
+                             const unsigned char * literals, int litlen, int offset, int matchlen)
+{
+    int litfield = litlen < 15 ? litlen : 15;
+    int matchfield = 0;
+    if(matchlen > 0)
+    {
+        matchfield = matchlen - LZ_MIN_MATCH < 15 ? matchlen - LZ_MIN_MATCH : 15;
+    }
+
+    if(op >= dstcap)
+    {
+        return -1;
+    }
+    out[op++] = (litfield << 4) | matchfield;
+
+    if(litfield == 15)
+    {
+        op = lz_write_length(out, op, dstcap, litlen - 15);
+        if(op < 0)
+        {
+            return -1;
+        }
+    }
+
+    if(op + litlen > dstcap)
+    {
+        return -1;
+    }
+    memcpy(out + op, literals, litlen);
+    op = op + litlen;
+
+    if(matchlen > 0)
+    {
+        if(op + 2 > dstcap)
+        {
+            return -1;
+        }
+        out[op++] = offset & 0xFF;
+        out[op++] = offset >> 8;
+
+        if(matchfield == 15)
+        {
+            op = lz_write_length(out, op, dstcap, matchlen - LZ_MIN_MATCH - 15);
+        }
+    }
+
+    return op;
+}
+
+int lz_compress(const char * src, int srclen, char * dst, int dstcap)
+{
+    const unsigned char * in = (const unsigned char *) src;
+    unsigned char * out = (unsigned char *) dst;
+    int table[1 << LZ_HASH_BITS];
+
+    for(int i = 0; i < (1 << LZ_HASH_BITS); i++)
+    {
+        table[i] = -1;
+    }
+
+    int ip = 0;
+    int op = 0;
+    // Start of the literals not yet written
+    int anchor = 0;
+
+    while(ip + LZ_MIN_MATCH <= srclen)
+    {
+        unsigned int h = lz_hash(in + ip);
+        int ref = table[h];
+        table[h] = ip;
+
+        if(ref >= 0 && ip - ref <= LZ_MAX_OFFSET && memcmp(in + ref, in + ip, LZ_MIN_MATCH) == 0)
+        {
+            // Extend the match as far as it goes
+            int matchlen = LZ_MIN_MATCH;
+            while(ip + matchlen < srclen && in[ref + matchlen] == in[ip + matchlen])
+            {
+                matchlen++;
+            }
+
+            op = lz_write_sequence(out, op, dstcap, in + anchor, ip - anchor, ip - ref, matchlen);
+            if(op < 0)
+            {
+                return -1;
+            }
+
+            ip = ip + matchlen;
+            anchor = ip;
+
+            // Remember a position near the end of the match so runs keep matching
+            if(ip - 2 >= 0 && ip + 2 <= srclen)
+            {
+                table[lz_hash(in + ip - 2)] = ip - 2;
+            }
+        }
+        else
+        {
+            ip++;
+        }
+    }
+
+    // Remaining bytes go in the last sequence
+    return lz_write_sequence(out, op, dstcap, in + anchor, srclen - anchor, 0, 0);
+}
+
+int lz_decompress(const char * src, int srclen, char * dst, int dstcap)
+{
+    const unsigned char * in = (const unsigned char *) src;
+    unsigned char * out = (unsigned char *) dst;
+    int ip = 0;
+    int op = 0;
+
+    while(ip < srclen)
+    {
+        int token = in[ip++];
+
+        /*----------*/
+        /* Literals */
+        /*----------*/
+        int litlen = token >> 4;
+        if(litlen == 15)
+        {
+            int b;
+            do
+            {
+                if(ip >= srclen)
+                {
+                    return -1;
+                }
+                b = in[ip++];
+                litlen = litlen + b;
+            } while(b == 255);
+        }
+
+        if(ip + litlen > srclen || op + litlen > dstcap)
+        {
+            return -1;
+        }
+        memcpy(out + op, in + ip, litlen);
+        ip = ip + litlen;
+        op = op + litlen;
+
+        // The last sequence has no match
+        if(ip == srclen)
+        {
+            break;
+        }
+
+        /*-------*/
+        /* Match */
+        /*-------*/
+        if(ip + 2 > srclen)
+        {
+            return -1;
+        }
+        int offset = in[ip] | (in[ip + 1] << 8);
+        ip = ip + 2;
+
+        int matchlen = (token & 15) + LZ_MIN_MATCH;
+        if((token & 15) == 15)
+        {
+            int b;
+            do
+            {
+                if(ip >= srclen)
+                {
+                    return -1;
+                }
+                b = in[ip++];
+                matchlen = matchlen + b;
+            } while(b == 255);
+        }
+
+        if(offset == 0 || offset > op || op + matchlen > dstcap)
+        {
+            return -1;
+        }
+
+        if(offset >= matchlen)
+        {
+            memcpy(out + op, out + op - offset, matchlen);
+        }
+        else
+        {
+            // The match overlaps the bytes it produces (repeated pattern)
+            for(int i = 0; i < matchlen; i++)
+            {
+                out[op + i] = out[op - offset + i];
+            }
+        }
+        op = op + matchlen;
+    }
+
+    return op;
+}
@@ -0,0 +1,21 @@
+#ifndef SFS_LZ_H
+#define SFS_LZ_H
+
+// Fast LZ77 codec used to compress file clusters
+// The format is a sequence of (literals, match) pairs:
+//   token        1 byte, high 4 bits literal length, low 4 bits match length - 4
+//   literal len  extra bytes of 255 while the previous one is 255 (only if the token field is 15)
+//   literals
+//   offset       2 bytes little endian, distance back to the match (absent in the last sequence)
+//   match len    extra bytes of 255 while the previous one is 255 (only if the token field is 15)
+// The last sequence only holds literals
+
+// Compress srclen bytes of src in dst
+// Return the compressed length, -1 if it does not fit in dstcap bytes
+int lz_compress(const char * src, int srclen, char * dst, int dstcap);
+
+// Decompress srclen bytes of src in dst
+// Return the decompressed length, -1 if the data is corrupted or does not fit in dstcap bytes
+int lz_decompress(const char * src, int srclen, char * dst, int dstcap);
+
+#endif
@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+
+void usage()
+{
+    printf("Usage: sfs_mkimage [-j threads] image directory\n");
+    printf("  -j  threads reading the files (default: one per processor)\n");
+}
+
+int main(int argc, char ** argv)
+{
+    int num_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    const char * path = NULL;
+    const char * hostdir = NULL;
+
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        {
+            num_threads = atoi(argv[++i]);
+        }
+        else if(argv[i][0] != '-' && path == NULL)
+        {
+            path = argv[i];
+        }
+        else if(argv[i][0] != '-' && hostdir == NULL)
+        {
+            hostdir = argv[i];
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if(path == NULL || hostdir == NULL)
+    {
+        usage();
+        return 1;
+    }
+
+    int r = sfs_mkimage(path, hostdir, num_threads);
+    if(r < 0)
+    {
+        printf("%s: could not build the image\n", path);
+        return 1;
+    }
+
+    printf("%s: %d files and directories packed from %s\n", path, r, hostdir);
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "sfs_pool.h"
+
+// Buffers a thread keeps, more than any operation holds at the same time
+// Buffers given back past this are freed
+#define POOL_MAX_FREE 32
+
+typedef struct THREAD_POOL
+{
+    void * buffers[POOL_MAX_FREE];
+    int count;
+} thread_pool;
+
+// Pool of the calling thread, NULL until its first buffer is given back
+static __thread thread_pool * pool = NULL;
+
+// Frees the pool of a thread when it exits
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+/* Free the buffers of the pool of an exiting thread */
+static void pool_destroy(void * arg)
+{
+    thread_pool * p = (thread_pool *) arg;
+    for(int i = 0; i < p->count; i++)
+    {
+        free(p->buffers[i]);
+    }
+    free(p);
+}
+
+static void pool_create_key(void)
+{
+    pthread_key_create(&pool_key, pool_destroy);
+}
+
+void * pool_get_buffer()
+{
+    if(pool != NULL && pool->count > 0)
+    {
+        pool->count--;
+        return pool->buffers[pool->count];
+    }
+
+    void * buffer = NULL;
+    if(posix_memalign(&buffer, POOL_BUFFER_ALIGN, POOL_BUFFER_LEN) != 0)
+    {
+        return NULL;
+    }
+    return buffer;
+}
+
+void pool_put_buffer(void * buffer)
+{
+    if(buffer == NULL)
+    {
+        return;
+    }
+
+    if(pool == NULL)
+    {
+        pthread_once(&pool_key_once, pool_create_key);
+        pool = (thread_pool *) calloc(1, sizeof(thread_pool));
+        pthread_setspecific(pool_key, pool);
+    }
+
+    if(pool->count == POOL_MAX_FREE)
+    {
+        free(buffer);
+        return;
+    }
+    pool->buffers[pool->count++] = buffer;
+}
@@ -0,0 +1,23 @@
+#ifndef SFS_POOL_H
+#define SFS_POOL_H
+
+#include "sfs_api.h"
+
+// Scratch buffers reused by every operation of a thread
+// Each thread keeps the buffers it gave back in its own pool: taking or giving back a buffer
+// never takes a lock, and never calls the allocator once the thread has as many buffers as
+// it ever used at the same time. The pool of a thread is freed when the thread exits.
+
+// Every buffer holds a cluster of blocks, a single block fits too
+#define POOL_BUFFER_LEN (CLUSTER_BLOCKS * BLOCK_SIZE)
+// Buffers start on a page boundary
+#define POOL_BUFFER_ALIGN 4096
+
+// Return a buffer of POOL_BUFFER_LEN bytes, its content is undefined
+void * pool_get_buffer();
+
+// Give a buffer back to the pool of the calling thread, NULL is ignored
+// A buffer can be given back by a thread other than the one that took it
+void pool_put_buffer(void * buffer);
+
+#endif